@@ -0,0 +1,87 @@
+#ifndef ALLOC_COUNTER_HPP
+#define ALLOC_COUNTER_HPP
+
+// Counts every call of the global operator new (all its forms), to check that the hot path does not allocate.
+// It replaces the whole family of global operator new/delete, so include it from exactly one translation unit.
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cstdint>
+#include <cstddef>
+#include <cstdlib>
+#include <new>
+
+namespace AllocCounter
+{
+    // one counter per thread (the last slot is shared once they run out), summed on demand
+    struct alignas(64) Slot
+    {
+        std::atomic<std::uint64_t> count{0};
+    };
+    inline std::array<Slot,256> slots;
+    inline std::atomic<std::size_t> next_slot{0};
+
+    inline Slot& local()
+    {
+        thread_local Slot* slot = &slots[std::min(next_slot.fetch_add(1), slots.size()-1)];
+        return *slot;
+    }
+
+    inline std::uint64_t total()
+    {
+        std::uint64_t sum = 0;
+        for(auto& s:slots)sum += s.count.load(std::memory_order_relaxed);
+        return sum;
+    }
+}
+
+namespace AllocCounter
+{
+    // Every replaced operator goes through these two. They are kept out of line so that
+    // the compiler does not pair the malloc/free inside them with the new/delete at call
+    // sites and report them as mismatched.
+    [[gnu::noinline]] inline void* allocate(std::size_t n, std::size_t align) noexcept
+    {
+        local().count.fetch_add(1, std::memory_order_relaxed);
+        if(n == 0)n = 1;
+        if(align <= alignof(std::max_align_t))return std::malloc(n);
+        void* p = nullptr;
+        return ::posix_memalign(&p, align, n) == 0 ? p : nullptr;
+    }
+
+    [[gnu::noinline]] inline void release(void* p) noexcept
+    {
+        std::free(p);
+    }
+
+    inline void* allocate_or_throw(std::size_t n, std::size_t align)
+    {
+        if(void* p = allocate(n, align))return p;
+        throw std::bad_alloc();
+    }
+}
+
+void* operator new(std::size_t n) {return AllocCounter::allocate_or_throw(n, 0);}
+void* operator new[](std::size_t n) {return AllocCounter::allocate_or_throw(n, 0);}
+void* operator new(std::size_t n, std::align_val_t a) {return AllocCounter::allocate_or_throw(n, static_cast<std::size_t>(a));}
+void* operator new[](std::size_t n, std::align_val_t a) {return AllocCounter::allocate_or_throw(n, static_cast<std::size_t>(a));}
+void* operator new(std::size_t n, const std::nothrow_t&) noexcept {return AllocCounter::allocate(n, 0);}
+void* operator new[](std::size_t n, const std::nothrow_t&) noexcept {return AllocCounter::allocate(n, 0);}
+void* operator new(std::size_t n, std::align_val_t a, const std::nothrow_t&) noexcept {return AllocCounter::allocate(n, static_cast<std::size_t>(a));}
+void* operator new[](std::size_t n, std::align_val_t a, const std::nothrow_t&) noexcept {return AllocCounter::allocate(n, static_cast<std::size_t>(a));}
+
+void operator delete(void* p) noexcept {AllocCounter::release(p);}
+void operator delete[](void* p) noexcept {AllocCounter::release(p);}
+void operator delete(void* p, std::size_t) noexcept {AllocCounter::release(p);}
+void operator delete[](void* p, std::size_t) noexcept {AllocCounter::release(p);}
+void operator delete(void* p, std::align_val_t) noexcept {AllocCounter::release(p);}
+void operator delete[](void* p, std::align_val_t) noexcept {AllocCounter::release(p);}
+void operator delete(void* p, std::size_t, std::align_val_t) noexcept {AllocCounter::release(p);}
+void operator delete[](void* p, std::size_t, std::align_val_t) noexcept {AllocCounter::release(p);}
+void operator delete(void* p, const std::nothrow_t&) noexcept {AllocCounter::release(p);}
+void operator delete[](void* p, const std::nothrow_t&) noexcept {AllocCounter::release(p);}
+void operator delete(void* p, std::align_val_t, const std::nothrow_t&) noexcept {AllocCounter::release(p);}
+void operator delete[](void* p, std::align_val_t, const std::nothrow_t&) noexcept {AllocCounter::release(p);}
+
+#endif // ALLOC_COUNTER_HPP
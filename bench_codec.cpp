@@ -0,0 +1,162 @@
+#include <boost/asio.hpp>
+#include <cassert>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <iostream>
+#include <string>
+#include <vector>
+#include "protocol.h"
+#include "codec.hpp"
+#include "messages.hpp"
+
+// Microbenchmark of the wire encoding: the generated codecs against the helpers they replaced
+// (kept below as they were), on headers, on message bodies and on arrays of numbers.
+// Every buffer starts one byte off alignment, as fields inside a message do.
+
+using namespace boost;
+
+namespace Legacy
+{
+    template <typename T>
+    void to_network(const T& x, char* begin)
+    {
+        auto szT = sizeof(T);
+        assert(szT==1 or szT==2 or szT==4);
+
+        T* p = reinterpret_cast<T*>(begin);
+        *p = x;
+
+        if(szT==2)*p = static_cast<T>( asio::detail::socket_ops::host_to_network_short(x) );
+        else *p = static_cast<T>( asio::detail::socket_ops::host_to_network_long(x) );
+    }
+
+    template <typename T>
+    T from_network(const char* begin)
+    {
+        auto szT = sizeof(T);
+        assert(szT==1 or szT==2 or szT==4);
+
+        T x = (*reinterpret_cast<const T*>(begin));
+        if(szT==2)return static_cast<T>( asio::detail::socket_ops::network_to_host_short(x) );
+        else return static_cast<T>( asio::detail::socket_ops::network_to_host_long(x) );
+    }
+}
+
+using header_t = Protocol::Message::Client_to_Server::header_t;
+
+static std::uint64_t NowNs()
+{
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// ns per iteration of f(i), which returns something to keep the work alive
+template <typename F>
+double Measure(std::size_t iterations, F f)
+{
+    std::uint64_t sink = 0;
+    std::uint64_t begin = NowNs();
+    for(std::size_t i=0;i<iterations;i++)sink += f(i);
+    std::uint64_t end = NowNs();
+    asm volatile("" : : "r"(sink) : "memory");
+    return double(end-begin)/iterations;
+}
+
+int main(int argc, char* argv[])
+{
+    std::size_t iterations = argc > 1 ? std::stoull(argv[1]) : 20000000;
+    const std::size_t array_length = 1024;
+    std::vector<char> storage(64 + array_length*sizeof(std::uint32_t) + 1);
+    char* buf = storage.data()+1;
+    std::vector<std::uint32_t> values(array_length), decoded(array_length);
+    for(std::size_t i=0;i<array_length;i++)values[i] = static_cast<std::uint32_t>(i*2654435761u);
+
+    struct Result {const char* name; double legacy, codec;};
+    std::vector<Result> results;
+
+    results.push_back({"header_encode",
+        Measure(iterations, [&](std::size_t i)
+        {
+            Legacy::to_network(header_t::text, buf);
+            Legacy::to_network(static_cast<std::uint32_t>(i), buf+sizeof(std::uint32_t));
+            return static_cast<unsigned char>(buf[7]);
+        }),
+        Measure(iterations, [&](std::size_t i)
+        {
+            Codec::encode(header_t{header_t::text, static_cast<std::uint32_t>(i)}, buf);
+            return static_cast<unsigned char>(buf[7]);
+        })});
+
+    // decoded from a ring of prepared headers
+    const std::size_t ring = 256;
+    std::vector<char> headers_storage(ring*Messages::header_length + 1);
+    char* headers = headers_storage.data()+1;
+    for(std::size_t k=0;k<ring;k++)
+        Codec::encode(header_t{header_t::text, static_cast<std::uint32_t>(k)}, headers+k*Messages::header_length);
+    results.push_back({"header_decode",
+        Measure(iterations, [&](std::size_t i)
+        {
+            const char* p = headers + (i%ring)*Messages::header_length;
+            auto type = Legacy::from_network<header_t::type_t>(p);
+            auto body_len = Legacy::from_network<std::uint32_t>(p+sizeof(type));
+            return type + body_len;
+        }),
+        Measure(iterations, [&](std::size_t i)
+        {
+            header_t header;
+            Codec::decode(headers + (i%ring)*Messages::header_length, Messages::header_length, header);
+            return header.type + header.body_len;
+        })});
+
+    // a whole list request: header and three numbers
+    results.push_back({"list_encode",
+        Measure(iterations, [&](std::size_t i)
+        {
+            Legacy::to_network(header_t::list, buf);
+            Legacy::to_network(static_cast<std::uint32_t>(12), buf+4);
+            Legacy::to_network(static_cast<std::uint32_t>(Protocol::Message::list_rooms), buf+8);
+            Legacy::to_network(static_cast<std::uint32_t>(i), buf+12);
+            Legacy::to_network(static_cast<std::uint32_t>(20), buf+16);
+            return static_cast<unsigned char>(buf[15]);
+        }),
+        Measure(iterations, [&](std::size_t i)
+        {
+            Messages::Encode(1, Messages::List{Protocol::Message::list_rooms, static_cast<std::uint32_t>(i), 20}, buf);
+            return static_cast<unsigned char>(buf[15]);
+        })});
+
+    std::size_t rounds = std::max<std::size_t>(1, iterations/array_length);
+    results.push_back({"array_encode_per_value",
+        Measure(rounds, [&](std::size_t i)
+        {
+            values[0] = static_cast<std::uint32_t>(i);
+            for(std::size_t k=0;k<array_length;k++)Legacy::to_network(values[k], buf+k*sizeof(std::uint32_t));
+            return static_cast<unsigned char>(buf[3]);
+        })/array_length,
+        Measure(rounds, [&](std::size_t i)
+        {
+            values[0] = static_cast<std::uint32_t>(i);
+            Codec::store_array(buf, values.data(), array_length);
+            return static_cast<unsigned char>(buf[3]);
+        })/array_length});
+
+    results.push_back({"array_decode_per_value",
+        Measure(rounds, [&](std::size_t i)
+        {
+            buf[3] = static_cast<char>(i);
+            for(std::size_t k=0;k<array_length;k++)decoded[k] = Legacy::from_network<std::uint32_t>(buf+k*sizeof(std::uint32_t));
+            return decoded[0] + decoded[array_length-1];
+        })/array_length,
+        Measure(rounds, [&](std::size_t i)
+        {
+            buf[3] = static_cast<char>(i);
+            Codec::load_array(buf, decoded.data(), array_length);
+            return decoded[0] + decoded[array_length-1];
+        })/array_length});
+
+    std::cout << "{\"iterations\":" << iterations;
+    for(auto& r:results)
+        std::cout << ",\"" << r.name << "\":{\"legacy_ns\":" << r.legacy << ",\"codec_ns\":" << r.codec << "}";
+    std::cout << "}" << std::endl;
+    return 0;
+}
@@ -0,0 +1,557 @@
+#include <boost/asio.hpp>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+#include <dirent.h>
+#include <sys/resource.h>
+#include <linux/perf_event.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include "protocol.h"
+#include "tools.hpp"
+#include "wire.hpp"
+#include "io_shard.hpp"
+#include "recv_ring.hpp"
+
+// Headless load generator: opens many connections to a running server, puts them into rooms,
+// lets some of them chat at a fixed rate and measures how long every delivery took.
+// Send timestamps travel inside the text, so latency is measured end to end on one clock.
+
+using namespace boost;
+using command_t = Protocol::Message::Client_to_Server::header_t::type_t;
+using reply_t = Protocol::Message::Server_to_Client::header_t;
+
+struct BenchOptions
+{
+    std::string host = Protocol::server_ip;
+    int port = Protocol::server_port;
+    unsigned connections = 1000;
+    unsigned rooms = 10;        // members (fan-out) per room = connections/rooms
+    unsigned senders = 100;     // connections that send text, spread over the rooms
+    double rate = 10;           // messages per second per sender
+    double warmup = 1;          // seconds sent but not measured
+    double duration = 10;       // seconds measured
+    unsigned threads = 1;
+    unsigned text_length = 64;  // bytes of text per message
+    unsigned protocol = Protocol::Version;  // 1 does without hello
+    int server_pid = 0;         // counts the system calls of this process while measuring, 0 does not
+    unsigned idle = 0;          // connections opened first that only say hello and their name
+    std::string tracefs = "/sys/kernel/tracing";
+};
+
+static std::uint64_t NowNs()
+{
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// per shard, only touched by the shard's thread until it is stopped
+struct ShardStats
+{
+    std::vector<std::uint64_t> latencies;
+    std::unordered_map<std::uint64_t, std::pair<std::uint64_t,std::uint64_t>> arrivals;  // first and last delivery, by send time
+    std::uint64_t sent = 0, bytes_received = 0;
+};
+
+// Counts the system calls of another process through the raw_syscalls:sys_enter tracepoint,
+// with a perf counter on each of its threads. Needs tracefs mounted and the right to trace the process.
+class SyscallCounter
+{
+    private:
+    std::vector<int> fds;
+
+    public:
+    bool open(int pid, const std::string& tracefs)
+    {
+        std::ifstream id_file(tracefs + "/events/raw_syscalls/sys_enter/id");
+        std::uint64_t id;
+        if(!(id_file >> id))return false;
+        std::string tasks = "/proc/" + std::to_string(pid) + "/task";
+        DIR* dir = ::opendir(tasks.c_str());
+        if(!dir)return false;
+        while(dirent* e = ::readdir(dir))
+        {
+            if(e->d_name[0] == '.')continue;
+            perf_event_attr attr;
+            std::memset(&attr, 0, sizeof(attr));
+            attr.type = PERF_TYPE_TRACEPOINT;
+            attr.size = sizeof(attr);
+            attr.config = id;
+            int fd = static_cast<int>(::syscall(SYS_perf_event_open, &attr, std::atoi(e->d_name), -1, -1, 0));
+            if(fd >= 0)fds.push_back(fd);
+        }
+        ::closedir(dir);
+        return !fds.empty();
+    }
+
+    // since open
+    std::uint64_t count() const
+    {
+        std::uint64_t total = 0;
+        for(int fd:fds)
+        {
+            std::uint64_t n = 0;
+            if(::read(fd, &n, sizeof(n)) == sizeof(n))total += n;
+        }
+        return total;
+    }
+
+    ~SyscallCounter(){for(int fd:fds)::close(fd);}
+};
+
+class Bench;
+
+class BenchConn : public std::enable_shared_from_this<BenchConn>
+{
+    private:
+    Bench& bench;
+    unsigned index, room_index;
+    IoShard& shard;
+    ShardStats& stats;
+    asio::ip::tcp::socket sock;
+    asio::steady_timer send_timer;
+    RecvRing inbox;
+    std::string pending, writing_buf;
+    bool writing = false;
+    std::string padding;
+    double rate = 0;
+    std::uint32_t protocol = 1;     // until the answer to hello
+
+    void RegisterRead();
+    void ReceiveHandler(const boost::system::error_code& eno, std::size_t len);
+    void HandleFrame(const reply_t& header, const char* body);
+    void Ready();
+    void RegisterTick(std::chrono::nanoseconds delay);
+    void Flush();
+
+    public:
+    // args is whatever Wire::Encode takes: a type and its body, or a message
+    template <typename... Args>
+    void Send(const Args&... args)
+    {
+        std::array<char,Wire::max_request_length> buf;
+        pending.append(buf.data(), Wire::Encode(protocol, buf.data(), args...));
+        if(!writing)Flush();
+    }
+
+    void Connect(const asio::ip::tcp::endpoint& ep, unsigned version);
+    void Join(Protocol::id_t roomid){Send(Messages::Enter{roomid});}
+    void StartSending(double rate);
+    void Stop(){sock.close();}
+    unsigned getroomindex(){return room_index;}
+    asio::io_context& context(){return shard.context();}
+
+    BenchConn(Bench& b, unsigned idx, unsigned room, IoShard& home, ShardStats& st, unsigned text_length):
+        bench(b), index(idx), room_index(room), shard(home), stats(st),
+        sock(home.context()), send_timer(home.context()), padding(text_length, 'x')
+    {}
+};
+
+class Bench
+{
+    private:
+    BenchOptions options;
+    std::vector<std::unique_ptr<IoShard>> shards;
+    std::vector<ShardStats> stats;
+    std::vector<std::shared_ptr<BenchConn>> conns, idle_conns;
+    SyscallCounter syscalls;
+    std::uint64_t server_syscalls = 0;
+    bool counting = false;
+    double idle_bytes = -1;     // server memory per idle connection, < 0: not measured
+
+    // resident bytes of a process, 0 if it cannot be read
+    static std::size_t ResidentBytes(int pid)
+    {
+        std::ifstream statm("/proc/" + std::to_string(pid) + "/statm");
+        std::size_t size = 0, resident = 0;
+        if(!(statm >> size >> resident))return 0;
+        return resident * ::sysconf(_SC_PAGESIZE);
+    }
+
+    // Opens the idle connections and measures how much the server grew for them.
+    bool OpenIdle(const asio::ip::tcp::endpoint& ep)
+    {
+        std::size_t before = options.server_pid ? ResidentBytes(options.server_pid) : 0;
+        for(unsigned i=0;i<options.idle;i++)
+        {
+            unsigned s = i%shards.size();
+            idle_conns.push_back(std::make_shared<BenchConn>(*this, options.connections+i, 0, *shards[s], stats[s], options.text_length));
+            unsigned version = options.protocol;
+            OnConn(idle_conns.back(), [ep,version](BenchConn& c){c.Connect(ep, version);});
+        }
+        if(!WaitFor([&]{return connected+errors == options.idle;}, 60) || errors)
+        {
+            std::cerr << "connected " << connected << " of " << options.idle << " idle connections" << std::endl;
+            return false;
+        }
+        // let the server handle the names
+        std::this_thread::sleep_for(std::chrono::milliseconds(500));
+        std::size_t after = options.server_pid ? ResidentBytes(options.server_pid) : 0;
+        if(before && after)idle_bytes = (double(after)-double(before))/options.idle;
+        connected = 0;
+        return true;
+    }
+
+    template <typename Pred>
+    bool WaitFor(Pred pred, double seconds)
+    {
+        auto deadline = std::chrono::steady_clock::now() + std::chrono::duration<double>(seconds);
+        while(!pred())
+        {
+            if(std::chrono::steady_clock::now() > deadline)return false;
+            std::this_thread::sleep_for(std::chrono::milliseconds(10));
+        }
+        return true;
+    }
+
+    // runs f on the connection's own shard
+    template <typename F>
+    void OnConn(const std::shared_ptr<BenchConn>& c, F f)
+    {
+        asio::post(c->context(), [c,f]{f(*c);});
+    }
+
+    static std::uint64_t Percentile(const std::vector<std::uint64_t>& sorted, double p)
+    {
+        if(sorted.empty())return 0;
+        std::size_t i = std::min(sorted.size()-1, static_cast<std::size_t>(p*sorted.size()));
+        return sorted[i];
+    }
+
+    public:
+    std::atomic<unsigned> connected{0}, joined{0}, errors{0};
+    std::vector<std::atomic<Protocol::id_t>> room_ids;
+    // messages sent inside [measure_begin, measure_end) are the ones measured
+    std::atomic<std::uint64_t> measure_begin{~0ull}, measure_end{~0ull};
+
+    int Run()
+    {
+        for(unsigned i=0;i<shards.size();i++)shards[i]->start();
+        asio::ip::tcp::endpoint ep(asio::ip::address::from_string(options.host), options.port);
+        if(options.idle && !OpenIdle(ep))return Finish(1);
+
+        unsigned per_room = std::max(1u, options.connections/options.rooms);
+        for(unsigned i=0;i<options.connections;i++)
+        {
+            unsigned s = i%shards.size();
+            conns.push_back(std::make_shared<BenchConn>(*this, i, std::min(i/per_room, options.rooms-1), *shards[s], stats[s], options.text_length));
+            unsigned version = options.protocol;
+            OnConn(conns.back(), [ep,version](BenchConn& c){c.Connect(ep, version);});
+        }
+        if(!WaitFor([&]{return connected+errors == options.connections;}, 30) || errors)
+        {
+            std::cerr << "connected " << connected << " of " << options.connections << std::endl;
+            return Finish(1);
+        }
+
+        // the first member of every room creates it, the others enter once its id is known
+        for(unsigned r=0;r<options.rooms;r++)
+            OnConn(conns[r*per_room], [](BenchConn& c){c.Send(command_t::newroom);});
+        if(!WaitFor([&]{return std::all_of(room_ids.begin(), room_ids.end(), [](auto& id){return id.load()!=0;});}, 30))
+        {
+            std::cerr << "rooms were not created" << std::endl;
+            return Finish(1);
+        }
+        for(unsigned i=0;i<conns.size();i++)
+        {
+            if(i%per_room == 0 && i/per_room < options.rooms)continue;
+            Protocol::id_t roomid = room_ids[conns[i]->getroomindex()];
+            OnConn(conns[i], [roomid](BenchConn& c){c.Join(roomid);});
+        }
+        if(!WaitFor([&]{return joined == options.connections;}, 30))
+        {
+            std::cerr << "joined " << joined << " of " << options.connections << std::endl;
+            return Finish(1);
+        }
+
+        // senders are spread evenly over the rooms
+        unsigned senders = std::min(options.senders, options.connections);
+        for(unsigned k=0;k<senders;k++)
+        {
+            unsigned room = k%options.rooms, nth = k/options.rooms;
+            unsigned i = std::min(room*per_room+nth, options.connections-1);
+            double rate = options.rate;
+            OnConn(conns[i], [rate](BenchConn& c){c.StartSending(rate);});
+        }
+        std::this_thread::sleep_for(std::chrono::duration<double>(options.warmup));
+        if(options.server_pid)
+        {
+            counting = syscalls.open(options.server_pid, options.tracefs);
+            if(!counting)std::cerr << "cannot count the system calls of " << options.server_pid << std::endl;
+        }
+        measure_begin = NowNs();
+        std::this_thread::sleep_for(std::chrono::duration<double>(options.duration));
+        measure_end = NowNs();
+        if(counting)server_syscalls = syscalls.count();
+        // let the last measured messages arrive
+        std::this_thread::sleep_for(std::chrono::seconds(1));
+        return Finish(0);
+    }
+
+    int Finish(int status)
+    {
+        for(auto& c:conns)OnConn(c, [](BenchConn& c){c.Stop();});
+        for(auto& c:idle_conns)OnConn(c, [](BenchConn& c){c.Stop();});
+        for(auto& s:shards)s->stop();
+        if(status)return status;
+
+        std::vector<std::uint64_t> latencies;
+        std::unordered_map<std::uint64_t, std::pair<std::uint64_t,std::uint64_t>> arrivals;
+        std::uint64_t sent = 0, bytes = 0;
+        for(auto& s:stats)
+        {
+            latencies.insert(latencies.end(), s.latencies.begin(), s.latencies.end());
+            for(auto& a:s.arrivals)
+            {
+                auto& b = arrivals.try_emplace(a.first, a.second).first->second;
+                b.first = std::min(b.first, a.second.first);
+                b.second = std::max(b.second, a.second.second);
+            }
+            sent += s.sent;
+            bytes += s.bytes_received;
+        }
+        std::sort(latencies.begin(), latencies.end());
+        // from the first member a message reached to the last one
+        std::vector<std::uint64_t> spreads;
+        for(auto& a:arrivals)spreads.push_back(a.second.second-a.second.first);
+        std::sort(spreads.begin(), spreads.end());
+
+        unsigned per_room = std::max(1u, options.connections/options.rooms);
+        double seconds = (measure_end-measure_begin)/1e9;
+        std::cout << "{\"protocol\":" << options.protocol
+            << ",\"connections\":" << options.connections
+            << ",\"rooms\":" << options.rooms
+            << ",\"fanout\":" << per_room
+            << ",\"senders\":" << std::min(options.senders, options.connections)
+            << ",\"rate_per_sender\":" << options.rate
+            << ",\"duration_s\":" << seconds
+            << ",\"sent\":" << sent
+            << ",\"delivered\":" << latencies.size()
+            << ",\"sent_per_s\":" << sent/seconds
+            << ",\"delivered_per_s\":" << latencies.size()/seconds
+            << ",\"received_bytes\":" << bytes;
+        // per message handled: the ones sent are read by the server, the deliveries written
+        if(options.idle)std::cout << ",\"idle_connections\":" << options.idle;
+        if(idle_bytes >= 0)std::cout << ",\"idle_bytes_per_connection\":" << idle_bytes;
+        if(counting)
+            std::cout << ",\"server_syscalls\":" << server_syscalls
+                << ",\"syscalls_per_message\":" << double(server_syscalls)/std::max<std::size_t>(1, sent+latencies.size());
+        std::cout
+            << ",\"latency_us\":{\"p50\":" << Percentile(latencies,0.5)/1e3
+            << ",\"p99\":" << Percentile(latencies,0.99)/1e3
+            << ",\"p999\":" << Percentile(latencies,0.999)/1e3
+            << ",\"max\":" << (latencies.empty() ? 0 : latencies.back())/1e3
+            << "},\"spread_us\":{\"p50\":" << Percentile(spreads,0.5)/1e3
+            << ",\"p99\":" << Percentile(spreads,0.99)/1e3
+            << ",\"max\":" << (spreads.empty() ? 0 : spreads.back())/1e3
+            << "}}" << std::endl;
+        return 0;
+    }
+
+    Bench(const BenchOptions& opts):options(opts), stats(std::max(1u, opts.threads)), room_ids(std::max(1u, opts.rooms))
+    {
+        options.threads = std::max(1u, options.threads);
+        options.rooms = std::max(1u, std::min(options.rooms, options.connections));
+        for(unsigned i=0;i<options.threads;i++)shards.emplace_back(new IoShard);
+    }
+};
+
+// a v2 connection only counts as connected once the server answered its hello
+void BenchConn::Connect(const asio::ip::tcp::endpoint& ep, unsigned version)
+{
+    auto self = shared_from_this();
+    sock.async_connect(ep, [this,self,version](const boost::system::error_code& eno)
+    {
+        if(eno)
+        {
+            bench.errors++;
+            return;
+        }
+        sock.set_option(asio::ip::tcp::no_delay(true));
+        if(version > 1)
+        {
+            std::array<char,Wire::max_request_length> buf;
+            pending.append(buf.data(), Wire::Encode(1, buf.data(), Messages::Hello{version, Protocol::cap_batch}));
+            Flush();
+        }
+        else Ready();
+        RegisterRead();
+    });
+}
+
+void BenchConn::Ready()
+{
+    bench.connected++;
+    Send(command_t::rename, "bench" + std::to_string(index));
+}
+
+void BenchConn::RegisterRead()
+{
+    auto self = shared_from_this();
+    sock.async_read_some(inbox.prepare(), [this,self](const boost::system::error_code& eno, std::size_t len){ReceiveHandler(eno,len);});
+}
+
+void BenchConn::ReceiveHandler(const boost::system::error_code& eno, std::size_t len)
+{
+    if(eno)return;
+    stats.bytes_received += len;
+    inbox.commit(len);
+    std::array<char,Protocol::BatchMaxLength> wrapped;
+    while(true)
+    {
+        std::array<char,Wire::max_header_length_v2> header_buf;
+        std::size_t n = std::min(inbox.size(), header_buf.size());
+        inbox.copy(header_buf.data(), 0, n);
+        reply_t header;
+        int header_length = Wire::DecodeHeader(protocol, header_buf.data(), n, header);
+        if(header_length == 0)break;
+        if(header_length < 0 || header.body_len > Wire::MaxBodyLength(header))return;
+        if(inbox.size() < header_length+header.body_len)break;
+        const char* body = inbox.contiguous(header_length, header.body_len);
+        if(!body)
+        {
+            inbox.copy(wrapped.data(), header_length, header.body_len);
+            body = wrapped.data();
+        }
+        HandleFrame(header, body);
+        inbox.consume(header_length+header.body_len);
+    }
+    RegisterRead();
+}
+
+void BenchConn::HandleFrame(const reply_t& header, const char* body)
+{
+    std::size_t len = header.body_len;
+    Messages::RoomChange change;
+    if(header.type == reply_t::roomchange && Wire::Read(protocol, body, len, change))
+    {
+        Protocol::id_t roomid = change.room, none = 0;
+        // the creator publishes the room, everybody counts as joined once the server confirms
+        if(roomid && (bench.room_ids[room_index].compare_exchange_strong(none, roomid) || none == roomid))
+            bench.joined++;
+    }
+    else if(header.type == reply_t::print)
+    {
+        std::uint64_t now = NowNs();
+        const char* tag = static_cast<const char*>(memmem(body, header.body_len, " say: bench ", 12));
+        if(!tag)return;
+        std::uint64_t sent_at = std::strtoull(tag+12, nullptr, 10);
+        if(sent_at >= bench.measure_begin && sent_at < bench.measure_end)
+        {
+            stats.latencies.push_back(now-sent_at);
+            auto& a = stats.arrivals.try_emplace(sent_at, now, now).first->second;
+            a.first = std::min(a.first, now);
+            a.second = std::max(a.second, now);
+        }
+    }
+    else if(header.type == reply_t::hello)
+    {
+        Messages::HelloReply hello;
+        if(!Wire::Read(1, body, len, hello))return;
+        protocol = hello.version;
+        Ready();
+    }
+    else if(header.type == reply_t::batch)
+        Wire::ForEachInBatch(body, len, [this](const reply_t& h, const char* b){HandleFrame(h, b);});
+}
+
+void BenchConn::StartSending(double per_second)
+{
+    rate = per_second;
+    auto period = std::chrono::nanoseconds(static_cast<std::int64_t>(1e9/rate));
+    // spread the senders over the first period
+    RegisterTick(std::chrono::nanoseconds(std::rand()%std::max<std::int64_t>(1, period.count())));
+}
+
+void BenchConn::RegisterTick(std::chrono::nanoseconds delay)
+{
+    auto self = shared_from_this();
+    send_timer.expires_after(delay);
+    send_timer.async_wait([this,self](const boost::system::error_code& eno)
+    {
+        if(eno || !sock.is_open())return;
+        std::uint64_t now = NowNs();
+        if(now >= bench.measure_begin && now < bench.measure_end)stats.sent++;
+        Send(command_t::text, "bench " + std::to_string(now) + " " + padding);
+        RegisterTick(std::chrono::nanoseconds(static_cast<std::int64_t>(1e9/rate)));
+    });
+}
+
+void BenchConn::Flush()
+{
+    if(pending.empty())
+    {
+        writing = false;
+        return;
+    }
+    writing = true;
+    writing_buf.swap(pending);
+    pending.clear();
+    auto self = shared_from_this();
+    asio::async_write(sock, asio::buffer(writing_buf), [this,self](const boost::system::error_code& eno, std::size_t)
+    {
+        if(eno)
+        {
+            writing = false;
+            return;
+        }
+        Flush();
+    });
+}
+
+BenchOptions ParseOptions(int argc, char* argv[])
+{
+    BenchOptions opts;
+    for(int i=1;i<argc;i++)
+    {
+        std::string arg = argv[i];
+        auto eq = arg.find('=');
+        std::string key = arg.substr(0, eq), value = eq==std::string::npos ? "" : arg.substr(eq+1);
+        if(key=="--host")opts.host = value;
+        else if(key=="--port")opts.port = std::stoi(value);
+        else if(key=="--connections")opts.connections = std::stoul(value);
+        else if(key=="--rooms")opts.rooms = std::stoul(value);
+        else if(key=="--senders")opts.senders = std::stoul(value);
+        else if(key=="--rate")opts.rate = std::stod(value);
+        else if(key=="--warmup")opts.warmup = std::stod(value);
+        else if(key=="--duration")opts.duration = std::stod(value);
+        else if(key=="--threads")opts.threads = std::stoul(value);
+        else if(key=="--text-length")opts.text_length = std::stoul(value);
+        else if(key=="--server-pid")opts.server_pid = std::stoi(value);
+        else if(key=="--tracefs")opts.tracefs = value;
+        else if(key=="--idle")opts.idle = std::stoul(value);
+        else if(key=="--protocol")opts.protocol = std::max(1ul, std::min<unsigned long>(std::stoul(value), Protocol::Version));
+        else
+        {
+            std::cerr << "unknown option " << arg << "\n"
+                "options: --host= --port= --connections= --rooms= --senders= --rate= (per sender per second)\n"
+                "         --warmup= --duration= (seconds) --threads= --text-length= --protocol=\n"
+                "         --server-pid= (counts its system calls, measures its memory per idle connection) --tracefs=\n"
+                "         --idle= (connections that only connect, opened first)" << std::endl;
+            std::exit(2);
+        }
+    }
+    return opts;
+}
+
+int main(int argc, char* argv[])
+{
+    // a room of 50k members needs more descriptors than the usual soft limit
+    rlimit files;
+    if(::getrlimit(RLIMIT_NOFILE, &files) == 0 && files.rlim_cur < files.rlim_max)
+    {
+        files.rlim_cur = files.rlim_max;
+        ::setrlimit(RLIMIT_NOFILE, &files);
+    }
+    Bench bench(ParseOptions(argc,argv));
+    return bench.Run();
+}
@@ -0,0 +1,179 @@
+#ifndef BUFFER_POOL_HPP
+#define BUFFER_POOL_HPP
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <new>
+#include <type_traits>
+#include <utility>
+
+// Size-classed block pool with a free list per thread and class.
+// The hot path never locks: only when a thread's list overflows (it frees more than it allocates,
+// e.g. frames built on one shard and released on another) or runs dry is a whole batch of blocks
+// moved through a shared depot, so producer and consumer threads keep recycling the same blocks.
+// Blocks larger than the biggest class go straight to operator new.
+class BufferPool
+{
+    public:
+    static constexpr std::array<std::size_t,4> Classes = {64, 256, 1024, 4096};
+    static const std::size_t BatchSize = 256;
+    // blocks kept per thread and class before a batch goes to the depot
+    static const std::size_t MaxFree = 2*BatchSize;
+    // batches kept per class in the depot, the rest is given back to operator new
+    static const std::size_t MaxDepotBatches = 64;
+
+    private:
+    // next links the blocks of a list, next_batch links the batches in the depot
+    struct Node {Node* next; Node* next_batch;};
+
+    struct FreeList
+    {
+        Node* head = nullptr;
+        std::size_t length = 0;
+
+        ~FreeList()
+        {
+            release(head);
+        }
+    };
+
+    struct Depot
+    {
+        std::mutex mtx;
+        Node* batches = nullptr;
+        std::size_t count = 0;
+    };
+
+    static thread_local std::array<FreeList,Classes.size()> lists;
+    static std::array<Depot,Classes.size()> depots;
+
+    static std::size_t class_of(std::size_t n)
+    {
+        std::size_t c = 0;
+        while(c<Classes.size() && Classes[c]<n)c++;
+        return c;
+    }
+
+    static void release(Node* chain)
+    {
+        while(chain)
+        {
+            Node* n = chain;
+            chain = chain->next;
+            ::operator delete(n);
+        }
+    }
+
+    static bool refill(std::size_t c)
+    {
+        Depot& depot = depots[c];
+        std::lock_guard<std::mutex> lock(depot.mtx);
+        if(!depot.batches)return false;
+        lists[c].head = depot.batches;
+        lists[c].length = BatchSize;
+        depot.batches = depot.batches->next_batch;
+        depot.count--;
+        return true;
+    }
+
+    static void spill(std::size_t c)
+    {
+        FreeList& list = lists[c];
+        Node* batch = list.head;
+        Node* last = batch;
+        for(std::size_t i=1;i<BatchSize;i++)last = last->next;
+        list.head = last->next;
+        list.length -= BatchSize;
+        last->next = nullptr;
+
+        Depot& depot = depots[c];
+        {
+            std::lock_guard<std::mutex> lock(depot.mtx);
+            if(depot.count < MaxDepotBatches)
+            {
+                batch->next_batch = depot.batches;
+                depot.batches = batch;
+                depot.count++;
+                return;
+            }
+        }
+        release(batch);
+    }
+
+    public:
+    static void* allocate(std::size_t n)
+    {
+        std::size_t c = class_of(n);
+        if(c == Classes.size())return ::operator new(n);
+        FreeList& list = lists[c];
+        if(!list.head && !refill(c))return ::operator new(Classes[c]);
+        Node* node = list.head;
+        list.head = node->next;
+        list.length--;
+        return node;
+    }
+
+    static void deallocate(void* p, std::size_t n)
+    {
+        std::size_t c = class_of(n);
+        if(c == Classes.size())
+        {
+            ::operator delete(p);
+            return;
+        }
+        FreeList& list = lists[c];
+        Node* node = static_cast<Node*>(p);
+        node->next = list.head;
+        list.head = node;
+        if(++list.length >= MaxFree)spill(c);
+    }
+};
+
+inline thread_local std::array<BufferPool::FreeList,BufferPool::Classes.size()> BufferPool::lists;
+inline std::array<BufferPool::Depot,BufferPool::Classes.size()> BufferPool::depots;
+
+// std-style allocator on top of BufferPool: for containers, allocate_shared and asio handlers.
+template <typename T>
+class PoolAllocator
+{
+    public:
+    using value_type = T;
+
+    PoolAllocator() noexcept = default;
+    template <typename U> PoolAllocator(const PoolAllocator<U>&) noexcept {}
+
+    T* allocate(std::size_t n){return static_cast<T*>(BufferPool::allocate(n*sizeof(T)));}
+    void deallocate(T* p, std::size_t n){BufferPool::deallocate(p, n*sizeof(T));}
+
+    template <typename U> bool operator==(const PoolAllocator<U>&) const noexcept {return true;}
+    template <typename U> bool operator!=(const PoolAllocator<U>&) const noexcept {return false;}
+};
+
+// Wraps a completion handler so that asio allocates its operation state from the pool
+// (asio looks the allocator up through associated_allocator).
+template <typename Handler>
+class PooledHandler
+{
+    private:
+    Handler handler;
+
+    public:
+    using allocator_type = PoolAllocator<void>;
+    allocator_type get_allocator() const noexcept {return allocator_type();}
+
+    template <typename... Args>
+    void operator()(Args&&... args){handler(std::forward<Args>(args)...);}
+
+    explicit PooledHandler(Handler h):handler(std::move(h))
+    {}
+};
+
+template <typename Handler>
+PooledHandler<typename std::decay<Handler>::type> pooled(Handler&& h)
+{
+    return PooledHandler<typename std::decay<Handler>::type>(std::forward<Handler>(h));
+}
+
+#endif // BUFFER_POOL_HPP
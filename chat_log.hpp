@@ -0,0 +1,408 @@
+#ifndef CHAT_LOG_HPP
+#define CHAT_LOG_HPP
+
+#include <boost/asio.hpp>
+#include <boost/crc.hpp>
+#include <algorithm>
+#include <chrono>
+#include <cerrno>
+#include <condition_variable>
+#include <cstdint>
+#include <cstring>
+#include <filesystem>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <shared_mutex>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "protocol.h"
+#include "codec.hpp"
+#include "messages.hpp"
+#include "frame.hpp"
+#include "metrics.hpp"
+
+// Persistent chat history: an append-only log per room, split into fixed-size memory-mapped segments
+// (<dir>/room<id>/<sequence number of the first record>.log). A segment is a plain concatenation of
+// encoded print frames, so any run of records is sent to a client straight from the mapping.
+// Next to every segment, <first>.sum holds the CRC-32 of each of its records; on start, a segment
+// ends at the first record that does not match its checksum, such as one torn by a crash.
+// Segments written before there were checksums have no .sum: they are read as they are, and not appended to.
+// Records are numbered from 1 in each room.
+// io threads only queue frames. A writer thread copies them into the mappings and syncs them in groups,
+// once sync_bytes are pending or sync_interval after the first pending byte.
+class ChatLog
+{
+    public:
+    using id_t = Protocol::id_t;
+    using seq_t = std::uint64_t;
+
+    struct Options
+    {
+        std::string dir;
+        std::size_t segment_size = 4 << 20;
+        std::size_t sync_bytes = 1 << 20;
+        std::chrono::milliseconds sync_interval{50};
+        std::size_t max_pending = 1 << 16;  // queued frames; more are dropped rather than blocking an io thread
+    };
+
+    // a run of records: frames hold records [first, first+count), end is the next sequence number of the room
+    struct Slice
+    {
+        std::vector<FramePtr> frames;
+        seq_t first = 0, end = 0;
+        std::size_t count = 0;
+    };
+
+    private:
+    using header_t = Protocol::Message::Server_to_Client::header_t;
+    static constexpr std::size_t header_length = Codec::fixed_size<header_t>();
+
+    struct Segment
+    {
+        seq_t first_seq = 0;
+        int fd = -1;
+        char* base = nullptr;
+        std::size_t capacity = 0;
+        std::size_t used = 0;                   // guarded by ChatLog::mtx
+        std::vector<std::uint32_t> offsets;     // of every record, guarded by ChatLog::mtx
+        std::size_t synced = 0;                 // writer only
+        int sum_fd = -1;                        // the .sum file, -1 for a segment from before checksums
+
+        ~Segment()
+        {
+            if(base)munmap(base, capacity);
+            if(fd >= 0)::close(fd);
+            if(sum_fd >= 0)::close(sum_fd);
+        }
+    };
+    using SegmentPtr = std::shared_ptr<Segment>;
+
+    struct RoomLog
+    {
+        std::vector<SegmentPtr> segments;
+        seq_t next_seq = 1;
+    };
+
+    Options options;
+    // Readers take it shared. The writer is the only one changing rooms, so it reads them
+    // without the lock and only takes it to publish.
+    mutable std::shared_mutex mtx;
+    std::map<id_t,RoomLog> rooms;
+
+    std::mutex queue_mtx;
+    std::condition_variable queue_cv;
+    std::vector<std::pair<id_t,FramePtr>> queue;
+    bool stopping = false;
+    std::thread writer;
+
+    std::string room_path(id_t id) const
+    {
+        return options.dir + "/room" + std::to_string(id);
+    }
+
+    // a complete print frame with its '\0', as written by append
+    static std::size_t record_length(const char* p, std::size_t left)
+    {
+        header_t header;
+        if(!Codec::decode(p, left, header))return 0;
+        if(header.type != header_t::print || header.body_len == 0 || header.body_len > Protocol::BodyMaxLength)return 0;
+        if(header_length+header.body_len > left || p[header_length+header.body_len-1] != '\0')return 0;
+        return header_length+header.body_len;
+    }
+
+    static std::uint32_t checksum(const char* p, std::size_t len)
+    {
+        boost::crc_32_type crc;
+        crc.process_bytes(p, len);
+        return crc.checksum();
+    }
+
+    static std::string sum_path(const std::string& path)
+    {
+        return path.substr(0, path.size()-4) + ".sum";
+    }
+
+    // the checksums of an existing segment, in the order of its records
+    static std::vector<std::uint32_t> read_sums(int sum_fd)
+    {
+        struct stat st;
+        std::vector<std::uint32_t> sums;
+        if(fstat(sum_fd, &st) != 0)return sums;
+        sums.resize(st.st_size/sizeof(std::uint32_t));
+        ssize_t n = ::pread(sum_fd, sums.data(), sums.size()*sizeof(std::uint32_t), 0);
+        sums.resize(n > 0 ? n/sizeof(std::uint32_t) : 0);
+        return sums;
+    }
+
+    // maps an existing segment (capacity 0) or creates one, with its .sum file
+    static SegmentPtr map_segment(const std::string& path, seq_t first_seq, std::size_t capacity)
+    {
+        auto seg = std::make_shared<Segment>();
+        seg->first_seq = first_seq;
+        std::string sums = sum_path(path);
+        seg->sum_fd = capacity == 0 ? ::open(sums.c_str(), O_RDWR) : ::open(sums.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+        if(seg->sum_fd < 0 && (capacity != 0 || errno != ENOENT))
+        {
+            std::cerr << "chat log: cannot open " << sums << std::endl;
+            return nullptr;
+        }
+        seg->fd = ::open(path.c_str(), O_RDWR | O_CREAT, 0644);
+        struct stat st;
+        if(seg->fd < 0 || fstat(seg->fd, &st) != 0)
+        {
+            std::cerr << "chat log: cannot open " << path << std::endl;
+            return nullptr;
+        }
+        if(capacity == 0)capacity = st.st_size;
+        else if(ftruncate(seg->fd, capacity) != 0)
+        {
+            std::cerr << "chat log: cannot size " << path << std::endl;
+            return nullptr;
+        }
+        if(capacity == 0)return nullptr;
+        void* base = mmap(nullptr, capacity, PROT_READ | PROT_WRITE, MAP_SHARED, seg->fd, 0);
+        if(base == MAP_FAILED)
+        {
+            std::cerr << "chat log: cannot map " << path << std::endl;
+            return nullptr;
+        }
+        seg->base = static_cast<char*>(base);
+        seg->capacity = capacity;
+        return seg;
+    }
+
+    // Rebuilds the record index of every segment on disk. A segment ends at the first
+    // byte that does not start a complete record with the right checksum: its unused zeroed tail,
+    // or a torn write.
+    void load()
+    {
+        namespace fs = std::filesystem;
+        for(auto& room_entry:fs::directory_iterator(options.dir))
+        {
+            std::string name = room_entry.path().filename().string();
+            if(!room_entry.is_directory() || name.compare(0, 4, "room") != 0)continue;
+            id_t id = std::strtoul(name.c_str()+4, nullptr, 10);
+            if(id == 0)continue;
+
+            std::map<seq_t,std::string> files;
+            for(auto& file:fs::directory_iterator(room_entry.path()))
+                if(file.path().extension() == ".log")
+                    files.emplace(std::strtoull(file.path().stem().c_str(), nullptr, 10), file.path().string());
+
+            RoomLog log;
+            for(auto& f:files)
+            {
+                if(f.first < log.next_seq)continue;
+                auto seg = map_segment(f.second, f.first, 0);
+                if(!seg)continue;
+                std::vector<std::uint32_t> sums;
+                if(seg->sum_fd >= 0)sums = read_sums(seg->sum_fd);
+                std::size_t n;
+                while((n = record_length(seg->base+seg->used, seg->capacity-seg->used)) != 0)
+                {
+                    if(seg->sum_fd >= 0)
+                    {
+                        std::size_t i = seg->offsets.size();
+                        if(i >= sums.size() || sums[i] != checksum(seg->base+seg->used, n))break;
+                    }
+                    seg->offsets.push_back(seg->used);
+                    seg->used += n;
+                }
+                seg->synced = seg->used;
+                log.next_seq = f.first + seg->offsets.size();
+                log.segments.push_back(seg);
+            }
+            if(log.next_seq > 1)rooms.emplace(id, std::move(log));
+        }
+    }
+
+    // copies one frame to the end of the room log, returns the bytes written
+    std::size_t write(id_t id, const Frame& frame, std::vector<SegmentPtr>& dirty)
+    {
+        auto it = rooms.find(id);
+        if(it == rooms.end())
+        {
+            std::error_code ec;
+            std::filesystem::create_directories(room_path(id), ec);
+            std::unique_lock<std::shared_mutex> lock(mtx);
+            it = rooms.emplace(id, RoomLog()).first;
+        }
+        RoomLog& log = it->second;
+
+        SegmentPtr seg = log.segments.empty() ? nullptr : log.segments.back();
+        if(!seg || seg->sum_fd < 0 || seg->used+frame.size() > seg->capacity)
+        {
+            seg = map_segment(room_path(id) + "/" + std::to_string(log.next_seq) + ".log",
+                log.next_seq, std::max(options.segment_size, frame.size()));
+            if(!seg)
+            {
+                Metrics::add(Metrics::log_dropped);
+                return 0;
+            }
+            std::unique_lock<std::shared_mutex> lock(mtx);
+            log.segments.push_back(seg);
+        }
+
+        // readers never look past used, so the copy needs no lock
+        std::memcpy(seg->base+seg->used, frame.data(), frame.size());
+        std::uint32_t sum = checksum(frame.data(), frame.size());
+        off_t sum_at = seg->offsets.size()*sizeof(sum);
+        if(::pwrite(seg->sum_fd, &sum, sizeof(sum), sum_at) != static_cast<ssize_t>(sizeof(sum)))
+        {
+            Metrics::add(Metrics::log_dropped);
+            return 0;
+        }
+        {
+            std::unique_lock<std::shared_mutex> lock(mtx);
+            seg->offsets.push_back(seg->used);
+            seg->used += frame.size();
+            log.next_seq++;
+        }
+        if(std::find(dirty.begin(), dirty.end(), seg) == dirty.end())dirty.push_back(seg);
+        Metrics::add(Metrics::log_appends);
+        Metrics::add(Metrics::log_bytes, frame.size());
+        return frame.size();
+    }
+
+    static void sync(std::vector<SegmentPtr>& dirty)
+    {
+        static const std::size_t page = sysconf(_SC_PAGESIZE);
+        for(auto& seg:dirty)
+        {
+            std::size_t from = seg->synced/page*page;
+            msync(seg->base+from, seg->used-from, MS_SYNC);
+            fdatasync(seg->sum_fd);
+            seg->synced = seg->used;
+        }
+        if(!dirty.empty())Metrics::add(Metrics::log_syncs);
+        dirty.clear();
+    }
+
+    void run()
+    {
+        std::vector<std::pair<id_t,FramePtr>> batch;
+        std::vector<SegmentPtr> dirty;
+        std::size_t unsynced = 0;
+        auto deadline = std::chrono::steady_clock::now();
+        for(;;)
+        {
+            bool stop;
+            {
+                std::unique_lock<std::mutex> lock(queue_mtx);
+                auto ready = [&]{return stopping || !queue.empty();};
+                if(unsynced)queue_cv.wait_until(lock, deadline, ready);
+                else queue_cv.wait(lock, ready);
+                batch.swap(queue);
+                stop = stopping;
+            }
+            for(auto& item:batch)
+            {
+                if(item.second->type() != header_t::print)continue;
+                if(!unsynced)deadline = std::chrono::steady_clock::now() + options.sync_interval;
+                unsynced += write(item.first, *item.second, dirty);
+            }
+            batch.clear();
+            if(stop || unsynced >= options.sync_bytes || (unsynced && std::chrono::steady_clock::now() >= deadline))
+            {
+                sync(dirty);
+                unsynced = 0;
+            }
+            if(stop)return;
+        }
+    }
+
+    public:
+    // queues a chat frame; never blocks on the disk
+    void append(id_t id, FramePtr frame)
+    {
+        std::lock_guard<std::mutex> lock(queue_mtx);
+        if(queue.size() >= options.max_pending)
+        {
+            Metrics::add(Metrics::log_dropped);
+            return;
+        }
+        queue.emplace_back(id, std::move(frame));
+        if(queue.size() == 1)queue_cv.notify_one();
+    }
+
+    // rooms that have a log
+    std::vector<id_t> room_ids() const
+    {
+        std::shared_lock<std::shared_mutex> lock(mtx);
+        std::vector<id_t> ids;
+        for(auto& r:rooms)ids.push_back(r.first);
+        return ids;
+    }
+
+    // At most count records of a room from sequence number from (0: the last count records),
+    // as one frame per segment they span, or one per record if asked to. Frames share the mapping.
+    Slice read(id_t id, seq_t from, std::size_t count, bool one_per_record = false) const
+    {
+        Slice slice;
+        std::shared_lock<std::shared_mutex> lock(mtx);
+        auto it = rooms.find(id);
+        if(it == rooms.end())return slice;
+        const RoomLog& log = it->second;
+        slice.end = log.next_seq;
+        if(from == 0)from = log.next_seq > count ? log.next_seq-count : 1;
+        slice.first = from;
+
+        auto seg = std::upper_bound(log.segments.begin(), log.segments.end(), from,
+            [](seq_t s, const SegmentPtr& p){return s < p->first_seq;});
+        if(seg != log.segments.begin())--seg;
+        for(;seg!=log.segments.end() && slice.count<count;++seg)
+        {
+            const Segment& s = **seg;
+            if(from < s.first_seq)from = s.first_seq;
+            if(from-s.first_seq >= s.offsets.size())continue;
+            if(slice.count == 0)slice.first = from;
+            std::size_t i = from-s.first_seq;
+            std::size_t n = std::min(count-slice.count, s.offsets.size()-i);
+            auto offset = [&](std::size_t k){return k < s.offsets.size() ? s.offsets[k] : s.used;};
+            if(one_per_record)
+            {
+                for(std::size_t k=i;k<i+n;k++)
+                    slice.frames.push_back(MakeFrame(*seg, s.base+offset(k), offset(k+1)-offset(k)));
+            }
+            else slice.frames.push_back(MakeFrame(*seg, s.base+offset(i), offset(i+n)-offset(i)));
+            slice.count += n;
+            from += n;
+        }
+        return slice;
+    }
+
+    // writes what is queued, syncs it and stops the writer
+    void stop()
+    {
+        {
+            std::lock_guard<std::mutex> lock(queue_mtx);
+            stopping = true;
+        }
+        queue_cv.notify_one();
+        if(writer.joinable())writer.join();
+    }
+
+    ChatLog(const Options& opts):options(opts)
+    {
+        std::error_code ec;
+        std::filesystem::create_directories(options.dir, ec);
+        if(ec)std::cerr << "chat log: cannot create " << options.dir << ": " << ec.message() << std::endl;
+        else load();
+        writer = std::thread([this]{run();});
+    }
+
+    ~ChatLog()
+    {
+        stop();
+    }
+};
+
+#endif // CHAT_LOG_HPP
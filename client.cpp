@@ -6,8 +6,11 @@
 #include <memory>
 #include <chrono>
 #include <thread>
+#include <cstring>
 #include "protocol.h"
 #include "tools.hpp"
+#include "buffer_pool.hpp"
+#include "wire.hpp"
 
 using namespace boost;
 using namespace boost::asio;
@@ -17,6 +20,9 @@ struct UserInfo
 {
     std::string name;
     Protocol::id_t roomid = Protocol::null_room_id;
+    // where the last rooms/users listing stopped, next_cursor==0 if it was complete
+    Protocol::Message::list_kind_t list_kind = Protocol::Message::list_rooms;
+    Protocol::id_t next_cursor = 0;
 };
 
 class Client
@@ -28,17 +34,32 @@ class Client
     using send_msg_t = Protocol::Message::Client_to_Server;
     using send_header_t = Protocol::Message::Client_to_Server::header_t;
 
-    static const int recv_header_length = sizeof(recv_header_t::type) + sizeof(recv_header_t::body_len);
-    static const int send_buf_length = sizeof(send_header_t::type) + Protocol::BodyMaxLength;
+    static const int send_buf_length = Wire::max_request_length;
+    // with a server that takes pings, one goes out after this long without a word from it,
+    // and the connection is given up after three times as long
+    static constexpr std::chrono::seconds HeartbeatInterval{10};
+    static const int recv_buf_length = Wire::max_header_length_v2 + Protocol::BatchMaxLength;
 
-    using recv_header_buf_t = std::array<char,recv_header_length>;
-    using recv_body_buf_t = std::array<char,Protocol::BodyMaxLength>;
+    using recv_buf_t = std::array<char,recv_buf_length>;
     using send_buf_t = std::array<char,send_buf_length>;
 
     io_service service;
     ip::tcp::endpoint server_ep;
     ip::tcp::socket sock;
     UserInfo info;
+    std::uint32_t protocol;     // asked for in hello, then what the server agreed on
+    bool batches = false;
+    bool pings = false;
+    steady_timer heartbeat;
+    std::chrono::steady_clock::time_point heard;    // the last bytes from the server
+    std::uint32_t ping_count = 0;
+    // what the server gave to come back to the session with (id 0: nothing), and whether the last connect did
+    Messages::Session session{};
+    bool resumed = false;
+    bool hello_due = false, resume_due = false;     // answers Connect waits for
+    // only one read is in flight at a time; a partial message stays at the front
+    recv_buf_t recv_buf;
+    std::size_t recv_len = 0;
 
     void Print(const std::string& s)
     {
@@ -46,116 +67,181 @@ class Client
         if(!s.empty() and s[s.size()-1]!='\n')std::cout << std::endl;
     }
 
-    void RegisterReadHeader()
+    void RegisterRead()
     {
-        auto header_buf = std::make_shared<recv_header_buf_t>();
-        async_read(sock, buffer(*header_buf), transfer_exactly(recv_header_length), [=](const error_code& e, std::size_t recv_len){this->ReceiveHeaderHandler(header_buf,e,recv_len);});
+        sock.async_read_some(buffer(recv_buf.data()+recv_len, recv_buf.size()-recv_len),
+            pooled([=](const error_code& e, std::size_t len){this->ReceiveHandler(e,len);}));
     }
 
-    void RegisterReadBody(const recv_header_t &header)
+    // args is whatever Wire::Encode takes: a type and its body, or a message
+    template <typename... Args>
+    void RegisterWrite(const Args&... args)
     {
-        auto body_buf = std::make_shared<recv_body_buf_t>();
-        async_read(sock, buffer(*body_buf), transfer_exactly(header.body_len), [=](const error_code& e, std::size_t recv_len){this->ReceiveBodyHandler(body_buf,header,e,recv_len);} );
-    }
-
-    void RegisterWrite(const send_header_t::type_t& type)
-    {
-        auto send_buf = std::make_shared<send_buf_t>();
-        Tools::to_network(type,send_buf->begin());
-        async_write(sock, buffer(*send_buf), transfer_exactly(sizeof(type)+sizeof(send_header_t::body_len)),
-            [=](const error_code& e, std::size_t trans_len){this->WriteHandler(e,trans_len);} );
-    }
-
-    void RegisterWrite(const send_header_t::type_t& type, const std::uint32_t& int_arg)
-    {
-        auto send_buf = std::make_shared<send_buf_t>();
-
-        // header
-        Tools::to_network(type,send_buf->begin());
-        decltype(send_header_t::body_len) body_len = sizeof(int_arg);
-        Tools::to_network(static_cast<std::uint32_t>(sizeof(int_arg)),send_buf->begin()+sizeof(type));
-
-        // body
-        Tools::to_network(int_arg, send_buf->begin()+sizeof(type)+sizeof(int_arg));
-
-        async_write(sock, buffer(*send_buf), transfer_exactly(sizeof(type)+sizeof(body_len)+body_len),
-            [=](const error_code& e, std::size_t trans_len){this->WriteHandler(e,trans_len);} );
-    }
-
-    void RegisterWrite(const send_header_t::type_t& type, const std::string& str_arg)
-    {
-        auto send_buf = std::make_shared<send_buf_t>();
-        Tools::to_network(type,send_buf->begin());
-
-        decltype(send_header_t::body_len) body_len;
-
-        const std::string& str = str_arg;
-        body_len = str.size()+1;
-        for(int i=0;i<str_arg.size();i++)
-            send_buf->at(sizeof(type)+sizeof(body_len)+i) = str[i];
-
-        if(body_len>Protocol::BodyMaxLength)
+        auto send_buf = std::allocate_shared<send_buf_t>(PoolAllocator<send_buf_t>());
+        std::size_t send_len = Wire::Encode(protocol, send_buf->data(), args...);
+        if(send_len == 0)
         {
             std::cerr << "Body too long!" << std::endl;
             return;
         }
 
-        Tools::to_network(body_len,send_buf->begin()+sizeof(type));
-
-        async_write(sock, buffer(*send_buf), transfer_exactly(sizeof(type)+sizeof(body_len)+body_len),
-            [=](const error_code& e, std::size_t trans_len){this->WriteHandler(e,trans_len);} );
+        // the handler holds send_buf, so it stays alive until the write is done
+        async_write(sock, buffer(*send_buf), transfer_exactly(send_len),
+            pooled([this,send_buf](const error_code& e, std::size_t){this->WriteHandler(e);}) );
     }
 
-    void ReceiveHeaderHandler(std::shared_ptr<recv_header_buf_t> header_buf, const error_code& e, std::size_t recv_len)
+    // handles every complete message in the buffer, false if one is malformed
+    bool Parse()
     {
-        if(!e)
+        std::size_t pos = 0;
+        while(true)
         {
             recv_header_t header;
-            header.type = Tools::from_network<decltype(header.type)>(header_buf->begin());
-            header.body_len = Tools::from_network<decltype(header.body_len)>(header_buf->begin()+sizeof(header.type));
-            
-            switch(header.type)
-            {
-                case recv_header_t::print:
-                case recv_header_t::roomchange:
-                    break;
-                default:
-                {
-                    std::cerr << "Undefined type " << header.type << std::endl;
-                    return;
-                }
-            }
+            int n = Wire::DecodeHeader(protocol, recv_buf.data()+pos, recv_len-pos, header);
+            if(n == 0)break;
+            if(n < 0 || header.body_len > Wire::MaxBodyLength(header))return false;
+            if(recv_len-pos < n+header.body_len)break;
+            if(!Handle(header, recv_buf.data()+pos+n))return false;
+            pos += n+header.body_len;
+        }
+        std::memmove(recv_buf.data(), recv_buf.data()+pos, recv_len-pos);
+        recv_len -= pos;
+        return true;
+    }
 
-            if(header.body_len==0)RegisterReadHeader();
-            else RegisterReadBody(header);
+    void ReceiveHandler(const error_code& e, std::size_t len)
+    {
+        if(e)
+        {
+            std::cerr << "Error!" << std::endl;
+            Disconnect();
+            return;
         }
-        else std::cerr << "Error!" << std::endl;
+        recv_len += len;
+        heard = std::chrono::steady_clock::now();
+        if(!Parse())
+        {
+            std::cerr << "Malformed message" << std::endl;
+            Disconnect();
+            return;
+        }
+        RegisterRead();
     }
 
-    void ReceiveBodyHandler(std::shared_ptr<recv_body_buf_t> body_buf, recv_header_t header, const error_code& e, std::size_t recv_len)
+    bool Handle(const recv_header_t& header, const char* body)
     {
+        std::size_t len = header.body_len;
         switch (header.type)
         {
             case recv_header_t::print:
             {
-                Print(body_buf->begin());
+                Print(std::string(Wire::Text(body, len)));
                 break;
             }
             case recv_header_t::roomchange:
             {
-                info.roomid = Tools::from_network<decltype(info.roomid)>(body_buf->begin());
+                Messages::RoomChange msg;
+                if(Wire::Read(protocol, body, len, msg))info.roomid = msg.room;
+                break;
+            }
+            case recv_header_t::listing:
+            {
+                Messages::Listing msg;
+                if(!Wire::Read(protocol, body, len, msg))break;
+                info.list_kind = msg.kind;
+                info.next_cursor = msg.next;
+                Print(std::string(Wire::Text(body, len)));
+                if(info.next_cursor != 0)Print("(more: type \"more\" for the next page)");
                 break;
             }
+            case recv_header_t::hello:
+            {
+                Messages::HelloReply msg;
+                if(!Wire::Read(1, body, len, msg))return false;
+                protocol = msg.version;
+                batches = msg.caps & Protocol::cap_batch;
+                pings = msg.caps & Protocol::cap_ping;
+                hello_due = false;
+                break;
+            }
+            case recv_header_t::session:
+            {
+                if(!Wire::Read(protocol, body, len, session))return false;
+                break;
+            }
+            case recv_header_t::resumed:
+            {
+                Messages::Resumed msg;
+                if(!Wire::Read(protocol, body, len, msg))return false;
+                resume_due = false;
+                resumed = msg.id != 0;
+                if(!resumed)break;
+                session.id = msg.id;
+                info.name = std::string(Wire::Text(body, len));
+                info.roomid = msg.room;
+                std::cerr << "Resumed as " << info.name << "." << std::endl;
+                break;
+            }
+            case recv_header_t::ping:
+            {
+                Messages::ServerPing msg;
+                if(!Wire::Read(protocol, body, len, msg))return false;
+                RegisterWrite(Messages::Pong{msg.token});
+                break;
+            }
+            case recv_header_t::pong:
+                break;
+            case recv_header_t::batch:
+            {
+                bool good = true;
+                if(!Wire::ForEachInBatch(body, len, [&](const recv_header_t& h, const char* b){good = Handle(h, b) && good;}))return false;
+                return good;
+            }
             default:
             {
                 std::cerr << "Undefined type " << header.type << std::endl;
-                break;
+                return false;
             }
         }
-        RegisterReadHeader();
+        return true;
+    }
+
+    void RegisterHeartbeat()
+    {
+        heartbeat.expires_after(HeartbeatInterval);
+        heartbeat.async_wait([this](const error_code& e){if(!e)this->HeartbeatHandler();});
+    }
+
+    // a server that has not said anything for a while is asked whether it is still there
+    void HeartbeatHandler()
+    {
+        auto silent = std::chrono::steady_clock::now() - heard;
+        if(silent >= 3*HeartbeatInterval)
+        {
+            std::cerr << "The server stopped answering." << std::endl;
+            Disconnect();
+            return;
+        }
+        if(silent >= HeartbeatInterval)RegisterWrite(Messages::Ping{++ping_count});
+        RegisterHeartbeat();
+    }
+
+    // ends the connection, which makes NetworkLoop connect again
+    void Disconnect()
+    {
+        error_code ignored;
+        sock.close(ignored);
+        heartbeat.cancel();
+    }
+
+    // a new session instead of the one that was lost: it gets the name and the room back the long way
+    void Relogin()
+    {
+        if(!info.name.empty())RegisterWrite(send_header_t::rename, info.name);
+        if(info.roomid != Protocol::null_room_id)RegisterWrite(Messages::Enter{info.roomid});
     }
 
-    void WriteHandler(const error_code& e, std::size_t trans_len)
+    void WriteHandler(const error_code& e)
     {
         if(e)
         {
@@ -165,22 +251,60 @@ class Client
 
     public:
 
-    Client():
-        server_ep(ip::address::from_string(Protocol::server_ip),Protocol::server_port),
-        sock(service)
+    // protocol: the highest version to ask for, 1 does without hello
+    Client(const std::string& host = Protocol::server_ip, unsigned short port = Protocol::server_port, std::uint32_t protocol = Protocol::Version):
+        server_ep(ip::address::from_string(host),port),
+        sock(service),
+        protocol(protocol),
+        heartbeat(service)
     {}
 
+    // Connects and agrees on the protocol. A server that does not know hello drops the connection:
+    // the next attempt is made in v1.
+    // With a session to go back to, the resume goes out right behind the hello, and what the session
+    // missed comes right behind the answer.
     bool Connect()
     {
         error_code e;
+        if(sock.is_open())sock.close();
+        recv_len = 0;
+        resumed = false;
         sock.connect(server_ep,e);
-        return !e;
+        if(e || protocol == 1)return !e;
+
+        char hello[2*Wire::max_request_length];
+        std::size_t n = Wire::Encode(1, hello, Messages::Hello{protocol, Protocol::cap_batch | Protocol::cap_ping | Protocol::cap_resume});
+        resume_due = session.id != 0;
+        if(resume_due)n += Wire::Encode(protocol, hello+n, Messages::Resume{session.id, session.token_high, session.token_low});
+        hello_due = true;
+        protocol = 1;
+        write(sock, buffer(hello, n), e);
+        while(!e)
+        {
+            if(!Parse())break;
+            if(!hello_due && !resume_due)return true;
+            recv_len += sock.read_some(buffer(recv_buf.data()+recv_len, recv_buf.size()-recv_len), e);
+        }
+        sock.close();
+        return false;
     }
 
+
+    // runs the connection, and once it drops connects again: back to the same session if the server kept it
     void NetworkLoop()
     {
-        RegisterReadHeader();
-        service.run();
+        while(true)
+        {
+            if(!Parse())return;
+            RegisterRead();
+            heard = std::chrono::steady_clock::now();
+            if(pings)RegisterHeartbeat();
+            service.run();
+            std::cerr << "Connection lost, reconnecting..." << std::endl;
+            service.restart();
+            while(!Connect())std::this_thread::sleep_for(std::chrono::seconds(1));
+            if(!resumed)Relogin();
+        }
     }
 
     bool chatting()
@@ -208,21 +332,41 @@ class Client
         return info.roomid;
     }
 
-    void remote_exec(const send_header_t::type_t& type)
+    void list(Protocol::Message::list_kind_t kind, Protocol::id_t cursor = 0)
     {
-        RegisterWrite(type);
+        RegisterWrite(Messages::List{kind, cursor, Protocol::DefaultPageSize});
     }
 
-    template <typename T>
-    void remote_exec(const send_header_t::type_t& type, const T& arg)
+    // false if the last listing was already complete
+    bool list_more()
     {
-        RegisterWrite(type,arg);
+        if(info.next_cursor == 0)return false;
+        list(info.list_kind, info.next_cursor);
+        return true;
+    }
+
+    template <typename... Args>
+    void remote_exec(const Args&... args)
+    {
+        RegisterWrite(args...);
     }
 };
 
-int main()
+int main(int argc, char* argv[])
 {
-    Client client;
+    // --host= and --port= pick the server, e.g. any node of a cluster; --protocol=1 does without v2
+    std::string host = Protocol::server_ip;
+    unsigned short port = Protocol::server_port;
+    std::uint32_t protocol = Protocol::Version;
+    for(int i=1;i<argc;i++)
+    {
+        std::string arg = argv[i];
+        if(arg.compare(0,7,"--host=")==0)host = arg.substr(7);
+        else if(arg.compare(0,7,"--port=")==0)port = static_cast<unsigned short>(std::stoul(arg.substr(7)));
+        else if(arg.compare(0,11,"--protocol=")==0)protocol = std::max(1ul, std::min<unsigned long>(std::stoul(arg.substr(11)), Protocol::Version));
+        else std::cerr << "unknown option " << arg << std::endl;
+    }
+    Client client(host, port, protocol);
     std::thread th;
     std::stringstream ss;
     std::string new_name, order;
@@ -232,9 +376,11 @@ int main()
     "rename xxx: change your name to xxx\n"
     "rooms: list all rooms\n"
     "users: list all users\n"
+    "more: show the next page of the last rooms/users listing\n"
     "enter room_id: enter the room with id room_id (and enter chatting mod)\n"
     "::leave (in chatting mod): leave current room\n"
     "find xxx: find the user with name xxx\n"
+    "history room_id [from] [n]: show n messages of a room from number from (the last ones without from)\n"
     "newroom: create a new room and enter it\n"
     "randroom: randomly enter a room\n"
     ".... (in chatting mod): send some text to the current room\n"
@@ -326,11 +472,15 @@ int main()
             }
             else if(order=="rooms")
             {
-                client.remote_exec(command_t::rooms);
+                client.list(Protocol::Message::list_rooms);
             }
             else if(order=="users")
             {
-                client.remote_exec(command_t::users);
+                client.list(Protocol::Message::list_users);
+            }
+            else if(order=="more")
+            {
+                if(!client.list_more())std::cout << "Nothing more to show." << std::endl;
             }
             else if( order.substr(0,std::string("enter").size()) == "enter" )
             {
@@ -339,7 +489,7 @@ int main()
                 ss.clear();
                 ss << order;
                 ss >> _ >> roomid;
-                client.remote_exec(command_t::enter,roomid);
+                client.remote_exec(Messages::Enter{roomid});
             }
             else if(order.substr(0,std::string("find").size()) == "find")
             {
@@ -347,11 +497,22 @@ int main()
                 ss.clear();
                 ss << order;
                 ss >> _ >> name;
-                if(new_name.size() == 0 or new_name.size()>Protocol::NameMaxLength)
+                if(name.size() == 0 or name.size()>Protocol::NameMaxLength)
                 {
                     std::cerr << "The length of name is too short or too long." << std::endl;
                 }
-                else client.remote_exec(command_t::find, new_name );
+                else client.remote_exec(command_t::find, name );
+            }
+            else if(order.substr(0,std::string("history").size()) == "history")
+            {
+                std::string _;
+                std::uint32_t roomid = 0, from = 0, count = Protocol::DefaultPageSize;
+                ss.clear();
+                ss << order;
+                ss >> _ >> roomid;
+                if(!(ss >> from))from = 0;
+                else if(!(ss >> count))count = Protocol::DefaultPageSize;
+                client.remote_exec(Messages::History{roomid, from, count});
             }
             else if(order.substr(0,std::string("enter").size()) == "enter")
             {
@@ -0,0 +1,462 @@
+#ifndef CLUSTER_HPP
+#define CLUSTER_HPP
+
+#include <boost/asio.hpp>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <functional>
+#include <initializer_list>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+#include "tools.hpp"
+#include "codec.hpp"
+#include "frame.hpp"
+#include "metrics.hpp"
+
+using namespace boost;
+
+// Several server processes (nodes) sharing the rooms. A room belongs to the node its id hashes to
+// on a consistent hash ring: that node keeps its history and its log, and puts its chat in order.
+// Every node has one outbound link to every other node, on which it only sends;
+// frames queued while a write is in flight leave together in the next one.
+namespace Peer
+{
+    using node_t = std::uint32_t;
+
+    // a peer frame is type (4bytes), body_len (4bytes), body; numbers in a body are 4 bytes
+    enum type_t : std::uint32_t
+    {
+        hello,      // node: the first frame on a link
+        join,       // room, user, replay count: a user of the sender enters a room of the receiver
+        joined,     // room, user, then the replay frames: the answer to join
+        no_room,    // room, user: the answer to join for a room that does not exist
+        part,       // room: a user of the sender left a room of the receiver
+        say,        // room, then a print frame: chat of a user of the sender in a room of the receiver
+        chat,       // room, then a print frame: chat of a room of the sender, for its members on the receiver
+        query,      // query id, kind, cursor, count, listing, pattern: the receiver's part of a listing or a find
+        answer      // query id, next cursor, then (id, line) entries
+    };
+
+    struct Header
+    {
+        type_t type;
+        std::uint32_t body_len;
+        static constexpr auto fields = Codec::fields(&Header::type, &Header::body_len);
+    };
+    const std::size_t header_length = Codec::fixed_size<Header>();
+    const std::size_t MaxBodyLength = 1 << 20;
+    const std::size_t MaxNodes = 64;
+    const unsigned NodeIdShift = 26;            // user ids of node k start above k << NodeIdShift
+    const std::uint32_t Resync = 0xffffffff;    // replay count of a join re-announcing a member after a reconnect:
+                                                // only answered if the room is gone
+
+    // follows: length of the end of the body, queued right behind as a frame of its own (e.g. a shared chat frame)
+    inline FramePtr Encode(type_t type, const Tools::Writer& body, std::size_t follows = 0)
+    {
+        char header[header_length];
+        Codec::encode(Header{type, static_cast<std::uint32_t>(body.str().size()+follows)}, header);
+        Tools::Writer w;
+        w.raw(std::string_view(header, header_length));
+        w.raw(body.str());
+        auto bytes = std::make_shared<const std::string>(w.take());
+        return MakeFrame(bytes, bytes->data(), bytes->size());
+    }
+
+    inline FramePtr Encode(type_t type, std::initializer_list<std::uint32_t> fields, std::size_t follows = 0)
+    {
+        Tools::Writer body;
+        for(auto x:fields)body.u32(x);
+        return Encode(type, body, follows);
+    }
+}
+
+// Every node has vnodes points on a 64 bit ring and an id belongs to the first point at or after its hash,
+// so adding or removing a node only moves the ids of the arcs it gains or loses.
+class HashRing
+{
+    private:
+    std::vector<std::pair<std::uint64_t,Peer::node_t>> points;
+
+    // splitmix64
+    static std::uint64_t mix(std::uint64_t x)
+    {
+        x += 0x9e3779b97f4a7c15ULL;
+        x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+        x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+        return x ^ (x >> 31);
+    }
+
+    public:
+    Peer::node_t owner(std::uint32_t id) const
+    {
+        if(points.empty())return 0;
+        auto it = std::lower_bound(points.begin(), points.end(), std::make_pair(mix(id), Peer::node_t(0)));
+        return it==points.end() ? points.front().second : it->second;
+    }
+
+    HashRing(std::size_t nodes, unsigned vnodes)
+    {
+        for(std::size_t n=0;n<nodes;n++)
+            for(unsigned v=0;v<vnodes;v++)
+                points.emplace_back(mix((std::uint64_t(n)+1) << 32 | v), static_cast<Peer::node_t>(n));
+        std::sort(points.begin(), points.end());
+    }
+};
+
+// The links between the nodes. Links are spread over the io threads, frames arrive in the order
+// they were sent on a link and are handed to the server as they are; a link that breaks is
+// connected again, dropping what was queued on it.
+class Cluster
+{
+    public:
+    using node_t = Peer::node_t;
+
+    struct Options
+    {
+        std::vector<asio::ip::tcp::endpoint> nodes;     // where every node accepts links; empty: a single server
+        node_t self = 0;
+        unsigned vnodes = 64;                           // points of every node on the hash ring
+        std::size_t max_queued = 64 << 20;              // bytes waiting on a link, more are dropped
+        std::chrono::milliseconds retry{500};           // between two attempts to connect or to bind
+        std::chrono::milliseconds query_timeout{500};   // a listing goes out without the nodes that have not answered by then
+        std::chrono::milliseconds resync_grace{5000};   // rooms keep the place of a reset node's members that long
+    };
+
+    // called on io threads
+    struct Handlers
+    {
+        std::function<void(node_t, Peer::type_t, std::string_view)> frame;
+        std::function<void(node_t)> link_up;    // the link to a node is connected (again)
+        std::function<void(node_t)> reset;      // a node connected again or went away: what it said before is void
+    };
+
+    private:
+    static const node_t none = ~node_t(0);
+
+    struct Link
+    {
+        node_t node;
+        asio::io_context& ctx;
+        asio::ip::tcp::socket sock;
+        asio::steady_timer timer;
+        char probe;                 // a link is only read to notice that it was closed
+        std::mutex mtx;
+        std::vector<FramePtr> queue, sending;
+        std::vector<asio::const_buffer> bufs;
+        std::size_t queued_bytes = 0;
+        bool up = false, writing = false;
+
+        Link(node_t n, asio::io_context& c):node(n), ctx(c), sock(c), timer(c)
+        {}
+    };
+    using LinkPtr = std::shared_ptr<Link>;
+
+    struct Inbound
+    {
+        asio::ip::tcp::socket sock;
+        std::vector<char> buf;
+        std::size_t used = 0;
+        node_t node = none;
+        std::uint64_t generation = 0;
+
+        Inbound(asio::ip::tcp::socket s):sock(std::move(s))
+        {}
+    };
+    using InboundPtr = std::shared_ptr<Inbound>;
+
+    Options options;
+    HashRing ring;
+    std::vector<asio::io_context*> contexts;
+    Handlers handlers;
+    std::vector<LinkPtr> links;             // null for self
+    asio::ip::tcp::acceptor acceptor;       // runs on contexts[0]
+    asio::steady_timer bind_timer;          // runs on contexts[0]
+    std::size_t next_context = 0;
+    std::atomic<std::uint64_t> epoch{0};    // bumped by stop(), handlers of an older epoch do nothing
+    std::mutex inbound_mtx;
+    std::set<InboundPtr> inbound;
+    std::vector<std::uint64_t> generations; // of the current inbound link of every node
+
+    void Connect(LinkPtr link, std::uint64_t e)
+    {
+        link->sock.async_connect(options.nodes[link->node], [=](const boost::system::error_code& eno)
+        {
+            if(e != epoch)return;
+            if(eno)
+            {
+                Retry(link, e);
+                return;
+            }
+            boost::system::error_code ignored;
+            link->sock.set_option(asio::ip::tcp::no_delay(true), ignored);
+            {
+                // the hello leads, and whatever link_up sends goes out with it
+                std::lock_guard<std::mutex> lock(link->mtx);
+                link->up = true;
+                link->writing = true;
+                link->sending.clear();
+                link->queue.assign(1, Peer::Encode(Peer::hello, {options.self}));
+                link->queued_bytes = link->queue.front()->size();
+            }
+            handlers.link_up(link->node);
+            Flush(link, e);
+            Probe(link, e);
+        });
+    }
+
+    void Retry(LinkPtr link, std::uint64_t e)
+    {
+        boost::system::error_code ignored;
+        link->sock.close(ignored);
+        link->timer.expires_after(options.retry);
+        link->timer.async_wait([=](const boost::system::error_code& eno){if(!eno && e == epoch)Connect(link, e);});
+    }
+
+    void Down(LinkPtr link, std::uint64_t e)
+    {
+        {
+            std::lock_guard<std::mutex> lock(link->mtx);
+            if(!link->up)return;
+            link->up = false;
+            for(auto& f:link->queue)link->queued_bytes -= f->size();
+            link->queue.clear();
+        }
+        std::cerr << "cluster: link to node " << link->node << " is down" << std::endl;
+        Retry(link, e);
+    }
+
+    void Probe(LinkPtr link, std::uint64_t e)
+    {
+        link->sock.async_read_some(asio::buffer(&link->probe, 1), [=](const boost::system::error_code& eno, std::size_t)
+        {
+            if(e != epoch)return;
+            if(eno)Down(link, e);
+            else Probe(link, e);
+        });
+    }
+
+    // writes everything queued in one gather write
+    void Flush(LinkPtr link, std::uint64_t e)
+    {
+        {
+            std::lock_guard<std::mutex> lock(link->mtx);
+            link->sending.swap(link->queue);
+            link->bufs.clear();
+            for(auto& f:link->sending)link->bufs.push_back(f->buffer());
+        }
+        asio::async_write(link->sock, BufferView(link->bufs), [=](const boost::system::error_code& eno, std::size_t)
+        {
+            if(e != epoch)return;
+            bool more;
+            {
+                std::lock_guard<std::mutex> lock(link->mtx);
+                for(auto& f:link->sending)link->queued_bytes -= f->size();
+                link->sending.clear();
+                more = !eno && link->up && !link->queue.empty();
+                link->writing = more;
+            }
+            if(eno)Down(link, e);
+            else if(more)Flush(link, e);
+        });
+    }
+
+    // binds the port of this node, retrying while it is taken (e.g. by a server handing off to this one)
+    void Bind(bool report = true)
+    {
+        boost::system::error_code eno;
+        const auto& ep = options.nodes[options.self];
+        acceptor.open(ep.protocol(), eno);
+        if(!eno)acceptor.set_option(asio::ip::tcp::acceptor::reuse_address(true), eno);
+        if(!eno)acceptor.bind(ep, eno);
+        if(!eno)acceptor.listen(asio::socket_base::max_listen_connections, eno);
+        if(eno)
+        {
+            if(report)std::cerr << "cluster: cannot listen on " << ep << ": " << eno.message() << ", retrying" << std::endl;
+            boost::system::error_code ignored;
+            acceptor.close(ignored);
+            bind_timer.expires_after(options.retry);
+            bind_timer.async_wait([=, e=epoch.load()](const boost::system::error_code& eno){if(!eno && e == epoch)Bind(false);});
+            return;
+        }
+        Accept(epoch);
+    }
+
+    void Accept(std::uint64_t e)
+    {
+        auto& ctx = *contexts[next_context++ % contexts.size()];
+        acceptor.async_accept(ctx, [=](const boost::system::error_code& eno, asio::ip::tcp::socket sock)
+        {
+            if(e != epoch || eno == asio::error::operation_aborted)return;
+            if(!eno)
+            {
+                auto in = std::make_shared<Inbound>(std::move(sock));
+                {
+                    std::lock_guard<std::mutex> lock(inbound_mtx);
+                    inbound.insert(in);
+                }
+                Read(in, e);
+            }
+            Accept(e);
+        });
+    }
+
+    void Read(InboundPtr in, std::uint64_t e)
+    {
+        if(in->buf.size()-in->used < 4096)in->buf.resize(std::max<std::size_t>(2*in->buf.size(), in->used+65536));
+        in->sock.async_read_some(asio::buffer(in->buf.data()+in->used, in->buf.size()-in->used),
+            [=](const boost::system::error_code& eno, std::size_t len)
+        {
+            if(e != epoch)return;
+            if(eno || !Receive(*in, len))
+            {
+                Closed(in);
+                return;
+            }
+            Read(in, e);
+        });
+    }
+
+    // hands every complete frame over, false if the link has to be closed
+    bool Receive(Inbound& in, std::size_t len)
+    {
+        in.used += len;
+        std::size_t pos = 0;
+        while(in.used-pos >= Peer::header_length)
+        {
+            const char* p = in.buf.data()+pos;
+            Peer::Header header;
+            Codec::decode(p, Peer::header_length, header);
+            if(header.body_len > Peer::MaxBodyLength)return false;
+            if(in.used-pos < Peer::header_length+header.body_len)break;
+            std::string_view body(p+Peer::header_length, header.body_len);
+            pos += Peer::header_length+header.body_len;
+            Metrics::add(Metrics::peer_in);
+            if(in.node != none)
+            {
+                handlers.frame(in.node, header.type, body);
+                continue;
+            }
+            Tools::Reader r(body);
+            node_t node = r.u32();
+            if(header.type != Peer::hello || !r.ok() || node >= options.nodes.size() || node == options.self)return false;
+            in.node = node;
+            {
+                std::lock_guard<std::mutex> lock(inbound_mtx);
+                in.generation = ++generations[node];
+            }
+            handlers.reset(node);
+        }
+        std::memmove(in.buf.data(), in.buf.data()+pos, in.used-pos);
+        in.used -= pos;
+        return true;
+    }
+
+    void Closed(InboundPtr in)
+    {
+        boost::system::error_code ignored;
+        in->sock.close(ignored);
+        bool current;
+        {
+            std::lock_guard<std::mutex> lock(inbound_mtx);
+            inbound.erase(in);
+            current = in->node != none && in->generation == generations[in->node];
+        }
+        if(current)handlers.reset(in->node);
+    }
+
+    public:
+    node_t self() const {return options.self;}
+    std::size_t size() const {return options.nodes.size();}
+    node_t owner(std::uint32_t id) const {return ring.owner(id);}
+    const Options& getoptions() const {return options;}
+
+    // Queues a peer message (one or more frames, e.g. a header and a shared chat frame).
+    // Returns false, dropping it, if the link to node is down or too far behind.
+    bool send(node_t to, std::initializer_list<FramePtr> frames)
+    {
+        LinkPtr link = links[to];
+        std::size_t n = 0;
+        for(auto& f:frames)n += f->size();
+        bool flush;
+        {
+            std::lock_guard<std::mutex> lock(link->mtx);
+            if(!link->up || link->queued_bytes+n > options.max_queued)
+            {
+                Metrics::add(Metrics::peer_dropped);
+                return false;
+            }
+            link->queue.insert(link->queue.end(), frames);
+            link->queued_bytes += n;
+            flush = !link->writing;
+            link->writing = true;
+        }
+        Metrics::add(Metrics::peer_out);
+        if(flush)asio::post(link->ctx, [=, e=epoch.load()]{if(e == epoch)Flush(link, e);});
+        return true;
+    }
+
+    void start()
+    {
+        std::uint64_t e = epoch;
+        asio::post(*contexts[0], [=]{if(e == epoch)Bind();});
+        for(auto& link:links)
+            if(link)asio::post(link->ctx, [=]{if(e == epoch)Connect(link, e);});
+    }
+
+    // closes every link, start() opens them again
+    void stop()
+    {
+        ++epoch;
+        asio::post(*contexts[0], [this]
+        {
+            boost::system::error_code ignored;
+            acceptor.close(ignored);
+            bind_timer.cancel();
+        });
+        for(auto& link:links)
+        {
+            if(!link)continue;
+            asio::post(link->ctx, [link]
+            {
+                {
+                    std::lock_guard<std::mutex> lock(link->mtx);
+                    link->up = false;
+                    link->writing = false;
+                    link->queue.clear();
+                    link->queued_bytes = 0;
+                }
+                boost::system::error_code ignored;
+                link->sock.close(ignored);
+                link->timer.cancel();
+            });
+        }
+        std::lock_guard<std::mutex> lock(inbound_mtx);
+        for(auto& in:inbound)
+            asio::post(in->sock.get_executor(), [in]
+            {
+                boost::system::error_code ignored;
+                in->sock.close(ignored);
+            });
+        inbound.clear();
+    }
+
+    // contexts: the io threads to spread the links over, the acceptor runs on the first one
+    Cluster(const Options& opts, std::vector<asio::io_context*> ctxs, Handlers h):
+        options(opts), ring(opts.nodes.size(), opts.vnodes), contexts(std::move(ctxs)), handlers(std::move(h)),
+        acceptor(*contexts[0]), bind_timer(*contexts[0]), generations(opts.nodes.size())
+    {
+        for(node_t n=0;n<options.nodes.size();n++)
+            links.push_back(n == options.self ? nullptr : std::make_shared<Link>(n, *contexts[n % contexts.size()]));
+    }
+};
+
+#endif // CLUSTER_HPP
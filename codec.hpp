@@ -0,0 +1,240 @@
+#ifndef CODEC_HPP
+#define CODEC_HPP
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <tuple>
+#include <type_traits>
+#include <utility>
+
+// Wire encoding of numbers and of messages made of them.
+// A message declares its fields once, as a tuple of member pointers:
+//
+//     struct Enter
+//     {
+//         Protocol::id_t room;
+//         static constexpr auto fields = Codec::fields(&Enter::room);
+//     };
+//
+// (or through a specialization of Codec::Describe), and gets its encoders and decoders generated:
+// fixed width big-endian fields (protocol v1, peer links, logs) or varints (protocol v2).
+// Every access goes through memcpy, so nothing has to be aligned.
+namespace Codec
+{
+    template <typename T>
+    constexpr bool is_scalar_v = std::is_integral_v<T> || std::is_enum_v<T>;
+
+    template <typename T>
+    inline T byteswap(T x)
+    {
+        static_assert(is_scalar_v<T>, "only integers and enums go on the wire");
+        if constexpr(sizeof(T) == 1)return x;
+        else
+        {
+            using U = std::conditional_t<sizeof(T)==2, std::uint16_t, std::conditional_t<sizeof(T)==4, std::uint32_t, std::uint64_t>>;
+            static_assert(sizeof(T) == sizeof(U), "unsupported size");
+            U u;
+            std::memcpy(&u, &x, sizeof(u));
+            if constexpr(sizeof(T) == 2)u = __builtin_bswap16(u);
+            else if constexpr(sizeof(T) == 4)u = __builtin_bswap32(u);
+            else u = __builtin_bswap64(u);
+            std::memcpy(&x, &u, sizeof(x));
+            return x;
+        }
+    }
+
+    // network (big-endian) order from and to the host's
+    template <typename T>
+    inline T to_big(T x)
+    {
+        if constexpr(__BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__)return byteswap(x);
+        else return x;
+    }
+
+    template <typename T>
+    inline void store(char* out, T x)
+    {
+        x = to_big(x);
+        std::memcpy(out, &x, sizeof(x));
+    }
+
+    template <typename T>
+    inline T load(const char* in)
+    {
+        T x;
+        std::memcpy(&x, in, sizeof(x));
+        return to_big(x);
+    }
+
+    // n values at once: loops over memcpy'd values, which the compiler turns into vector byte shuffles
+    template <typename T>
+    inline void store_array(char* out, const T* v, std::size_t n)
+    {
+        if constexpr(sizeof(T) == 1 || __BYTE_ORDER__ != __ORDER_LITTLE_ENDIAN__)std::memcpy(out, v, n*sizeof(T));
+        else
+            for(std::size_t i=0;i<n;i++)
+            {
+                T x = byteswap(v[i]);
+                std::memcpy(out+i*sizeof(T), &x, sizeof(T));
+            }
+    }
+
+    template <typename T>
+    inline void load_array(const char* in, T* v, std::size_t n)
+    {
+        if constexpr(sizeof(T) == 1 || __BYTE_ORDER__ != __ORDER_LITTLE_ENDIAN__)std::memcpy(v, in, n*sizeof(T));
+        else
+            for(std::size_t i=0;i<n;i++)
+            {
+                T x;
+                std::memcpy(&x, in+i*sizeof(T), sizeof(T));
+                v[i] = byteswap(x);
+            }
+    }
+
+    // LEB128 varints: 7 bits per byte, low bits first, the high bit set on every byte but the last
+    const std::size_t MaxVarintLength = 5;
+
+    inline std::size_t varint_length(std::uint32_t x)
+    {
+        std::size_t n = 1;
+        while(x >= 0x80){x >>= 7; n++;}
+        return n;
+    }
+
+    inline std::size_t put_varint(std::uint32_t x, char* out)
+    {
+        std::size_t n = 0;
+        while(x >= 0x80)
+        {
+            out[n++] = static_cast<char>(x | 0x80);
+            x >>= 7;
+        }
+        out[n++] = static_cast<char>(x);
+        return n;
+    }
+
+    // Decodes a varint from the n bytes at in and returns its length, 0 if it is not complete.
+    // A varint still not complete after MaxVarintLength bytes is invalid.
+    inline std::size_t get_varint(const char* in, std::size_t n, std::uint32_t& x)
+    {
+        x = 0;
+        for(std::size_t i=0;i<n && i<MaxVarintLength;i++)
+        {
+            auto b = static_cast<unsigned char>(in[i]);
+            x |= static_cast<std::uint32_t>(b & 0x7f) << (7*i);
+            if(!(b & 0x80))return i+1;
+        }
+        return 0;
+    }
+
+    template <typename... M>
+    constexpr auto fields(M... members){return std::make_tuple(members...);}
+
+    // where the fields of M are declared
+    template <typename M>
+    struct Describe
+    {
+        static constexpr auto fields = M::fields;
+    };
+
+    template <typename C, typename T> T member_type(T C::*);
+    template <typename F> using field_t = decltype(member_type(std::declval<F>()));
+
+    // bytes of M in fixed width
+    template <typename M>
+    constexpr std::size_t fixed_size()
+    {
+        return std::apply([](auto... f){return (std::size_t(0) + ... + sizeof(field_t<decltype(f)>));}, Describe<M>::fields);
+    }
+
+    // the most bytes M takes in varints
+    template <typename M>
+    constexpr std::size_t max_varint_size()
+    {
+        return std::tuple_size_v<std::decay_t<decltype(Describe<M>::fields)>> * MaxVarintLength;
+    }
+
+    // fixed width: returns the length
+    template <typename M>
+    inline std::size_t encode(const M& m, char* out)
+    {
+        std::size_t n = 0;
+        std::apply([&](auto... f){((store(out+n, m.*f), n += sizeof(m.*f)), ...);}, Describe<M>::fields);
+        return n;
+    }
+
+    // fixed width: returns the length, 0 if len is too short
+    template <typename M>
+    inline std::size_t decode(const char* in, std::size_t len, M& m)
+    {
+        if(len < fixed_size<M>())return 0;
+        std::size_t n = 0;
+        std::apply([&](auto... f){((m.*f = load<field_t<decltype(f)>>(in+n), n += sizeof(m.*f)), ...);}, Describe<M>::fields);
+        return n;
+    }
+
+    template <typename M>
+    inline std::size_t encode_varint(const M& m, char* out)
+    {
+        std::size_t n = 0;
+        std::apply([&](auto... f)
+        {
+            static_assert(((sizeof(field_t<decltype(f)>) <= sizeof(std::uint32_t)) && ...), "varints are 32 bits at most");
+            ((n += put_varint(static_cast<std::uint32_t>(m.*f), out+n)), ...);
+        }, Describe<M>::fields);
+        return n;
+    }
+
+    // returns the length, 0 if len is too short or a varint is invalid
+    template <typename M>
+    inline std::size_t decode_varint(const char* in, std::size_t len, M& m)
+    {
+        std::size_t n = 0;
+        bool good = true;
+        auto one = [&](auto f)
+        {
+            std::uint32_t x = 0;
+            std::size_t k = good ? get_varint(in+n, len-n, x) : 0;
+            good = k != 0;
+            n += k;
+            m.*f = static_cast<field_t<decltype(f)>>(x);
+        };
+        std::apply([&](auto... f){(one(f), ...);}, Describe<M>::fields);
+        return good ? n : 0;
+    }
+
+    // false once the len bytes at in cannot be the start of M in varints, however many bytes follow
+    template <typename M>
+    inline bool varint_viable(const char* in, std::size_t len)
+    {
+        std::size_t n = 0;
+        bool complete = true, viable = true;
+        auto one = [&](auto)
+        {
+            std::uint32_t x;
+            std::size_t k = complete ? get_varint(in+n, len-n, x) : 0;
+            if(complete && !k)viable = len-n < MaxVarintLength;
+            complete = k != 0;
+            n += k;
+        };
+        std::apply([&](auto... f){(one(f), ...);}, Describe<M>::fields);
+        return viable;
+    }
+
+    // in the given protocol version: fixed width in v1, varints from v2 on
+    template <typename M>
+    inline std::size_t encode(std::uint32_t version, const M& m, char* out)
+    {
+        return version == 1 ? encode(m, out) : encode_varint(m, out);
+    }
+
+    template <typename M>
+    inline std::size_t decode(std::uint32_t version, const char* in, std::size_t len, M& m)
+    {
+        return version == 1 ? decode(in, len, m) : decode_varint(in, len, m);
+    }
+}
+
+#endif // CODEC_HPP
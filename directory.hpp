@@ -0,0 +1,87 @@
+#ifndef DIRECTORY_HPP
+#define DIRECTORY_HPP
+
+#include <cstdint>
+#include <map>
+#include <shared_mutex>
+#include <string>
+#include <utility>
+#include <vector>
+
+// Pre-rendered listing lines ordered by id, for paginated `rooms`/`users` answers.
+// Lines are re-rendered by the owner of an entry when it changes, so a page only copies
+// the lines it returns. A version lets concurrent renderers of the same entry race safely:
+// an older rendering never overwrites a newer one.
+class Directory
+{
+    public:
+    using id_t = std::uint32_t;
+
+    private:
+    struct Entry
+    {
+        std::string line;
+        std::uint64_t version;
+    };
+
+    mutable std::shared_mutex mtx;
+    std::map<id_t, Entry> entries;
+
+    public:
+    void set(id_t id, std::string line, std::uint64_t version = 0)
+    {
+        std::unique_lock<std::shared_mutex> lock(mtx);
+        auto it = entries.find(id);
+        if(it == entries.end())entries.emplace(id, Entry{std::move(line), version});
+        else if(version >= it->second.version)it->second = Entry{std::move(line), version};
+    }
+
+    void erase(id_t id)
+    {
+        std::unique_lock<std::shared_mutex> lock(mtx);
+        entries.erase(id);
+    }
+
+    std::size_t size() const
+    {
+        std::shared_lock<std::shared_mutex> lock(mtx);
+        return entries.size();
+    }
+
+    // the ids >= cursor in order, at most max_count of them
+    std::vector<id_t> ids(id_t cursor, std::size_t max_count) const
+    {
+        std::shared_lock<std::shared_mutex> lock(mtx);
+        std::vector<id_t> out;
+        for(auto it = entries.lower_bound(cursor); it!=entries.end() && out.size()<max_count; ++it)
+            out.push_back(it->first);
+        return out;
+    }
+
+    // Appends the lines of ids >= cursor to out, at most max_count of them and max_bytes together.
+    // Returns the cursor of the next page, 0 when there is none.
+    id_t page(id_t cursor, std::size_t max_count, std::size_t max_bytes, std::vector<std::pair<id_t,std::string>>& out) const
+    {
+        std::shared_lock<std::shared_mutex> lock(mtx);
+        std::size_t bytes = 0;
+        auto it = entries.lower_bound(cursor);
+        for(std::size_t n=0; it!=entries.end() && n<max_count; ++it, ++n)
+        {
+            if(bytes + it->second.line.size() > max_bytes)
+            {
+                // a single line longer than a whole page is cut rather than skipped forever
+                if(n == 0)
+                {
+                    out.emplace_back(it->first, it->second.line.substr(0, max_bytes));
+                    ++it;
+                }
+                break;
+            }
+            bytes += it->second.line.size();
+            out.emplace_back(it->first, it->second.line);
+        }
+        return it==entries.end() ? 0 : it->first;
+    }
+};
+
+#endif // DIRECTORY_HPP
@@ -0,0 +1,129 @@
+#ifndef FANOUT_HPP
+#define FANOUT_HPP
+
+#include <boost/asio.hpp>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+#include "io_shard.hpp"
+
+using namespace boost;
+
+// The members of a room, split by the io shard they live on.
+// A small room delivers to all of them right away, on the thread that posts. Once it has had spread_at
+// members, a post only hands the frame to every shard with members, and the shards deliver to their own
+// ones in parallel: the poster does O(shards) work instead of O(members). The room stays spread from
+// then on, so that none of its frames overtakes an earlier one.
+// The room's lock guards it; a part's own lock is also taken by changes, so that its shard can deliver without the room's.
+template <typename M>
+class Fanout
+{
+    private:
+    struct Part
+    {
+        IoShard* shard;
+        std::mutex mtx;
+        std::vector<std::pair<M, std::uint64_t>> members;   // with the number of the last post before they joined
+        std::unordered_map<typename M::element_type*, std::size_t> position;
+
+        Part(IoShard& s):shard(&s)
+        {}
+    };
+
+    std::vector<std::shared_ptr<Part>> parts;
+    std::size_t spread_at;
+    std::size_t count = 0;
+    std::uint64_t posts = 0;
+    bool spread = false;
+
+    // null if the shard has never had a member here
+    Part* find_part(IoShard& shard)
+    {
+        for(auto& p:parts)
+            if(p->shard == &shard)return p.get();
+        return nullptr;
+    }
+
+    Part& part(IoShard& shard)
+    {
+        if(Part* p = find_part(shard))return *p;
+        parts.push_back(std::make_shared<Part>(shard));
+        return *parts.back();
+    }
+
+    public:
+    explicit Fanout(std::size_t spread_at):spread_at(spread_at)
+    {}
+
+    void insert(const M& member, IoShard& shard)
+    {
+        Part& p = part(shard);
+        std::lock_guard<std::mutex> lock(p.mtx);
+        if(!p.position.emplace(member.get(), p.members.size()).second)return;
+        p.members.emplace_back(member, posts);
+        if(++count >= spread_at)spread = true;
+    }
+
+    // false if it was not a member
+    bool erase(const M& member, IoShard& shard)
+    {
+        Part* found = find_part(shard);
+        if(!found)return false;
+        Part& p = *found;
+        std::lock_guard<std::mutex> lock(p.mtx);
+        auto it = p.position.find(member.get());
+        if(it == p.position.end())return false;
+        std::size_t pos = it->second;
+        p.position.erase(it);
+        if(pos != p.members.size()-1)
+        {
+            p.members[pos] = std::move(p.members.back());
+            p.position[p.members[pos].first.get()] = pos;
+        }
+        p.members.pop_back();
+        count--;
+        return true;
+    }
+
+    std::size_t size() const {return count;}
+    bool empty() const {return count == 0;}
+
+    // f(member) returns false to stop; false if it did
+    template <typename F>
+    bool for_each(F f) const
+    {
+        for(auto& p:parts)
+            for(auto& m:p->members)
+                if(!f(m.first))return false;
+        return true;
+    }
+
+    // Calls f(member) for every member: right away, or later on the member's shard if the room is spread.
+    // Each shard then gets a copy of f, and a member that joins in between does not get the frame.
+    template <typename F>
+    void deliver(F f)
+    {
+        std::uint64_t post = ++posts;
+        if(!spread)
+        {
+            for(auto& p:parts)
+                for(auto& m:p->members)f(m.first);
+            return;
+        }
+        for(auto& p:parts)
+        {
+            if(p->members.empty())continue;
+            asio::post(p->shard->context(), [p, f, post]() mutable
+            {
+                std::lock_guard<std::mutex> lock(p->mtx);
+                for(auto& m:p->members)
+                    if(m.second < post)f(m.first);
+            });
+        }
+    }
+};
+
+#endif // FANOUT_HPP
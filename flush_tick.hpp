@@ -0,0 +1,84 @@
+#ifndef FLUSH_TICK_HPP
+#define FLUSH_TICK_HPP
+
+#include <boost/asio.hpp>
+#include <chrono>
+#include <functional>
+#include <vector>
+
+using namespace boost;
+
+// Holds back the writes that idle sessions of one shard would start, and starts them together at the
+// next tick: the messages a busy room sends within a tick leave every member in one gather write instead
+// of one write each. Nothing waits longer than a tick.
+// With busy_at, it only holds back while the shard is busy, that is once busy_at writes were to start
+// within the previous tick; a quiet shard writes right away.
+// Only used on the thread of its shard.
+template <typename P>
+class FlushTick
+{
+    private:
+    using clock = std::chrono::steady_clock;
+    asio::steady_timer timer;
+    clock::duration period;
+    std::size_t busy_at;
+    std::function<void(const P&)> flush;
+    std::vector<P> due, flushing;
+    bool armed = false;
+    clock::time_point window;   // when the tick that counts the starts began
+    std::size_t starts = 0, last_starts = 0;
+
+    bool busy()
+    {
+        if(busy_at == 0)return true;
+        auto now = clock::now();
+        if(now-window >= period)
+        {
+            // a tick without any start in between counts as quiet
+            last_starts = now-window < 2*period ? starts : 0;
+            starts = 0;
+            window = now;
+        }
+        return ++starts > busy_at || last_starts >= busy_at;
+    }
+
+    void fire()
+    {
+        flushing.swap(due);
+        for(auto& p:flushing)flush(p);
+        flushing.clear();
+    }
+
+    public:
+    // true if p is flushed at the next tick, false if the caller has to flush it now
+    bool defer(const P& p)
+    {
+        if(period == clock::duration::zero() || !busy())return false;
+        due.push_back(p);
+        if(!armed)
+        {
+            armed = true;
+            timer.expires_after(period);
+            timer.async_wait([this](const boost::system::error_code& eno)
+            {
+                armed = false;
+                if(!eno)fire();
+            });
+        }
+        return true;
+    }
+
+    // forgets what is due: the io is stopped, and whoever starts it again flushes every session
+    void cancel()
+    {
+        timer.cancel();
+        due.clear();
+    }
+
+    // a zero period never holds anything back
+    FlushTick(asio::io_context& ctx, clock::duration tick, std::size_t busy, std::function<void(const P&)> f):
+        timer(ctx), period(tick), busy_at(busy), flush(std::move(f)), window(clock::now())
+    {}
+};
+
+#endif // FLUSH_TICK_HPP
@@ -0,0 +1,213 @@
+#ifndef FRAME_HPP
+#define FRAME_HPP
+
+#include <boost/asio.hpp>
+#include <algorithm>
+#include <initializer_list>
+#include <memory>
+#include <string_view>
+#include <vector>
+#include "protocol.h"
+#include "codec.hpp"
+#include "messages.hpp"
+#include "buffer_pool.hpp"
+
+// An encoded Server_to_Client message (header + body).
+// Immutable once built, so one instance can be handed to any number of sockets.
+class Frame
+{
+    private:
+    using msg_t = Protocol::Message::Server_to_Client;
+    static const int header_length = Messages::header_length;
+
+    std::vector<char,PoolAllocator<char>> bytes;
+    // external storage, used instead of bytes when set
+    std::shared_ptr<const void> storage;
+    const char* external = nullptr;
+    std::size_t external_size = 0;
+    std::uint8_t protocol = 1;  // wire format of the messages: frames are built in v1, converted for v2 sessions
+
+    void write_header(msg_t::header_t::type_t type, std::uint32_t body_len)
+    {
+        Codec::encode(msg_t::header_t{type, body_len}, bytes.data());
+    }
+
+    public:
+    const char* data() const {return external ? external : bytes.data();}
+    std::size_t size() const {return external ? external_size : bytes.size();}
+    std::uint8_t version() const {return protocol;}
+    msg_t::header_t::type_t type() const
+    {
+        msg_t::header_t header{};
+        Codec::decode(protocol, data(), size(), header);
+        return header.type;
+    }
+    asio::const_buffer buffer() const {return asio::buffer(data(),size());}
+
+    Frame(msg_t::header_t::type_t type, const char* body, std::uint32_t body_len):bytes(header_length+body_len)
+    {
+        write_header(type, body_len);
+        std::copy(body,body+body_len,bytes.data()+header_length);
+    }
+
+    // A string body is the concatenation of parts, sent with '\0'
+    // and cut to what the client is able to receive.
+    Frame(msg_t::header_t::type_t type, std::initializer_list<std::string_view> parts)
+    {
+        std::size_t len = 0;
+        for(auto part:parts)len += part.size();
+        std::uint32_t body_len = std::min<std::size_t>(len+1, Protocol::BodyMaxLength);
+        bytes.resize(header_length+body_len);
+        write_header(type, body_len);
+
+        char* out = bytes.data()+header_length;
+        char* last = out+body_len-1;
+        for(auto part:parts)
+            out = std::copy_n(part.data(), std::min<std::size_t>(part.size(), last-out), out);
+        *last = '\0';
+    }
+
+    // size bytes of already encoded messages (one or more) at data, which owner keeps alive
+    Frame(std::shared_ptr<const void> owner, const char* data, std::size_t size, std::uint8_t version = 1):
+        storage(std::move(owner)), external(data), external_size(size), protocol(version)
+    {}
+
+    // already encoded messages
+    Frame(std::vector<char,PoolAllocator<char>>&& encoded, std::uint8_t version):
+        bytes(std::move(encoded)), protocol(version)
+    {}
+};
+using FramePtr = std::shared_ptr<const Frame>;
+
+// frames (and their control block) come from the buffer pool
+template <typename... Args>
+FramePtr MakeFrame(Args&&... args)
+{
+    return std::allocate_shared<Frame>(PoolAllocator<Frame>(), std::forward<Args>(args)...);
+}
+
+// Re-encodes v1 frames for a v2 session: varint headers, numbers as varints, strings without
+// their '\0'. With batches, consecutive messages are packed into batch frames of up to
+// BatchMaxLength bytes of body; a lone message goes out as it is.
+class V2Encoder
+{
+    private:
+    using msg_t = Protocol::Message::Server_to_Client;
+    using bytes_t = std::vector<char,PoolAllocator<char>>;
+    static const int v1_header_length = Messages::header_length;
+
+    bool batches;
+    bytes_t out;                // messages not emitted yet
+    std::size_t count = 0;
+
+    static void put_header(bytes_t& v, msg_t::header_t::type_t type, std::size_t body_len)
+    {
+        char buf[Messages::max_header_length_v2];
+        v.insert(v.end(), buf, buf+Codec::encode_varint(msg_t::header_t{type, static_cast<std::uint32_t>(body_len)}, buf));
+    }
+
+    // the fixed part M at the front of a v1 body, moved past and written to out as varints
+    template <typename M>
+    static std::size_t reencode(const char*& body, std::uint32_t& len, char* out)
+    {
+        M m;
+        std::size_t n = Codec::decode(body, len, m);
+        if(!n)return 0;
+        body += n, len -= n;
+        return Codec::encode_varint(m, out);
+    }
+
+    // one message, its body given in v1
+    static void convert(msg_t::header_t::type_t type, const char* body, std::uint32_t len, bytes_t& v)
+    {
+        char numbers[Codec::max_varint_size<Messages::Session>()];
+        std::size_t n = 0;
+        if(type == msg_t::header_t::roomchange)n = reencode<Messages::RoomChange>(body, len, numbers);
+        else if(type == msg_t::header_t::listing)n = reencode<Messages::Listing>(body, len, numbers);
+        else if(type == msg_t::header_t::ping)n = reencode<Messages::ServerPing>(body, len, numbers);
+        else if(type == msg_t::header_t::pong)n = reencode<Messages::ServerPong>(body, len, numbers);
+        else if(type == msg_t::header_t::session)n = reencode<Messages::Session>(body, len, numbers);
+        else if(type == msg_t::header_t::resumed)n = reencode<Messages::Resumed>(body, len, numbers);
+        if((type == msg_t::header_t::print || type == msg_t::header_t::listing || type == msg_t::header_t::resumed) && len && body[len-1] == '\0')len--;
+
+        put_header(v, type, n+len);
+        v.insert(v.end(), numbers, numbers+n);
+        v.insert(v.end(), body, body+len);
+    }
+
+    public:
+    // every message of a v1 frame; emit(FramePtr) receives the frames ready to be sent
+    template <typename F>
+    void add(const Frame& v1, F&& emit)
+    {
+        const char* p = v1.data();
+        const char* end = p+v1.size();
+        msg_t::header_t header;
+        while(Codec::decode(p, end-p, header))
+        {
+            p += v1_header_length;
+            if(static_cast<std::size_t>(end-p) < header.body_len)break;
+
+            if(!batches)convert(header.type, p, header.body_len, out);
+            else
+            {
+                thread_local bytes_t msg;
+                msg.clear();
+                convert(header.type, p, header.body_len, msg);
+                if(count && out.size()+msg.size() > Protocol::BatchMaxLength)finish(emit);
+                out.insert(out.end(), msg.begin(), msg.end());
+            }
+            count++;
+            p += header.body_len;
+        }
+        if(!batches)finish(emit);
+    }
+
+    template <typename F>
+    void finish(F&& emit)
+    {
+        if(!count)return;
+        if(count > 1 && batches)
+        {
+            bytes_t wrapped;
+            wrapped.reserve(Messages::max_header_length_v2+out.size());
+            put_header(wrapped, msg_t::header_t::batch, out.size());
+            wrapped.insert(wrapped.end(), out.begin(), out.end());
+            out.swap(wrapped);
+        }
+        emit(std::allocate_shared<Frame>(PoolAllocator<Frame>(), std::move(out), 2));
+        out = bytes_t();
+        count = 0;
+    }
+
+    V2Encoder(bool batches):batches(batches)
+    {}
+};
+
+// a v1 frame as one v2 frame (without batches)
+inline FramePtr ToV2(const Frame& v1)
+{
+    FramePtr f;
+    V2Encoder(false).add(v1, [&](FramePtr x){f = std::move(x);});
+    return f;
+}
+
+// Non-owning view of a gather batch. asio copies the buffer sequence into its write
+// operation; copying this is free where copying a std::vector would allocate.
+class BufferView
+{
+    private:
+    const asio::const_buffer *first, *last;
+
+    public:
+    using value_type = asio::const_buffer;
+    using const_iterator = const asio::const_buffer*;
+
+    const_iterator begin() const {return first;}
+    const_iterator end() const {return last;}
+
+    BufferView(const std::vector<asio::const_buffer>& v):first(v.data()), last(v.data()+v.size())
+    {}
+};
+
+#endif // FRAME_HPP
@@ -0,0 +1,135 @@
+#ifndef HANDOFF_HPP
+#define HANDOFF_HPP
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <string_view>
+#include <vector>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include "tools.hpp"
+
+// Hot restart: the running server hands its state and its sockets to a new process over a
+// Unix domain socket. The snapshot is sent as a length-prefixed blob, then the descriptors
+// travel as SCM_RIGHTS ancillary data in groups, and the new process acknowledges with one byte
+// once it has everything, so that the old one can exit. Without it the old one serves on.
+namespace Handoff
+{
+    const std::uint32_t Magic = 0x4d79494d; // "MyIM"
+    const std::uint32_t Version = 3;
+    const std::size_t FdsPerMessage = 250;  // below the kernel's SCM_MAX_FD
+    const char Ack = 'K';
+
+    inline bool write_all(int sock, const char* data, std::size_t n)
+    {
+        while(n)
+        {
+            ssize_t k = ::send(sock, data, n, MSG_NOSIGNAL);
+            if(k <= 0)return false;
+            data += k;
+            n -= k;
+        }
+        return true;
+    }
+
+    inline bool read_all(int sock, char* data, std::size_t n)
+    {
+        while(n)
+        {
+            ssize_t k = ::recv(sock, data, n, 0);
+            if(k <= 0)return false;
+            data += k;
+            n -= k;
+        }
+        return true;
+    }
+
+    // one byte of data carrying up to FdsPerMessage descriptors
+    inline bool send_fds(int sock, const int* fds, std::size_t n)
+    {
+        char byte = 0;
+        iovec iov{&byte, 1};
+        std::vector<char> control(CMSG_SPACE(sizeof(int)*n));
+        msghdr msg{};
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = control.data();
+        msg.msg_controllen = control.size();
+        cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(int)*n);
+        std::memcpy(CMSG_DATA(cmsg), fds, sizeof(int)*n);
+        return ::sendmsg(sock, &msg, MSG_NOSIGNAL) == 1;
+    }
+
+    inline bool recv_fds(int sock, std::vector<int>& fds, std::size_t n)
+    {
+        char byte;
+        iovec iov{&byte, 1};
+        std::vector<char> control(CMSG_SPACE(sizeof(int)*n));
+        msghdr msg{};
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = control.data();
+        msg.msg_controllen = control.size();
+        if(::recvmsg(sock, &msg, MSG_CMSG_CLOEXEC) != 1 || (msg.msg_flags & MSG_CTRUNC))return false;
+        cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+        if(!cmsg || cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS)return false;
+        std::size_t got = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+        const int* data = reinterpret_cast<const int*>(CMSG_DATA(cmsg));
+        fds.insert(fds.end(), data, data+got);
+        return got == n;
+    }
+
+    // old process: snapshot then descriptors, and wait for the acknowledgement
+    inline bool send_state(int sock, const std::string& snapshot, const std::vector<int>& fds)
+    {
+        Tools::Writer header;
+        header.u64(snapshot.size());
+        header.u32(static_cast<std::uint32_t>(fds.size()));
+        if(!write_all(sock, header.str().data(), header.str().size()))return false;
+        if(!write_all(sock, snapshot.data(), snapshot.size()))return false;
+        for(std::size_t i=0;i<fds.size();i+=FdsPerMessage)
+            if(!send_fds(sock, fds.data()+i, std::min(FdsPerMessage, fds.size()-i)))return false;
+        char ack;
+        return read_all(sock, &ack, 1) && ack == Ack;
+    }
+
+    // new process: the counterpart of send_state; acknowledge once the snapshot has been checked
+    inline bool receive_state(int sock, std::string& snapshot, std::vector<int>& fds)
+    {
+        char header_buf[12];
+        if(!read_all(sock, header_buf, sizeof(header_buf)))return false;
+        Tools::Reader header(std::string_view(header_buf, sizeof(header_buf)));
+        std::uint64_t length = header.u64();
+        std::uint32_t count = header.u32();
+        snapshot.resize(length);
+        if(!read_all(sock, &snapshot[0], length))return false;
+        for(std::size_t i=0;i<count;i+=FdsPerMessage)
+            if(!recv_fds(sock, fds, std::min<std::size_t>(FdsPerMessage, count-i)))return false;
+        return true;
+    }
+
+    inline bool acknowledge(int sock)
+    {
+        return write_all(sock, &Ack, 1);
+    }
+
+    // a connected Unix stream socket, -1 on failure
+    inline int connect_to(const std::string& path)
+    {
+        int sock = ::socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        sockaddr_un addr{};
+        addr.sun_family = AF_UNIX;
+        std::strncpy(addr.sun_path, path.c_str(), sizeof(addr.sun_path)-1);
+        if(sock >= 0 && ::connect(sock, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) == 0)return sock;
+        if(sock >= 0)::close(sock);
+        return -1;
+    }
+}
+
+#endif // HANDOFF_HPP
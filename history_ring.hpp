@@ -0,0 +1,42 @@
+#ifndef HISTORY_RING_HPP
+#define HISTORY_RING_HPP
+
+#include <algorithm>
+#include <cstddef>
+#include <vector>
+#include "frame.hpp"
+
+// The last frames said in a room, kept in one preallocated array.
+// Frames are shared, so a replay hands out the very buffers that were broadcast.
+class HistoryRing
+{
+    private:
+    std::vector<FramePtr> frames;
+    std::size_t next = 0, count = 0;
+
+    public:
+    std::size_t size() const {return count;}
+
+    void push(FramePtr frame)
+    {
+        if(frames.empty())return;
+        frames[next] = std::move(frame);
+        next = (next+1) % frames.size();
+        count = std::min(count+1, frames.size());
+    }
+
+    // calls f for the last k frames, oldest first
+    template <typename F>
+    void for_each_last(std::size_t k, F f) const
+    {
+        k = std::min(k, count);
+        for(std::size_t i=0;i<k;i++)
+            f(frames[(next+frames.size()-k+i) % frames.size()]);
+    }
+
+    // capacity 0 keeps nothing
+    HistoryRing(std::size_t capacity):frames(capacity)
+    {}
+};
+
+#endif // HISTORY_RING_HPP
@@ -0,0 +1,70 @@
+#ifndef IO_SHARD_HPP
+#define IO_SHARD_HPP
+
+#include <boost/asio.hpp>
+#include <atomic>
+#include <memory>
+#include <optional>
+#include <thread>
+#include <pthread.h>
+#include "uring.hpp"
+
+using namespace boost;
+
+// One io_context driven by exactly one thread.
+// Every handler of a session runs on its home shard, so per-session state needs no strand.
+// A stopped shard can be started again, with whatever was left in its queue.
+// With an io_uring, the sessions of the shard do their io through it instead of the io_context's epoll.
+class IoShard
+{
+    private:
+    asio::io_context ctx;
+    std::optional<asio::executor_work_guard<asio::io_context::executor_type>> work;
+    std::thread thread;
+    std::atomic<std::size_t> sessions{0};
+    std::unique_ptr<Uring> uring;   // null: asio's reactor does all the io
+
+    public:
+    asio::io_context& context(){return ctx;}
+    Uring* ring(){return uring.get();}
+    std::size_t load() const {return sessions.load(std::memory_order_relaxed);}
+    void attach(){sessions.fetch_add(1, std::memory_order_relaxed);}
+    void detach(){sessions.fetch_sub(1, std::memory_order_relaxed);}
+
+    // cpu < 0 leaves the thread unpinned
+    void start(int cpu = -1)
+    {
+        ctx.restart();
+        work.emplace(ctx.get_executor());
+        thread = std::thread([this]{ctx.run();});
+        if(cpu >= 0)
+        {
+            cpu_set_t set;
+            CPU_ZERO(&set);
+            CPU_SET(cpu, &set);
+            pthread_setaffinity_np(thread.native_handle(), sizeof(set), &set);
+        }
+    }
+
+    // gives the shard an io_uring; false if the kernel does not have one to give
+    bool open_ring(unsigned entries, unsigned buffers, unsigned buffer_size)
+    {
+        uring.reset(new Uring(ctx));
+        if(!uring->open(entries, buffers, buffer_size))uring.reset();
+        return uring != nullptr;
+    }
+
+    void close_ring(){uring.reset();}
+
+    void stop()
+    {
+        work.reset();
+        ctx.stop();
+        if(thread.joinable())thread.join();
+    }
+
+    IoShard()
+    {}
+};
+
+#endif // IO_SHARD_HPP
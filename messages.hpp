@@ -0,0 +1,163 @@
+#ifndef MESSAGES_HPP
+#define MESSAGES_HPP
+
+#include "protocol.h"
+#include "codec.hpp"
+
+// The fixed part of every message, declared once for Codec: headers, and the numbers at the front
+// of a body. Whatever follows them (a string, a listing's text) is the rest of the body.
+// Request and reply structs know their type.
+template <>
+struct Codec::Describe<Protocol::Message::Client_to_Server::header_t>
+{
+    using M = Protocol::Message::Client_to_Server::header_t;
+    static constexpr auto fields = Codec::fields(&M::type, &M::body_len);
+};
+
+template <>
+struct Codec::Describe<Protocol::Message::Server_to_Client::header_t>
+{
+    using M = Protocol::Message::Server_to_Client::header_t;
+    static constexpr auto fields = Codec::fields(&M::type, &M::body_len);
+};
+
+namespace Messages
+{
+    using request_t = Protocol::Message::Client_to_Server::header_t;
+    using reply_t = Protocol::Message::Server_to_Client::header_t;
+
+    // a v1 header is 8 bytes, a v2 one at most 10
+    const std::size_t header_length = Codec::fixed_size<request_t>();
+    const std::size_t max_header_length_v2 = Codec::max_varint_size<request_t>();
+
+    struct Enter
+    {
+        static constexpr auto type = request_t::enter;
+        Protocol::id_t room;
+        static constexpr auto fields = Codec::fields(&Enter::room);
+    };
+
+    struct List
+    {
+        static constexpr auto type = request_t::list;
+        Protocol::Message::list_kind_t kind;
+        Protocol::id_t cursor;
+        std::uint32_t page_size;
+        static constexpr auto fields = Codec::fields(&List::kind, &List::cursor, &List::page_size);
+    };
+
+    struct History
+    {
+        static constexpr auto type = request_t::history;
+        Protocol::id_t room;
+        std::uint32_t from, count;  // from 0: the last ones
+        static constexpr auto fields = Codec::fields(&History::room, &History::from, &History::count);
+    };
+
+    // always sent in v1, as is the answer
+    struct Hello
+    {
+        static constexpr auto type = request_t::hello;
+        std::uint32_t version, caps;
+        static constexpr auto fields = Codec::fields(&Hello::version, &Hello::caps);
+    };
+
+    struct HelloReply
+    {
+        static constexpr auto type = reply_t::hello;
+        std::uint32_t version, caps;
+        static constexpr auto fields = Codec::fields(&HelloReply::version, &HelloReply::caps);
+    };
+
+    // heartbeats of a cap_ping session, either way: a ping is answered by a pong with its token
+    struct Ping
+    {
+        static constexpr auto type = request_t::ping;
+        std::uint32_t token;
+        static constexpr auto fields = Codec::fields(&Ping::token);
+    };
+
+    struct Pong
+    {
+        static constexpr auto type = request_t::pong;
+        std::uint32_t token;
+        static constexpr auto fields = Codec::fields(&Pong::token);
+    };
+
+    struct ServerPing
+    {
+        static constexpr auto type = reply_t::ping;
+        std::uint32_t token;
+        static constexpr auto fields = Codec::fields(&ServerPing::token);
+    };
+
+    struct ServerPong
+    {
+        static constexpr auto type = reply_t::pong;
+        std::uint32_t token;
+        static constexpr auto fields = Codec::fields(&ServerPong::token);
+    };
+
+    // a cap_resume session is told how to come back to it, and comes back with the same numbers
+    struct Session
+    {
+        static constexpr auto type = reply_t::session;
+        Protocol::id_t id;
+        std::uint32_t token_high, token_low;
+        static constexpr auto fields = Codec::fields(&Session::id, &Session::token_high, &Session::token_low);
+    };
+
+    struct Resume
+    {
+        static constexpr auto type = request_t::resume;
+        Protocol::id_t id;
+        std::uint32_t token_high, token_low;
+        static constexpr auto fields = Codec::fields(&Resume::id, &Resume::token_high, &Resume::token_low);
+    };
+
+    // followed by the name
+    struct Resumed
+    {
+        static constexpr auto type = reply_t::resumed;
+        Protocol::id_t id;      // 0: not resumed
+        Protocol::id_t room;
+        static constexpr auto fields = Codec::fields(&Resumed::id, &Resumed::room);
+    };
+
+    struct RoomChange
+    {
+        static constexpr auto type = reply_t::roomchange;
+        Protocol::id_t room;
+        static constexpr auto fields = Codec::fields(&RoomChange::room);
+    };
+
+    // followed by the text of the page
+    struct Listing
+    {
+        static constexpr auto type = reply_t::listing;
+        Protocol::Message::list_kind_t kind;
+        Protocol::id_t next;    // 0: last page
+        static constexpr auto fields = Codec::fields(&Listing::kind, &Listing::next);
+    };
+
+    // a whole message with a generated body, in the given version; out holds
+    // max_header_length_v2 + Codec::fixed_size<M>() bytes
+    template <typename M>
+    inline std::size_t Encode(std::uint32_t version, const M& m, char* out)
+    {
+        using header_t = std::conditional_t<std::is_same_v<std::decay_t<decltype(M::type)>, request_t::type_t>, request_t, reply_t>;
+        if(version == 1)
+        {
+            // the body length is known up front: everything is written in place
+            Codec::encode(header_t{M::type, static_cast<std::uint32_t>(Codec::fixed_size<M>())}, out);
+            return header_length + Codec::encode(m, out+header_length);
+        }
+        char body[Codec::max_varint_size<M>()];
+        std::uint32_t body_len = static_cast<std::uint32_t>(Codec::encode_varint(m, body));
+        std::size_t n = Codec::encode_varint(header_t{M::type, body_len}, out);
+        std::memcpy(out+n, body, body_len);
+        return n+body_len;
+    }
+}
+
+#endif // MESSAGES_HPP
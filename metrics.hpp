@@ -0,0 +1,272 @@
+#ifndef METRICS_HPP
+#define METRICS_HPP
+
+#include <boost/asio.hpp>
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <iomanip>
+#include <sstream>
+#include <string>
+#include <utility>
+#include <vector>
+#include "protocol.h"
+
+// Server counters and histograms. Every thread adds to its own cache-line aligned slot with
+// relaxed atomics and a report sums the slots, so recording never touches shared lines.
+namespace Metrics
+{
+    // frame types from here on are counted together in the last entry
+    const std::size_t MaxTypes = 20;
+
+    enum counter_t
+    {
+        accepts,
+        accept_errors,
+        accept_rejects,         // connections turned away, the server was full
+        accept_pauses,          // accepting stopped for a while, the accept rate ran out
+        bytes_in,
+        bytes_out,
+        reads,
+        writes,
+        writes_deferred,        // writes held back for the flush tick
+        read_errors,
+        write_errors,
+        bad_frames,
+        sessions_closed,
+        sessions_reaped,        // closed after idle_timeout without a byte from the client
+        pings,                  // sent to sessions that had been silent for ping_interval
+        sessions_detached,      // connections that dropped, their sessions kept for a resume
+        sessions_resumed,
+        resume_failed,          // resumes with an unknown session or a wrong token
+        rooms_dropped,          // rooms closed when their last member left
+        overflow_drop,          // a backlog went over its budget and its oldest chat frames were dropped
+        overflow_collapse,      // the same, the client is told how many were skipped
+        overflow_disconnect,    // a session was closed for its backlog
+        frames_dropped,
+        ceiling_hits,           // an overflow came from the global ceiling rather than the session budget
+        log_appends,
+        log_bytes,
+        log_syncs,
+        log_dropped,            // chat not logged: the writer was too far behind or a segment could not be created
+        peer_in,                // frames from other nodes
+        peer_out,               // messages to other nodes
+        peer_dropped,           // messages not sent: the link was down or too far behind
+        gather_timeouts,        // listings that went out without the answer of every node
+        counter_count
+    };
+    const std::array<const char*,counter_count> counter_names = {
+        "accepts", "accept_errors", "accept_rejects", "accept_pauses", "bytes_in", "bytes_out", "reads", "writes", "writes_deferred",
+        "read_errors", "write_errors", "bad_frames", "sessions_closed", "sessions_reaped", "pings",
+        "sessions_detached", "sessions_resumed", "resume_failed", "rooms_dropped",
+        "overflow_drop", "overflow_collapse", "overflow_disconnect", "frames_dropped", "ceiling_hits",
+        "log_appends", "log_bytes", "log_syncs", "log_dropped",
+        "peer_in", "peer_out", "peer_dropped", "gather_timeouts"
+    };
+    const std::vector<const char*> recv_type_names = {
+        "rename", "rooms", "users", "enter", "leave", "find", "newroom", "randroom", "text", "list", "history", "hello", "batch", "ping", "pong", "resume"
+    };
+    const std::vector<const char*> send_type_names = {"print", "roomchange", "listing", "hello", "batch", "ping", "pong", "session", "resumed"};
+
+    // power of two buckets: bucket i counts the values v with 2^(i-1) <= v < 2^i
+    const std::size_t Buckets = 48;
+
+    inline std::size_t bucket_of(std::uint64_t v)
+    {
+        std::size_t b = v ? 64-__builtin_clzll(v) : 0;
+        return std::min(b, Buckets-1);
+    }
+
+    struct Histogram
+    {
+        std::array<std::atomic<std::uint64_t>,Buckets> buckets{};
+        std::atomic<std::uint64_t> count{0}, sum{0}, max{0};
+
+        void add(std::uint64_t v)
+        {
+            buckets[bucket_of(v)].fetch_add(1, std::memory_order_relaxed);
+            count.fetch_add(1, std::memory_order_relaxed);
+            sum.fetch_add(v, std::memory_order_relaxed);
+            std::uint64_t m = max.load(std::memory_order_relaxed);
+            while(v > m && !max.compare_exchange_weak(m, v, std::memory_order_relaxed));
+        }
+    };
+
+    struct alignas(64) Slot
+    {
+        std::array<std::atomic<std::uint64_t>,counter_count> counters{};
+        std::array<std::atomic<std::uint64_t>,MaxTypes> frames_in{}, frames_out{};
+        std::array<Histogram,MaxTypes> handler_ns;  // time spent dispatching a frame, per received type
+        Histogram send_batch;                       // frames per gather write
+    };
+
+    // one slot per thread, the last one is shared once they run out
+    inline std::array<Slot,64> slots;
+    inline std::atomic<std::size_t> next_slot{0};
+    inline const std::chrono::steady_clock::time_point start_time = std::chrono::steady_clock::now();
+
+    inline Slot& local()
+    {
+        thread_local Slot* slot = &slots[std::min(next_slot.fetch_add(1), slots.size()-1)];
+        return *slot;
+    }
+
+    inline std::size_t type_index(std::uint32_t type){return std::min<std::size_t>(type, MaxTypes-1);}
+
+    inline void add(counter_t c, std::uint64_t n = 1){local().counters[c].fetch_add(n, std::memory_order_relaxed);}
+    inline void frame_in(std::uint32_t type){local().frames_in[type_index(type)].fetch_add(1, std::memory_order_relaxed);}
+    inline void frame_out(std::uint32_t type){local().frames_out[type_index(type)].fetch_add(1, std::memory_order_relaxed);}
+    inline void handler_time(std::uint32_t type, std::uint64_t ns){local().handler_ns[type_index(type)].add(ns);}
+    inline void send_batch(std::size_t frames){local().send_batch.add(frames);}
+
+    // measures the lifetime of the object
+    class ScopedTimer
+    {
+        private:
+        std::uint32_t type;
+        std::chrono::steady_clock::time_point begin;
+
+        public:
+        ScopedTimer(std::uint32_t t):type(t), begin(std::chrono::steady_clock::now())
+        {}
+
+        ~ScopedTimer()
+        {
+            auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now()-begin).count();
+            handler_time(type, ns);
+        }
+    };
+
+    // plain sum of the histograms of all slots
+    struct Summary
+    {
+        std::array<std::uint64_t,Buckets> buckets{};
+        std::uint64_t count = 0, sum = 0, max = 0;
+
+        void merge(const Histogram& h)
+        {
+            for(std::size_t i=0;i<Buckets;i++)buckets[i] += h.buckets[i].load(std::memory_order_relaxed);
+            count += h.count.load(std::memory_order_relaxed);
+            sum += h.sum.load(std::memory_order_relaxed);
+            max = std::max(max, h.max.load(std::memory_order_relaxed));
+        }
+
+        // upper bound of the bucket holding the q-quantile
+        std::uint64_t quantile(double q) const
+        {
+            std::uint64_t rank = static_cast<std::uint64_t>(q*count), seen = 0;
+            for(std::size_t i=0;i<Buckets;i++)
+            {
+                seen += buckets[i];
+                if(seen > rank)return std::min(max, i ? (std::uint64_t(1) << i)-1 : 0);
+            }
+            return max;
+        }
+    };
+
+    struct Snapshot
+    {
+        std::chrono::steady_clock::time_point time;
+        std::array<std::uint64_t,counter_count> counters{};
+        std::array<std::uint64_t,MaxTypes> frames_in{}, frames_out{};
+        std::array<Summary,MaxTypes> handler_ns{};
+        Summary send_batch{};
+    };
+
+    inline Snapshot collect()
+    {
+        Snapshot s;
+        s.time = std::chrono::steady_clock::now();
+        for(auto& slot:slots)
+        {
+            for(std::size_t i=0;i<counter_count;i++)s.counters[i] += slot.counters[i].load(std::memory_order_relaxed);
+            for(std::size_t i=0;i<MaxTypes;i++)
+            {
+                s.frames_in[i] += slot.frames_in[i].load(std::memory_order_relaxed);
+                s.frames_out[i] += slot.frames_out[i].load(std::memory_order_relaxed);
+                s.handler_ns[i].merge(slot.handler_ns[i]);
+            }
+            s.send_batch.merge(slot.send_batch);
+        }
+        return s;
+    }
+
+    // Formats the totals, and the rates since the previous report of the same reporter.
+    // A reporter must only be used by one thread at a time.
+    class Reporter
+    {
+        private:
+        Snapshot last;
+        std::vector<std::pair<std::string,std::uint64_t>> last_totals;
+        bool has_last = false;
+
+        static std::string type_name(const std::vector<const char*>& names, std::size_t i)
+        {
+            if(i < names.size())return names[i];
+            return i==MaxTypes-1 ? "other" : "type" + std::to_string(i);
+        }
+
+        public:
+        // gauges are current values (sessions, rooms...), totals are cumulative values kept elsewhere
+        // (e.g. allocations) that get a rate like the counters
+        std::string report(const std::vector<std::pair<std::string,std::uint64_t>>& gauges,
+            const std::vector<std::pair<std::string,std::uint64_t>>& totals = {})
+        {
+            Snapshot now = collect();
+            const Snapshot& prev = has_last ? last : Snapshot{start_time};
+            double seconds = std::max(1e-9, std::chrono::duration<double>(now.time-prev.time).count());
+            auto rate = [&](std::uint64_t cur, std::uint64_t old){return (cur-old)/seconds;};
+
+            std::stringstream ss;
+            ss << std::fixed << std::setprecision(1);
+            ss << "uptime " << std::chrono::duration<double>(now.time-start_time).count() << "s, "
+                << "rates over the last " << seconds << "s\n";
+            for(auto& g:gauges)ss << g.first << " " << g.second << "  ";
+            ss << "\n";
+
+            ss << std::left << std::setw(20) << "counter" << std::right << std::setw(14) << "total" << std::setw(14) << "/s" << "\n";
+            auto line = [&](const std::string& name, std::uint64_t cur, std::uint64_t old)
+            {
+                ss << std::left << std::setw(20) << name << std::right << std::setw(14) << cur << std::setw(14) << rate(cur, old) << "\n";
+            };
+            for(std::size_t i=0;i<counter_count;i++)line(counter_names[i], now.counters[i], prev.counters[i]);
+            for(std::size_t i=0;i<totals.size();i++)
+            {
+                std::uint64_t old = 0;
+                for(auto& t:last_totals)if(t.first==totals[i].first)old = t.second;
+                line(totals[i].first, totals[i].second, has_last ? old : 0);
+            }
+            for(std::size_t i=0;i<MaxTypes;i++)
+                if(now.frames_in[i])line("in." + type_name(recv_type_names, i), now.frames_in[i], prev.frames_in[i]);
+            for(std::size_t i=0;i<MaxTypes;i++)
+                if(now.frames_out[i])line("out." + type_name(send_type_names, i), now.frames_out[i], prev.frames_out[i]);
+
+            auto summary = [&](const std::string& name, const Summary& s, double scale)
+            {
+                ss << std::left << std::setw(20) << name << std::right << std::setw(10) << s.count
+                    << std::setw(10) << (s.count ? s.sum/scale/s.count : 0.0)
+                    << std::setw(10) << s.quantile(0.5)/scale << std::setw(10) << s.quantile(0.99)/scale
+                    << std::setw(10) << s.quantile(0.999)/scale << std::setw(10) << s.max/scale << "\n";
+            };
+            auto header = [&](const std::string& title)
+            {
+                ss << std::left << std::setw(20) << title << std::right << std::setw(10) << "count" << std::setw(10) << "mean"
+                    << std::setw(10) << "p50<=" << std::setw(10) << "p99<=" << std::setw(10) << "p999<=" << std::setw(10) << "max" << "\n";
+            };
+            header("frames per write");
+            summary("send_batch", now.send_batch, 1);
+            header("handler us");
+            for(std::size_t i=0;i<MaxTypes;i++)
+                if(now.handler_ns[i].count)summary(type_name(recv_type_names, i), now.handler_ns[i], 1e3);
+
+            last = now;
+            last_totals = totals;
+            has_last = true;
+            return ss.str();
+        }
+    };
+}
+
+#endif // METRICS_HPP
@@ -0,0 +1,160 @@
+#ifndef NAME_INDEX_HPP
+#define NAME_INDEX_HPP
+
+#include <algorithm>
+#include <cstdint>
+#include <functional>
+#include <shared_mutex>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+// Inverted index from every 1-, 2- and 3-byte substring (gram) of a name to the ids having it.
+// A query of up to three bytes is a single posting list; a longer one starts from the rarest
+// of its trigrams and only verifies the ids that contain all of them, so the cost follows
+// the number of candidates instead of the number of users.
+class NameIndex
+{
+    public:
+    using id_t = std::uint32_t;
+
+    struct Match
+    {
+        id_t id;
+        std::string name;
+    };
+
+    private:
+    using gram_t = std::uint32_t;
+    using posting_t = std::unordered_set<id_t>;
+
+    mutable std::shared_mutex mtx;
+    std::unordered_map<gram_t, posting_t> postings;
+    std::unordered_map<id_t, std::string> names;
+
+    // length in the top byte, so grams of different lengths never collide
+    static gram_t gram(std::string_view s, std::size_t pos, std::size_t len)
+    {
+        gram_t g = static_cast<gram_t>(len) << 24;
+        for(std::size_t i=0;i<len;i++)
+            g |= static_cast<gram_t>(static_cast<unsigned char>(s[pos+i])) << (8*(2-i));
+        return g;
+    }
+
+    template <typename F>
+    static void for_each_gram(std::string_view s, F f)
+    {
+        for(std::size_t len=1;len<=3;len++)
+            for(std::size_t pos=0;pos+len<=s.size();pos++)
+                f(gram(s, pos, len));
+    }
+
+    void add(id_t id, const std::string& name)
+    {
+        for_each_gram(name, [&](gram_t g){postings[g].insert(id);});
+    }
+
+    void remove(id_t id, const std::string& name)
+    {
+        for_each_gram(name, [&](gram_t g)
+        {
+            auto it = postings.find(g);
+            if(it==postings.end())return;
+            it->second.erase(id);
+            if(it->second.empty())postings.erase(it);
+        });
+    }
+
+    const posting_t* find_posting(gram_t g) const
+    {
+        auto it = postings.find(g);
+        return it==postings.end() ? nullptr : &it->second;
+    }
+
+    // exact match first, then prefix, then anywhere; shorter names first inside each group
+    static bool better(std::string_view q, const Match& a, const Match& b)
+    {
+        auto rank = [&](const Match& m){return m.name==q ? 0 : m.name.compare(0, q.size(), q)==0 ? 1 : 2;};
+        int ra = rank(a), rb = rank(b);
+        if(ra != rb)return ra < rb;
+        if(a.name.size() != b.name.size())return a.name.size() < b.name.size();
+        return a.id < b.id;
+    }
+
+    public:
+    void update(id_t id, const std::string& name)
+    {
+        std::unique_lock<std::shared_mutex> lock(mtx);
+        auto it = names.find(id);
+        if(it != names.end())
+        {
+            if(it->second == name)return;
+            remove(id, it->second);
+            names.erase(it);
+        }
+        if(name.empty())return;
+        add(id, name);
+        names.emplace(id, name);
+    }
+
+    void erase(id_t id)
+    {
+        std::unique_lock<std::shared_mutex> lock(mtx);
+        auto it = names.find(id);
+        if(it == names.end())return;
+        remove(id, it->second);
+        names.erase(it);
+    }
+
+    // at most limit names containing q, best ranked first
+    std::vector<Match> search(std::string_view q, std::size_t limit) const
+    {
+        std::vector<Match> out;
+        if(q.empty() || limit==0)return out;
+
+        std::shared_lock<std::shared_mutex> lock(mtx);
+        std::vector<const posting_t*> lists;
+        if(q.size() <= 3)
+        {
+            if(auto p = find_posting(gram(q, 0, q.size())))lists.push_back(p);
+            else return out;
+        }
+        else
+        {
+            for(std::size_t pos=0;pos+3<=q.size();pos++)
+            {
+                auto p = find_posting(gram(q, pos, 3));
+                if(!p)return out;
+                lists.push_back(p);
+            }
+            std::sort(lists.begin(), lists.end(), [](auto a, auto b)
+            {
+                return a->size()!=b->size() ? a->size() < b->size() : std::less<const posting_t*>()(a, b);
+            });
+            lists.erase(std::unique(lists.begin(), lists.end()), lists.end());
+        }
+
+        for(id_t id:*lists[0])
+        {
+            bool all = std::all_of(lists.begin()+1, lists.end(), [&](const posting_t* p){return p->count(id);});
+            if(!all)continue;
+            const std::string& name = names.at(id);
+            if(q.size() > 3 && name.find(q) == std::string::npos)continue;
+            out.push_back({id, name});
+        }
+        lock.unlock();
+
+        auto cmp = [&](const Match& a, const Match& b){return better(q, a, b);};
+        if(out.size() > limit)
+        {
+            std::partial_sort(out.begin(), out.begin()+limit, out.end(), cmp);
+            out.resize(limit);
+        }
+        else std::sort(out.begin(), out.end(), cmp);
+        return out;
+    }
+};
+
+#endif // NAME_INDEX_HPP
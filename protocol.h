@@ -16,28 +16,49 @@ namespace Protocol
     const int TextMaxLength = 1000;
     const int PrintMaxLength = 1000;
     const int BodyMaxLength = std::max(TextMaxLength, PrintMaxLength);
+    const int BatchMaxLength = 4000;    // body of a batch (v2)
     const std::uint32_t null_room_id = 0;
     const int MaxUsersShowPerLine = 5;
+    const int DefaultPageSize = 20;
+    const int MaxPageSize = 100;
 
     using id_t = std::uint32_t;
 
+    // the highest protocol version, and what a v2 session may agree on in its hello
+    const std::uint32_t Version = 2;
+    enum capability_t : std::uint32_t
+    {
+        cap_batch = 1,  // the client takes batch frames
+        cap_ping = 2,   // the client answers pings, and may send its own
+        cap_resume = 4  // the session outlives a dropped connection for a while, and is resumed on a new one
+    };
+
     namespace Message
     {
         /*
         command (client)            meaning
         name                        show my name
         rename xxx                  change my name to xxx
-        rooms                       list all rooms
-        users                       list all users
+        rooms                       list all rooms (first page)
+        users                       list all users (first page)
+        more                        show the next page of the last rooms/users listing
         enter room_id               enter the room with id room_id
         ::leave (in chatting mod)   leave current room
         find username               find the user with name "username"
+        history room_id [from] [n]  show n messages of a room from sequence number from (the last ones without from)
         newroom                     create a new room and enter it
         randroom                    randomly enter a room
         .... (in chatting mod)      send some text to the current room
         ::roomid (in chatting mod)  query the current room id ( no need internet )
         */
 
+        // what a list/listing message is about
+        enum list_kind_t : std::uint32_t
+        {
+            list_rooms,
+            list_users
+        };
+
        /*
        A message from Client to Server should contain:
        
@@ -46,6 +67,19 @@ namespace Protocol
        body (with length not fixed)
 
        The body_len shows the length of body (in bytes)
+
+       Protocol v2: a client that sends hello as its first message (in the format above, like the
+       answer to it) agrees on the version and the capabilities given in the answer. From then on
+       every message in both directions is
+
+       type (varint)
+       body_len (varint)
+       body
+
+       with varints as in LEB128 (7 bits per byte, low bits first). Numbers in a body are varints
+       too, and strings are not followed by '\0': their length is what is left of the body.
+       A batch carries a sequence of v2 messages (never another batch) as its body.
+       Clients that never send hello keep talking v1.
        */
         struct Client_to_Server
         {
@@ -61,7 +95,14 @@ namespace Protocol
                     find,
                     newroom,
                     randroom,
-                    text
+                    text,
+                    list,   // body: list_kind_t, cursor, page_size (3 x 4bytes)
+                    history,    // body: room_id, first sequence number (0: the last ones), count (3 x 4bytes)
+                    hello,      // body: the highest version and the capabilities of the client (2 x 4bytes)
+                    batch,      // v2 only
+                    ping,       // v2 with cap_ping: body: a token (4bytes), answered by a pong with the same token
+                    pong,       // the answer to the server's ping, body: its token (4bytes)
+                    resume      // v2 with cap_resume, right behind hello: body: the user id and the token of a dropped session (3 x 4bytes)
                 }type;
                 std::uint32_t body_len;
             }header;
@@ -84,7 +125,15 @@ namespace Protocol
                 enum type_t : std::uint32_t
                 {
                     print,  // to print something immidiately on screen
-                    roomchange  // to inform the client to change a room
+                    roomchange,  // to inform the client to change a room
+                    listing,    // a page of a list: list_kind_t, next_cursor (0: last page) (2 x 4bytes), then text with '\0'
+                    hello,      // body: the version and the capabilities of the session (2 x 4bytes)
+                    batch,      // v2 only
+                    ping,       // sent to a cap_ping session that has been silent for a while, body: a token (4bytes)
+                    pong,       // the answer to the client's ping, body: its token (4bytes)
+                    session,    // right behind the answer to the hello of a cap_resume session: its user id and resume token (3 x 4bytes)
+                    resumed     // the answer to resume: user id (0: not resumed, this is a new session), room id (2 x 4bytes), then the name;
+                                // what the session missed follows
                 }type;
                 std::uint32_t body_len;
             }header;
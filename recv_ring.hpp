@@ -0,0 +1,99 @@
+#ifndef RECV_RING_HPP
+#define RECV_RING_HPP
+
+#include <boost/asio.hpp>
+#include <algorithm>
+#include <array>
+#include <cstdint>
+#include <cstring>
+#include "buffer_pool.hpp"
+
+using namespace boost;
+
+// Per-connection receive buffer. Reads fill whatever space is free (wrapping around the end),
+// the frame parser then consumes complete frames from the front.
+// The storage comes from the BufferPool when bytes arrive and goes back to it once they are all
+// consumed, so that an idle connection holds none.
+class RecvRing
+{
+    public:
+    // power of two, large enough for any complete frame
+    static const std::uint32_t Capacity = 4096;
+
+    private:
+    char* buf = nullptr;
+    std::uint32_t head = 0, tail = 0; // free running, readable bytes are [head, tail)
+
+    static std::uint32_t wrap(std::uint32_t i){return i & (Capacity-1);}
+
+    public:
+    std::size_t size() const {return tail-head;}
+    std::size_t space() const {return Capacity-size();}
+
+    // free space as (at most) two buffers, for a single scatter read
+    std::array<asio::mutable_buffer,2> prepare()
+    {
+        if(!buf)buf = static_cast<char*>(BufferPool::allocate(Capacity));
+        std::uint32_t t = wrap(tail);
+        std::size_t first = std::min<std::size_t>(space(), Capacity-t);
+        return {asio::buffer(buf+t, first), asio::buffer(buf, space()-first)};
+    }
+
+    // gives the storage back if nothing is buffered, e.g. after a read that got nothing
+    void release()
+    {
+        if(!buf || head != tail)return;
+        BufferPool::deallocate(buf, Capacity);
+        buf = nullptr;
+    }
+
+    void commit(std::size_t n){tail += n;}
+
+    void consume(std::size_t n)
+    {
+        head += n;
+        if(head != tail)return;
+        head = tail = 0; // keep the next frames contiguous
+        release();
+    }
+
+    // n readable bytes starting at offset, or nullptr if they wrap around the end
+    const char* contiguous(std::size_t offset, std::size_t n) const
+    {
+        std::uint32_t h = wrap(head+offset);
+        return h+n <= Capacity ? buf+h : nullptr;
+    }
+
+    // writes n bytes at the end, e.g. to restore a ring; false if they do not fit
+    bool append(const char* src, std::size_t n)
+    {
+        if(n > space())return false;
+        if(n == 0)return true;
+        auto bufs = prepare();
+        std::size_t first = std::min(n, bufs[0].size());
+        std::memcpy(bufs[0].data(), src, first);
+        std::memcpy(bufs[1].data(), src+first, n-first);
+        commit(n);
+        return true;
+    }
+
+    void copy(char* dst, std::size_t offset, std::size_t n) const
+    {
+        if(n == 0)return;
+        std::uint32_t h = wrap(head+offset);
+        std::size_t first = std::min<std::size_t>(n, Capacity-h);
+        std::memcpy(dst, buf+h, first);
+        std::memcpy(dst+first, buf, n-first);
+    }
+
+    RecvRing() = default;
+    RecvRing(const RecvRing&) = delete;
+    RecvRing& operator=(const RecvRing&) = delete;
+
+    ~RecvRing()
+    {
+        if(buf)BufferPool::deallocate(buf, Capacity);
+    }
+};
+
+#endif // RECV_RING_HPP
@@ -0,0 +1,203 @@
+#ifndef REGISTRY_HPP
+#define REGISTRY_HPP
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cstdint>
+#include <mutex>
+#include <random>
+#include <shared_mutex>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+// A hash table keyed by id, split into lock stripes.
+// Lookups only take the shared lock of one stripe, so readers never wait for each other
+// and a writer only blocks the ids that hash to its stripe.
+template <typename V, std::size_t Stripes = 64>
+class Registry
+{
+    private:
+    using id_t = std::uint32_t;
+
+    struct alignas(64) Stripe
+    {
+        mutable std::shared_mutex mtx;
+        std::unordered_map<id_t, V> map;
+    };
+
+    std::array<Stripe, Stripes> stripes;
+    std::atomic<std::size_t> count{0};
+
+    // ids are handed out sequentially, so the low bits spread them evenly
+    Stripe& stripe(id_t id){return stripes[id % Stripes];}
+    const Stripe& stripe(id_t id) const {return stripes[id % Stripes];}
+
+    public:
+    // returns V() if id is unknown
+    V find(id_t id) const
+    {
+        auto& s = stripe(id);
+        std::shared_lock<std::shared_mutex> lock(s.mtx);
+        auto it = s.map.find(id);
+        return it==s.map.end() ? V() : it->second;
+    }
+
+    bool insert(id_t id, V value)
+    {
+        auto& s = stripe(id);
+        std::unique_lock<std::shared_mutex> lock(s.mtx);
+        bool inserted = s.map.emplace(id, std::move(value)).second;
+        if(inserted)count.fetch_add(1, std::memory_order_relaxed);
+        return inserted;
+    }
+
+    // returns the removed value, V() if id is unknown
+    V erase(id_t id)
+    {
+        auto& s = stripe(id);
+        std::unique_lock<std::shared_mutex> lock(s.mtx);
+        auto it = s.map.find(id);
+        if(it==s.map.end())return V();
+        V value = std::move(it->second);
+        s.map.erase(it);
+        count.fetch_sub(1, std::memory_order_relaxed);
+        return value;
+    }
+
+    // removes id only while it still maps to expected; false if it does not
+    bool erase(id_t id, const V& expected)
+    {
+        auto& s = stripe(id);
+        std::unique_lock<std::shared_mutex> lock(s.mtx);
+        auto it = s.map.find(id);
+        if(it==s.map.end() || !(it->second == expected))return false;
+        s.map.erase(it);
+        count.fetch_sub(1, std::memory_order_relaxed);
+        return true;
+    }
+
+    std::size_t size() const {return count.load(std::memory_order_relaxed);}
+
+    // A consistent point-in-time copy sorted by id: every stripe is held (shared) while copying.
+    std::vector<std::pair<id_t, V>> snapshot() const
+    {
+        std::vector<std::shared_lock<std::shared_mutex>> locks;
+        locks.reserve(Stripes);
+        for(auto& s:stripes)locks.emplace_back(s.mtx);
+
+        std::vector<std::pair<id_t, V>> out;
+        out.reserve(size());
+        for(auto& s:stripes)
+            out.insert(out.end(), s.map.begin(), s.map.end());
+        locks.clear();
+
+        std::sort(out.begin(), out.end(), [](const auto& a, const auto& b){return a.first < b.first;});
+        return out;
+    }
+
+    void clear()
+    {
+        for(auto& s:stripes)
+        {
+            std::unique_lock<std::shared_mutex> lock(s.mtx);
+            count.fetch_sub(s.map.size(), std::memory_order_relaxed);
+            s.map.clear();
+        }
+    }
+};
+
+// A Registry whose values are also packed in one array, with the position of every id,
+// so that one of them is picked at random in O(1) and removed in O(1) by moving the last one in its place.
+// Lookups go to the stripes as before; inserting and erasing take one more lock, which keeps both in step.
+template <typename V, std::size_t Stripes = 64>
+class SampledRegistry
+{
+    private:
+    using id_t = std::uint32_t;
+
+    Registry<V, Stripes> registry;
+    mutable std::mutex mtx;
+    std::vector<std::pair<id_t, V>> dense;
+    std::unordered_map<id_t, std::size_t> position;
+
+    void remove(id_t id)
+    {
+        auto it = position.find(id);
+        std::size_t pos = it->second;
+        position.erase(it);
+        if(pos != dense.size()-1)
+        {
+            dense[pos] = std::move(dense.back());
+            position[dense[pos].first] = pos;
+        }
+        dense.pop_back();
+    }
+
+    public:
+    V find(id_t id) const {return registry.find(id);}
+
+    bool insert(id_t id, V value)
+    {
+        std::lock_guard<std::mutex> lock(mtx);
+        if(!registry.insert(id, value))return false;
+        position.emplace(id, dense.size());
+        dense.emplace_back(id, std::move(value));
+        return true;
+    }
+
+    V erase(id_t id)
+    {
+        std::lock_guard<std::mutex> lock(mtx);
+        V value = registry.erase(id);
+        if(value)remove(id);
+        return value;
+    }
+
+    bool erase(id_t id, const V& expected)
+    {
+        std::lock_guard<std::mutex> lock(mtx);
+        if(!registry.erase(id, expected))return false;
+        remove(id);
+        return true;
+    }
+
+    std::size_t size() const {return registry.size();}
+
+    std::vector<std::pair<id_t, V>> snapshot() const {return registry.snapshot();}
+
+    void clear()
+    {
+        std::lock_guard<std::mutex> lock(mtx);
+        registry.clear();
+        dense.clear();
+        position.clear();
+    }
+
+    // uniformly at random, V() if there is none
+    template <typename Rng>
+    V pick(Rng& rng) const
+    {
+        std::lock_guard<std::mutex> lock(mtx);
+        if(dense.empty())return V();
+        return dense[std::uniform_int_distribution<std::size_t>(0, dense.size()-1)(rng)].second;
+    }
+
+    // In proportion to weight(value), a number in [0, 1]: a uniform pick is kept with that probability,
+    // up to tries times, after which the last one is taken anyway.
+    template <typename Rng, typename W>
+    V pick(Rng& rng, W weight, int tries = 8) const
+    {
+        std::uniform_real_distribution<double> coin(0, 1);
+        V value;
+        for(int i=0;i<tries;i++)
+        {
+            value = pick(rng);
+            if(!value || coin(rng) < weight(value))break;
+        }
+        return value;
+    }
+};
+
+#endif // REGISTRY_HPP
@@ -5,62 +5,714 @@
 #include <thread>
 #include <set>
 #include <atomic>
+#include <mutex>
 #include <random>
 #include <cstdlib>
 #include <sstream>
+#include <fstream>
+#include <ctime>
+#include <future>
+#include <map>
+#include <unordered_map>
+#include <poll.h>
+#include <sys/eventfd.h>
 #include "protocol.h"
 #include "tools.hpp"
+#include "io_shard.hpp"
+#include "registry.hpp"
+#include "recv_ring.hpp"
+#include "buffer_pool.hpp"
+#include "frame.hpp"
+#include "alloc_counter.hpp"
+#include "name_index.hpp"
+#include "directory.hpp"
+#include "metrics.hpp"
+#include "history_ring.hpp"
+#include "chat_log.hpp"
+#include "handoff.hpp"
+#include "cluster.hpp"
+#include "token_bucket.hpp"
+#include "fanout.hpp"
+#include "flush_tick.hpp"
+#include "timer_wheel.hpp"
 
 using namespace boost;
 using tcp_socket = boost::asio::ip::tcp::socket;
 using UserPtr = std::shared_ptr<class User>;
 using RoomPtr = std::shared_ptr<class Room>;
 
+// what happens to a session whose outbound backlog goes over its budget
+enum class OverflowPolicy
+{
+    drop_oldest,    // drop the oldest chat frames
+    collapse,       // drop them and tell the client how many were skipped
+    disconnect
+};
+
+// Outbound memory limits. Bytes are counted per recipient, while a broadcast frame is shared.
+struct SendLimits
+{
+    std::size_t budget = 256*1024;          // queued bytes per session
+    std::size_t ceiling = 256*1024*1024;    // queued bytes of all sessions together
+    std::size_t detached = 64*1024;         // queued bytes per session waiting to be resumed
+    OverflowPolicy policy = OverflowPolicy::collapse;
+};
+
+// what drives the io of the sessions
+enum class IoBackend
+{
+    epoll,      // asio's reactor
+    uring       // an io_uring per shard, falling back to epoll if the kernel has none
+};
+
+struct ServerOptions
+{
+    std::string host = Protocol::server_ip;
+    unsigned short port = Protocol::server_port;
+    unsigned threads = std::max(1u, std::thread::hardware_concurrency());
+    bool pin_threads = false;
+    IoBackend io = IoBackend::epoll;
+    unsigned ring_entries = 1024;   // submission queue of every io_uring
+    unsigned ring_buffers = 1024;   // provided receive buffers per shard, a power of two
+    std::size_t max_users = Protocol::MaxTotalUsers;    // connections over it are turned away
+    double accept_rate = 0;         // new connections per second, 0: no limit
+    double accept_burst = 0;        // accepted at once above the rate, 0: a second's worth
+    SendLimits send_limits;
+    std::chrono::microseconds flush_tick{0};    // idle sessions start writing together, at most this late; 0: right away
+    std::size_t flush_busy_at = 0;  // writes per tick from which a shard holds them back, 0: always
+    std::chrono::milliseconds idle_timeout{0};  // a session silent that long is closed, 0: never
+    std::chrono::milliseconds ping_interval{0}; // a cap_ping session silent that long is pinged, 0: never
+    std::chrono::milliseconds resume_window{0}; // a cap_resume session whose connection dropped waits that long, 0: not at all
+    std::size_t history_size = 64;  // chat frames kept per room
+    std::size_t replay_size = 20;   // of which the last ones are replayed on enter
+    bool randroom_free = false;     // randroom prefers rooms with room left under MaxUsersPerRoom
+    std::size_t spread_at = 1000;   // members from which a room's chat is delivered by their shards in parallel
+    ChatLog::Options chat_log;      // no directory: chat is not persisted
+    std::string handoff_path;       // Unix socket a new process connects to in order to take over
+    std::string takeover_path;      // take over from the server listening there instead of binding the port
+    std::string stats_file;         // empty: no periodic dump
+    unsigned stats_interval = 10;   // seconds between two dumps
+    Cluster::Options cluster;       // no nodes: a single server
+};
+
 class Room
 {
     private:
     Protocol::id_t id;
-    std::set<UserPtr> users;
+    Fanout<UserPtr> users;
+    std::mutex mtx;
+    std::uint64_t version = 0; // bumped on every change of what the listing shows
+    HistoryRing history;
+    std::map<Peer::node_t,std::size_t> remote; // members on other nodes, only known to the room's own node
+    std::map<Peer::node_t,std::chrono::steady_clock::time_point> resyncing; // nodes reset, until they had time to announce their members again
+    bool closed = false;    // the last member left: nobody enters it any more and the server drops it
     static std::atomic<Protocol::id_t> id_count;
 
+    std::string line();
+
+    public:
+    // what a departure did to the room
+    enum left_t
+    {
+        unchanged,  // it was not a member
+        left,
+        emptied     // it was the last member, the room is closed
+    };
+
+    private:
+    left_t departed()
+    {
+        version++;
+        if(!users.empty() || !remote.empty() || !resyncing.empty())return left;
+        closed = true;
+        return emptied;
+    }
+
     public:
-    auto begin(){return users.begin();}
-    auto end(){return users.end();}
-    auto size(){return users.size();}
-    void enter(UserPtr user){users.insert(user);}
-    void leave(UserPtr user){users.erase(user);}
+    // f is called for every member with the room locked
+    template <typename F>
+    void for_each(F f)
+    {
+        std::lock_guard<std::mutex> lock(mtx);
+        users.for_each([&](const UserPtr& u){f(u); return true;});
+    }
+    // Keeps a chat frame in the history and calls relay for every node with members, in the same locked section.
+    // f is called for every member in that order as well, though maybe later, on the member's shard (see Fanout).
+    template <typename F, typename R>
+    void post(const FramePtr& frame, F f, R relay)
+    {
+        std::lock_guard<std::mutex> lock(mtx);
+        history.push(frame);
+        users.deliver(f);
+        for(const auto &r:remote)relay(r.first);
+    }
+    template <typename F>
+    void post(const FramePtr& frame, F f){post(frame, f, [](Peer::node_t){});}
+    std::size_t size(){std::lock_guard<std::mutex> lock(mtx); return users.size();}
+    // f is called with the history and the room locked, so that nothing posted meanwhile
+    // reaches the newcomer before it or is missing from both
+    // false if the room is closed
+    template <typename F>
+    bool enter(UserPtr user, F f);
+    left_t leave(UserPtr user);
+    // a resumed session goes on as new_user, in the place of old_user; f is called in the same locked section
+    // false if old_user was not a member
+    template <typename F>
+    bool swap(UserPtr old_user, UserPtr new_user, F f);
+    void touch(){std::lock_guard<std::mutex> lock(mtx); version++;}
+    // a member on another node; like enter, f is called with the history in the same locked section
+    template <typename F>
+    bool subscribe(Peer::node_t node, F f)
+    {
+        std::lock_guard<std::mutex> lock(mtx);
+        if(closed)return false;
+        remote[node]++;
+        resyncing.erase(node);
+        version++;
+        f(history);
+        return true;
+    }
+    left_t unsubscribe(Peer::node_t node)
+    {
+        std::lock_guard<std::mutex> lock(mtx);
+        auto it = remote.find(node);
+        if(it==remote.end())return unchanged;
+        if(--it->second==0)remote.erase(it);
+        return departed();
+    }
+    // Forgets every member on node. The room stays open until then all the same, for node to announce
+    // them again: a link that drops for a moment does not close the room under them.
+    left_t unsubscribe_all(Peer::node_t node, std::chrono::steady_clock::time_point until)
+    {
+        std::lock_guard<std::mutex> lock(mtx);
+        bool had = remote.erase(node);
+        if(!had && !resyncing.count(node))return unchanged;
+        resyncing[node] = until;
+        return had ? departed() : unchanged;
+    }
+    // node had until now to announce its members again: the room closes if nobody else is in it
+    left_t resynced(Peer::node_t node, std::chrono::steady_clock::time_point now)
+    {
+        std::lock_guard<std::mutex> lock(mtx);
+        auto it = resyncing.find(node);
+        if(it==resyncing.end() || it->second > now)return unchanged;
+        resyncing.erase(it);
+        return departed();
+    }
     auto getid(){return id;}
+    std::vector<FramePtr> recent(std::size_t k)
+    {
+        std::lock_guard<std::mutex> lock(mtx);
+        std::vector<FramePtr> frames;
+        history.for_each_last(k, [&](const FramePtr& f){frames.push_back(f);});
+        return frames;
+    }
+    // the highest id given so far, and making sure that no id up to id is given again
+    static Protocol::id_t last_id(){return id_count;}
+    static void reserve_id(Protocol::id_t id)
+    {
+        Protocol::id_t count = id_count;
+        while(count < id && !id_count.compare_exchange_weak(count, id));
+    }
+    static Protocol::id_t next_id(){return ++id_count;}
+    // Calls f with the directory line of this room and the version it shows. The room stays locked,
+    // so that no line of a closed room is published after it was taken out of the directory.
+    template <typename F>
+    void render(F f)
+    {
+        std::lock_guard<std::mutex> lock(mtx);
+        if(!closed)f(line(), version);
+    }
 
-    Room():id(++id_count)
-    {}
+    // ids come from next_id, or are restored from the chat log or a handoff
+    Room(Protocol::id_t known_id, std::size_t history_size, std::size_t spread_at):id(known_id), users(spread_at), history(history_size)
+    {
+        reserve_id(id);
+    }
 };
 std::atomic<Protocol::id_t> Room::id_count;
 
-class User
+class User : public std::enable_shared_from_this<User>
 {
+    public:
+    // only touched on the home shard
+    struct Liveness
+    {
+        TimerWheel<User>::Entry entry;
+        std::uint64_t heard = 0, pinged = 0;    // ticks of the shard's wheel
+        bool pings = false;     // the client agreed on cap_ping
+
+        Liveness(User* owner):entry(owner)
+        {}
+    };
+
     private:
     
-    std::string name;
-    Protocol::id_t id, roomid;
+    Tools::FixedString<Protocol::NameMaxLength> name;
+    Tools::SpinLock name_lock;
+    std::atomic<Protocol::id_t> id;     // only changes when a new session resumes an old one
+    std::atomic<Protocol::id_t> roomid;
+    IoShard& shard;
     asio::ip::tcp::socket sock;
+    std::unique_ptr<RingSocket<User>> ring_sock;    // instead of sock when the shard has an io_uring
+    RecvRing inbox;
+    Liveness liveness{this};
     static std::atomic<Protocol::id_t> id_count;
 
+    // outbound queue: frames wait in send_queue while the previous batch (sending) is being written
+    struct Outbound
+    {
+        FramePtr frame;
+        bool droppable;     // a chat frame, which the overflow policy may drop
+    };
+    std::mutex send_mtx;
+    std::vector<Outbound> send_queue, sending;
+    std::vector<asio::const_buffer> send_bufs;
+    static const std::size_t KeptBatch = 8;     // frames the vectors keep room for between writes
+    bool writing = false, send_closed = false, overflowed = false;
+    // with a resume token the session waits for a resume once its connection drops (detached),
+    // and the one resume that presents the token claims it
+    std::uint64_t resume_token = 0;
+    bool detached = false, claimed = false;
+    const SendLimits& limits;
+    std::size_t queued_bytes = 0;   // in send_queue and sending
+    std::size_t skipped = 0;        // dropped frames the client has not been told about yet
+    static std::atomic<std::size_t> outbound_bytes;
+    // protocol of the session: frames queued for a v2 session are converted, packed into batches
+    // if the client takes them; both change with send_mtx held
+    std::atomic<std::uint8_t> protocol{1};
+    bool batches = false;
+
+    void account(std::size_t n)
+    {
+        queued_bytes += n;
+        outbound_bytes.fetch_add(n, std::memory_order_relaxed);
+    }
+
+    void release(std::size_t n)
+    {
+        queued_bytes -= n;
+        outbound_bytes.fetch_sub(n, std::memory_order_relaxed);
+    }
+
+    // a session waiting to be resumed only keeps a short backlog
+    std::size_t full_budget() const {return detached ? limits.detached : limits.budget;}
+
+    // over the global ceiling every session only gets a quarter of its budget,
+    // so the largest backlogs are trimmed first
+    std::size_t budget() const
+    {
+        if(outbound_bytes.load(std::memory_order_relaxed) > limits.ceiling)return full_budget()/4;
+        return full_budget();
+    }
+
+    FramePtr skip_notice(std::size_t n)
+    {
+        std::string text = std::to_string(n) + " messages skipped";
+        auto notice = MakeFrame(Protocol::Message::Server_to_Client::header_t::print,
+            text.c_str(), static_cast<std::uint32_t>(text.size()+1));
+        if(protocol != 1)notice = ToV2(*notice);
+        account(notice->size());
+        return notice;
+    }
+
+    // Appends frames to the queue, re-encoded for a v2 session (in batches if it takes them).
+    template <typename It>
+    void push(It first, It last, bool droppable)
+    {
+        auto emit = [&](FramePtr f)
+        {
+            account(f->size());
+            send_queue.push_back({std::move(f), droppable});
+        };
+        if(protocol == 1)
+        {
+            for(;first!=last;++first)emit(*first);
+            return;
+        }
+        V2Encoder v2(batches);
+        for(;first!=last;++first)
+        {
+            if((*first)->version() == 1)v2.add(**first, emit);
+            else
+            {
+                v2.finish(emit);
+                emit(*first);
+            }
+        }
+        v2.finish(emit);
+    }
+
+    // Applies the overflow policy to the queue. Chat frames are dropped oldest first down to 3/4 of
+    // the budget, so that a stalled reader does not pay for a trim on every new frame.
+    // Returns false if the session has to be closed: by policy, or because what is left
+    // (replies that cannot be dropped) is still more than twice the budget.
+    bool trim()
+    {
+        std::size_t allowed = budget();
+        if(allowed < full_budget())Metrics::add(Metrics::ceiling_hits);
+        if(limits.policy == OverflowPolicy::disconnect)
+        {
+            Metrics::add(Metrics::overflow_disconnect);
+            return false;
+        }
+        std::size_t target = allowed/4*3, dropped = 0;
+        auto out = send_queue.begin();
+        for(auto it=send_queue.begin();it!=send_queue.end();++it)
+        {
+            if(queued_bytes > target && it->droppable)
+            {
+                release(it->frame->size());
+                dropped++;
+            }
+            else *out++ = std::move(*it);
+        }
+        send_queue.erase(out, send_queue.end());
+        Metrics::add(limits.policy==OverflowPolicy::collapse ? Metrics::overflow_collapse : Metrics::overflow_drop);
+        Metrics::add(Metrics::frames_dropped, dropped);
+        if(limits.policy == OverflowPolicy::collapse)skipped += dropped;
+        if(queued_bytes <= 2*full_budget())return true;
+        Metrics::add(Metrics::overflow_disconnect);
+        return false;
+    }
+
     public:
     
-    Protocol::id_t getid(){return id;}
+    Protocol::id_t getid(){return id.load(std::memory_order_relaxed);}
     Protocol::id_t getroom(){return roomid;}
-    std::string getname(){return name;}
+    std::string getname(){std::lock_guard<Tools::SpinLock> lock(name_lock); return name.str();}
+    // calls f with a copy of the name on the stack
+    template <typename F>
+    auto withname(F f)
+    {
+        decltype(name) copy;
+        {
+            std::lock_guard<Tools::SpinLock> lock(name_lock);
+            copy = name;
+        }
+        return f(copy.view());
+    }
     asio::ip::tcp::socket& getsock(){return sock;}
+    RingSocket<User>* getring(){return ring_sock.get();}
+    RecvRing& getinbox(){return inbox;}
+    Liveness& getliveness(){return liveness;}
+    IoShard& getshard(){return shard;}
+    // the concrete executor of the home shard: unlike the socket's type-erased one it honours handler allocators
+    asio::io_context::executor_type getexecutor(){return shard.context().get_executor();}
+    bool is_open(){return ring_sock ? ring_sock->is_open() : sock.is_open();}
+    int native_handle(){return ring_sock ? ring_sock->native_handle() : sock.native_handle();}
+    // the socket is non-blocking: it is only read once it is readable
+    void assign(const asio::ip::tcp& protocol, int fd)
+    {
+        boost::system::error_code ignored;
+        if(ring_sock)
+        {
+            ring_sock->assign(fd);
+            return;
+        }
+        sock.assign(protocol, fd, ignored);
+        sock.non_blocking(true, ignored);
+    }
+    void assign(asio::ip::tcp::socket&& accepted)
+    {
+        boost::system::error_code ignored;
+        sock = std::move(accepted);
+        sock.non_blocking(true, ignored);
+    }
+    void cancel_io()
+    {
+        boost::system::error_code ignored;
+        if(ring_sock)ring_sock->cancel();
+        else sock.cancel(ignored);
+    }
+    void close_socket()
+    {
+        boost::system::error_code ignored;
+        if(ring_sock)ring_sock->close();
+        else sock.close(ignored);
+    }
+    // gives up the descriptor without closing it, once another process serves the connection
+    void release_socket()
+    {
+        boost::system::error_code ignored;
+        if(ring_sock)ring_sock->release();
+        else if(sock.is_open())sock.release(ignored);
+    }
+    asio::ip::tcp::endpoint remote_endpoint()
+    {
+        boost::system::error_code ignored;
+        return ring_sock ? ring_sock->remote_endpoint() : sock.remote_endpoint(ignored);
+    }
     void setroom(const Protocol::id_t &new_roomid){roomid=new_roomid;}
-    void setname(const std::string &new_name){name=new_name;}
-    bool match(const std::string &s)
+    // a name longer than NameMaxLength is cut
+    void setname(std::string_view new_name){std::lock_guard<Tools::SpinLock> lock(name_lock); name=new_name;}
+    std::uint8_t getprotocol(){return protocol.load(std::memory_order_relaxed);}
+    bool getbatches(){std::lock_guard<std::mutex> lock(send_mtx); return batches;}
+    std::uint64_t getresume(){std::lock_guard<std::mutex> lock(send_mtx); return resume_token;}
+    void setresume(std::uint64_t token){std::lock_guard<std::mutex> lock(send_mtx); resume_token = token;}
+    bool is_detached(){std::lock_guard<std::mutex> lock(send_mtx); return detached;}
+
+    enum send_result_t
     {
-        return name.find(s) != std::string::npos;
+        queued,
+        start_flush,    // the caller has to start writing
+        overflow        // the backlog went over the limits, the caller has to close the session
+    };
+
+    template <typename It>
+    send_result_t queue_send(It first, It last, bool droppable)
+    {
+        std::lock_guard<std::mutex> lock(send_mtx);
+        if(send_closed || overflowed)return queued;
+        push(first, last, droppable);
+        return flush_state();
+    }
+
+    // Queues reply (if any) in the current protocol and switches to version for everything after it,
+    // in one locked section so that no frame queued meanwhile gets the wrong encoding.
+    send_result_t switch_protocol(std::uint8_t version, bool batch, FramePtr reply)
+    {
+        std::lock_guard<std::mutex> lock(send_mtx);
+        if(!send_closed && !overflowed && reply)push(&reply, &reply+1, false);
+        protocol = version;
+        batches = batch;
+        if(send_closed || overflowed || !reply)return queued;
+        return flush_state();
+    }
+
+    // The connection is gone: frames are queued, within the detached budget, but not written
+    // until a resume; false if the session cannot wait (closed, or without a resume token).
+    bool detach()
+    {
+        std::lock_guard<std::mutex> lock(send_mtx);
+        if(send_closed || overflowed || !resume_token)return false;
+        detached = true;
+        return true;
+    }
+
+    // true for the one caller that presents the token of a detached session; it has to resume it
+    bool claim(std::uint64_t token)
+    {
+        std::lock_guard<std::mutex> lock(send_mtx);
+        if(!detached || claimed || send_closed || overflowed || token != resume_token)return false;
+        claimed = true;
+        return true;
     }
-    User(asio::io_service& service):roomid(Protocol::null_room_id), sock(service), id(++id_count)
+
+    // Takes over the backlog of the claimed session old, which is closed: reply goes first, then
+    // what old dropped and what old had queued, which is already encoded for the same client.
+    send_result_t resume(User& old, FramePtr reply)
+    {
+        std::scoped_lock lock(send_mtx, old.send_mtx);
+        old.send_closed = true;
+        bool open = !send_closed && !overflowed;
+        if(open)
+        {
+            push(&reply, &reply+1, false);
+            if(old.skipped)send_queue.push_back({skip_notice(old.skipped), false});
+        }
+        for(auto& o:old.send_queue)
+        {
+            old.release(o.frame->size());
+            if(!open)continue;
+            account(o.frame->size());
+            send_queue.push_back(std::move(o));
+        }
+        old.send_queue.clear();
+        old.skipped = 0;
+        return open ? flush_state() : queued;
+    }
+
+    void setid(Protocol::id_t new_id){id = new_id;}
+
+    private:
+    send_result_t flush_state()
+    {
+        if(queued_bytes > budget() && !trim())
+        {
+            overflowed = true;
+            return overflow;
+        }
+        if(writing || detached)return queued;
+        writing = true;
+        return start_flush;
+    }
+
+    public:
+
+    // moves everything queued into one gather batch, led by the notice of what was skipped;
+    // nothing once detached, the queue waits for a resume
+    BufferView take_send_batch()
+    {
+        std::lock_guard<std::mutex> lock(send_mtx);
+        if(!detached)sending.swap(send_queue);
+        if(skipped && !detached)
+        {
+            sending.insert(sending.begin(), {skip_notice(skipped), false});
+            skipped = 0;
+        }
+        send_bufs.clear();
+        for(const auto &o:sending)
+            send_bufs.push_back(o.frame->buffer());
+        Metrics::send_batch(sending.size());
+        return send_bufs;
+    }
+
+    // returns true if more frames were queued while the batch was being written
+    bool finish_send()
+    {
+        std::lock_guard<std::mutex> lock(send_mtx);
+        for(const auto &o:sending)release(o.frame->size());
+        sending.clear();
+        if(detached)writing = false;
+        else if(send_queue.empty())
+        {
+            writing = false;
+            // what a burst (a replay, a backlog) grew is not kept for the rest of an idle session
+            if(sending.capacity() > KeptBatch)
+            {
+                std::vector<Outbound>().swap(sending);
+                std::vector<Outbound>().swap(send_queue);
+                std::vector<asio::const_buffer>().swap(send_bufs);
+            }
+        }
+        return writing;
+    }
+
+    // stops sending; returns true only for the first call, false as well once a resume claimed the session
+    bool close()
+    {
+        std::lock_guard<std::mutex> lock(send_mtx);
+        if(send_closed || claimed)return false;
+        send_closed = true;
+        for(const auto &o:send_queue)release(o.frame->size());
+        send_queue.clear();
+        return true;
+    }
+
+    // The write of the current batch was cancelled after written bytes: what is left of it goes back
+    // to the front of the queue (the partly written frame as a view of its tail) and nothing is in flight.
+    void abort_send(std::size_t written)
+    {
+        std::lock_guard<std::mutex> lock(send_mtx);
+        std::vector<Outbound> rest;
+        for(auto &o:sending)
+        {
+            std::size_t n = o.frame->size();
+            if(written >= n)
+            {
+                written -= n;
+                release(n);
+                continue;
+            }
+            if(written)
+            {
+                o.frame = MakeFrame(o.frame, o.frame->data()+written, n-written, o.frame->version());
+                release(written);
+                written = 0;
+            }
+            rest.push_back(std::move(o));
+        }
+        rest.insert(rest.end(), std::make_move_iterator(send_queue.begin()), std::make_move_iterator(send_queue.end()));
+        send_queue.swap(rest);
+        sending.clear();
+    }
+
+    // after the io was stopped: returns true if the caller has to start writing again
+    bool restart_send()
+    {
+        std::lock_guard<std::mutex> lock(send_mtx);
+        writing = !send_queue.empty() && !send_closed && !detached;
+        return writing;
+    }
+
+    // everything queued and not written, as raw bytes; only meaningful with the io stopped
+    std::string pending_output()
+    {
+        std::lock_guard<std::mutex> lock(send_mtx);
+        std::string out;
+        for(const auto &o:send_queue)out.append(o.frame->data(), o.frame->size());
+        return out;
+    }
+
+    // bytes queued for all sessions
+    static std::size_t total_outbound(){return outbound_bytes.load(std::memory_order_relaxed);}
+    // the highest id given so far, and making sure that no id up to id is given again
+    static Protocol::id_t last_id(){return id_count;}
+    static void reserve_id(Protocol::id_t id)
+    {
+        Protocol::id_t count = id_count;
+        while(count < id && !id_count.compare_exchange_weak(count, id));
+    }
+
+    // the socket (and so every handler of this user) lives on the given shard
+    User(IoShard& home, const SendLimits& send_limits):User(home, send_limits, ++id_count)
     {}
+
+    // a session taken over from another process keeps its id
+    User(IoShard& home, const SendLimits& send_limits, Protocol::id_t known_id):
+        id(known_id), roomid(Protocol::null_room_id), shard(home), sock(home.context()), limits(send_limits)
+    {
+        if(Uring* ring = shard.ring())ring_sock.reset(new RingSocket<User>(*ring));
+        reserve_id(id);
+        shard.attach();
+    }
+
+    ~User()
+    {
+        outbound_bytes.fetch_sub(queued_bytes, std::memory_order_relaxed);
+        shard.detach();
+    }
 };
 std::atomic<Protocol::id_t> User::id_count;
+std::atomic<std::size_t> User::outbound_bytes;
+
+template <typename F>
+bool Room::enter(UserPtr user, F f)
+{
+    std::lock_guard<std::mutex> lock(mtx);
+    if(closed)return false;
+    users.insert(user, user->getshard());
+    version++;
+    f(history);
+    return true;
+}
+
+template <typename F>
+bool Room::swap(UserPtr old_user, UserPtr new_user, F f)
+{
+    std::lock_guard<std::mutex> lock(mtx);
+    if(!users.erase(old_user, old_user->getshard()))return false;
+    users.insert(new_user, new_user->getshard());
+    f();
+    return true;
+}
+
+Room::left_t Room::leave(UserPtr user)
+{
+    std::lock_guard<std::mutex> lock(mtx);
+    if(!users.erase(user, user->getshard()))return unchanged;
+    return departed();
+}
+
+// with the room locked
+std::string Room::line()
+{
+    std::string line = "Room" + boost::lexical_cast<std::string>(id) + ":\n\tUsers:";
+    int res = Protocol::MaxUsersPerRoom;
+    users.for_each([&](const UserPtr& u)
+    {
+        if(res-- <= 0)return false;
+        line += " " + u->getname();
+        return true;
+    });
+    if(users.size()>Protocol::MaxUsersShowPerLine)line += " ...";
+    std::size_t elsewhere = 0;
+    for(const auto &r:remote)elsewhere += r.second;
+    if(elsewhere)line += " (+" + boost::lexical_cast<std::string>(elsewhere) + " on other nodes)";
+    line += '\n';
+    return line;
+}
 
 class Server
 {
@@ -69,285 +721,1679 @@ class Server
     using recv_msg_t = Protocol::Message::Client_to_Server;
     using send_msg_t = Protocol::Message::Server_to_Client;
 
-    static const int MaxAverageSocket = 100;
-    static const int recv_header_length = sizeof(recv_msg_t::header_t::type) + sizeof(recv_msg_t::header_t::body_len);
-    static const int send_header_length = sizeof(send_msg_t::header_t::type) + sizeof(recv_msg_t::header_t::body_len);
+    static const int recv_header_length = Messages::header_length;
+    static const int MaxFindResults = 50;
+
+    using recv_header_buf_t = std::array<char,Messages::max_header_length_v2>;
+    using recv_body_buf_t = std::array<char,std::max(Protocol::BodyMaxLength, Protocol::BatchMaxLength)>;
+
+    // a body that wraps around the end of a ring is copied here; only used during dispatch
+    static thread_local recv_body_buf_t wrapped_body;
+    // history frames on their way to a newcomer
+    static thread_local std::vector<FramePtr> replay_frames;
+
+    static constexpr std::size_t listing_prefix_length = Codec::fixed_size<Messages::Listing>();
+
+    // a listing or a find, which every node answers for what it has
+    enum query_kind_t : std::uint32_t
+    {
+        query_rooms,
+        query_users,
+        query_find
+    };
+    struct Query
+    {
+        query_kind_t kind;
+        Protocol::id_t cursor;
+        std::uint32_t count;
+        std::string pattern;
+        bool listing;   // answered with a listing frame rather than plain text
+    };
+    // the lines of one node by id, and the cursor of its next page
+    struct Answer
+    {
+        Protocol::id_t next = 0;
+        std::vector<std::pair<Protocol::id_t,std::string>> lines;
+    };
+    // A listening socket of the port. Every shard has its own, bound with SO_REUSEPORT, so that
+    // the kernel spreads new connections over the shards; a session stays on the shard that accepted it.
+    struct Listener
+    {
+        IoShard& shard;
+        asio::ip::tcp::acceptor acceptor;
+        Uring::Callback accept_op;  // the multishot accept when the shard has an io_uring
+        TokenBucket bucket;         // the shard's part of the accept rate
+        asio::steady_timer pause;   // waits for the bucket to refill
+
+        Listener(IoShard& s, std::function<void(int,std::uint32_t)> on_accept):
+            shard(s), acceptor(s.context()), accept_op(std::move(on_accept)), pause(s.context())
+        {}
+    };
+    // a query waiting for the other nodes; its timer runs on the home shard of usr
+    struct Gathering
+    {
+        UserPtr usr;
+        Query query;
+        std::vector<Answer> answers;
+        std::size_t waiting;
+        asio::steady_timer timer;
 
-    using recv_header_buf_t = std::array<char,recv_header_length>;
-    using recv_body_buf_t = std::array<char,Protocol::BodyMaxLength>;
-    using send_buf_t = std::array<char,Protocol::BodyMaxLength+send_header_length>;
+        Gathering(UserPtr u, Query q, std::size_t nodes):
+            usr(u), query(std::move(q)), answers(nodes), waiting(nodes-1), timer(u->getexecutor())
+        {}
+    };
 
-    std::map< Protocol::id_t, UserPtr > users;
-    std::map< Protocol::id_t, RoomPtr > rooms;
-    asio::io_service asio_service;
+    ServerOptions options;
+    std::vector<std::unique_ptr<IoShard>> shards;
+    // what every shard keeps for its sessions, set up once
+    struct ShardState
+    {
+        FlushTick<UserPtr> tick;
+        TimerWheel<User> wheel;     // liveness of the sessions
+    };
+    std::map<IoShard*,std::unique_ptr<ShardState>> shard_states;
+    static constexpr std::chrono::milliseconds LivenessTick{100};
+    std::size_t next_shard = 0;
+    Registry<UserPtr> users;
+    SampledRegistry<RoomPtr> rooms;
+    NameIndex names;
+    Directory room_dir, user_dir;
     asio::ip::tcp::endpoint server_ep;
-    asio::ip::tcp::acceptor acceptor;
-    std::vector<std::shared_ptr<std::thread>> threads;
+    std::vector<std::unique_ptr<Listener>> listeners;
+    FramePtr full_notice;             // what a connection turned away gets, in v1 as it has not said hello
+    asio::steady_timer stats_timer;   // runs on shards[0]
+    std::unique_ptr<ChatLog> chat_log;
+    asio::local::stream_protocol::acceptor handoff_acceptor;   // runs on shards[0]
+    std::thread handoff_thread;
+    std::mutex handoff_mtx;             // guards handoff_thread and closing
+    bool closing = false;               // Close has begun: no handoff starts any more
+    std::atomic<bool> handed_off{false};
+    int stop_event;                     // an eventfd, readable once the server has handed off
+    std::atomic<bool> draining{false};  // a handoff is stopping all io
+    Metrics::Reporter console_stats, file_stats;
+    std::unique_ptr<Cluster> cluster;   // null: a single server
+    std::mutex gather_mtx;
+    std::unordered_map<std::uint32_t,std::shared_ptr<Gathering>> gatherings;
+    std::uint32_t gather_count = 0;
+
+    static std::vector<std::unique_ptr<IoShard>> MakeShards(unsigned n)
+    {
+        std::vector<std::unique_ptr<IoShard>> v;
+        for(unsigned i=0;i<std::max(1u,n);i++)v.emplace_back(new IoShard);
+        return v;
+    }
+
+    // an io_uring for every shard or for none
+    bool OpenRings()
+    {
+        for(auto& shard:shards)
+            if(!shard->open_ring(options.ring_entries, options.ring_buffers, RecvRing::Capacity))
+            {
+                for(auto& s:shards)s->close_ring();
+                return false;
+            }
+        return true;
+    }
+
+    // A listening socket on shard sharing the port with the others, or the one fd was handed over.
+    boost::system::error_code OpenListener(IoShard& shard, int fd = -1)
+    {
+        std::size_t i = listeners.size();
+        listeners.emplace_back(new Listener(shard, [this, i](int res, std::uint32_t flags){this->RingAcceptHandler(*listeners[i], res, flags);}));
+        auto& acceptor = listeners.back()->acceptor;
+        boost::system::error_code eno;
+        if(fd >= 0)acceptor.assign(server_ep.protocol(), fd, eno);
+        else
+        {
+            acceptor.open(server_ep.protocol(), eno);
+            if(!eno)acceptor.set_option(asio::ip::tcp::acceptor::reuse_address(true), eno);
+            if(!eno)acceptor.set_option(asio::detail::socket_option::boolean<SOL_SOCKET, SO_REUSEPORT>(true), eno);
+            if(!eno)acceptor.bind(server_ep, eno);
+            if(!eno)acceptor.listen(asio::socket_base::max_listen_connections, eno);
+        }
+        if(eno)listeners.pop_back();
+        return eno;
+    }
+
+    // the accept rate is shared out among the listeners
+    void SetAcceptRate()
+    {
+        double n = listeners.size();
+        double burst = options.accept_burst > 0 ? options.accept_burst : options.accept_rate;
+        for(auto& l:listeners)l->bucket = TokenBucket(options.accept_rate/n, burst/n);
+    }
+
+    // least loaded shard, ties are broken round-robin
+    IoShard& PickShard()
+    {
+        std::size_t best = next_shard;
+        for(std::size_t i=1;i<shards.size();i++)
+        {
+            std::size_t k = (next_shard+i)%shards.size();
+            if(shards[k]->load() < shards[best]->load())best = k;
+        }
+        next_shard = (best+1)%shards.size();
+        return *shards[best];
+    }
+
+    // Leaves the current room (if any) and enters room (null to just leave).
+    // The copy of a room of another node has no history, its owner sent the replay along.
+    // Returns false if room was closed meanwhile, which leaves the user in no room, or if the session is closed.
+    bool MoveToRoom(UserPtr usr, RoomPtr room, FramePtr replay = nullptr)
+    {
+        if(!usr->is_open())return false;
+        // entering the room one is in again does not empty it
+        if(usr->getroom()!=Protocol::null_room_id && !(room && room->getid()==usr->getroom()))
+            if(auto old_room = rooms.find(usr->getroom()))LeftRoom(old_room, old_room->leave(usr));
+        bool entered = room && room->enter(usr, [&](const HistoryRing& history)
+            {
+                usr->setroom(room->getid());
+                InformRoom(usr);
+                // the recent chat goes out as one batch right behind the roomchange
+                if(replay)
+                {
+                    RegisterSend(usr, replay, true);
+                    return;
+                }
+                replay_frames.clear();
+                history.for_each_last(options.replay_size, [](const FramePtr& f){replay_frames.push_back(f);});
+                RegisterSend(usr, replay_frames.begin(), replay_frames.end(), true);
+                replay_frames.clear();
+            });
+        if(entered)RefreshRoomLine(*room);
+        else
+        {
+            usr->setroom(Protocol::null_room_id);
+            InformRoom(usr);
+        }
+        RefreshUserLine(*usr);
+        return entered || !room;
+    }
+
+    // a user left room: the owner of a room of another node is told
+    void LeftRoom(const RoomPtr& room, Room::left_t change)
+    {
+        if(change == Room::unchanged)return;
+        if(!Owns(room->getid()))cluster->send(cluster->owner(room->getid()), {Peer::Encode(Peer::part, {room->getid()})});
+        Departed(room, change);
+    }
+
+    // a member here or on another node is gone
+    void Departed(const RoomPtr& room, Room::left_t change)
+    {
+        if(change == Room::emptied)DropRoom(room);
+        else if(change == Room::left)RefreshRoomLine(*room);
+    }
+
+    // An emptied room is closed, so nobody enters it and no line of it is published any more:
+    // it goes from the directory and the registry. Its log, if any, stays for FindRoom to bring it back.
+    void DropRoom(const RoomPtr& room)
+    {
+        if(Owns(room->getid()))room_dir.erase(room->getid());
+        rooms.erase(room->getid(), room);
+        Metrics::add(Metrics::rooms_dropped);
+    }
+
+    // a room of this node, brought back from its log if it was dropped
+    RoomPtr FindRoom(Protocol::id_t roomid)
+    {
+        auto room = rooms.find(roomid);
+        if(room || !chat_log || !Owns(roomid))return room;
+        auto slice = chat_log->read(roomid, 0, options.history_size, true);
+        if(slice.end == 0)return nullptr;
+        room = std::make_shared<Room>(roomid, options.history_size, options.spread_at);
+        for(auto& frame:slice.frames)room->post(frame, [](const UserPtr&){});
+        if(!rooms.insert(roomid, room))return rooms.find(roomid);
+        RefreshRoomLine(*room);
+        return room;
+    }
+
+    // rooms are listed by their own node, which knows all of their members
+    void RefreshRoomLine(Room &room)
+    {
+        if(!Owns(room.getid()))return;
+        room.render([&](std::string line, std::uint64_t version){room_dir.set(room.getid(), std::move(line), version);});
+    }
+
+    // only called from the user's home shard, so user lines need no version
+    void RefreshUserLine(User &u)
+    {
+        std::string line = "User " + u.getname();
+        if(u.getroom()!=Protocol::null_room_id)
+            line += "(in room " + lexical_cast<std::string>(u.getroom()) + ")";
+        line += '\n';
+        user_dir.set(u.getid(), std::move(line));
+    }
+
+    // a page of a listing, next is where the following one starts (0: none)
+    FramePtr EncodeListing(Protocol::Message::list_kind_t kind, Protocol::id_t next, const std::string& text)
+    {
+        std::string body(listing_prefix_length, '\0');
+        Codec::encode(Messages::Listing{kind, next}, &body[0]);
+        body += text;
+        body.push_back('\0');
+        return MakeFrame(send_msg_t::header_t::listing, body.data(), body.size());
+    }
+
+    // what this node has for a query
+    Answer AnswerQuery(const Query& q)
+    {
+        Answer a;
+        if(q.kind == query_find)
+        {
+            std::size_t limit = std::min<std::size_t>(q.count, MaxFindResults);
+            auto add = [&](const UserPtr& u, const std::string& name)
+            {
+                std::string line = "User " + name;
+                if(u->getroom()!=Protocol::null_room_id)
+                    line += "(in room" + lexical_cast<std::string>(u->getroom()) + ")";
+                line += "\n";
+                a.lines.emplace_back(u->getid(), std::move(line));
+            };
+            // an empty name matches everyone, as it always did: the first users by id, named or not
+            if(q.pattern.empty())
+            {
+                for(auto id:user_dir.ids(0, limit))
+                    if(auto u = users.find(id))add(u, u->getname());
+                return a;
+            }
+            for(auto& m:names.search(q.pattern, limit))
+                if(auto u = users.find(m.id))add(u, m.name);
+            return a;
+        }
+        const Directory& dir = q.kind==query_users ? user_dir : room_dir;
+        std::size_t max_bytes = Protocol::BodyMaxLength-1 - (q.listing ? listing_prefix_length : 0);
+        a.next = dir.page(q.cursor, q.count, max_bytes, a.lines);
+        return a;
+    }
+
+    // Puts the answers of the nodes together, a find in the order of the nodes and a listing by id.
+    // A listing stops where the first node to stop did, and goes on from there or from the first
+    // line that did not fit.
+    void Present(UserPtr usr, const Query& q, std::vector<Answer>& answers)
+    {
+        std::vector<std::pair<Protocol::id_t,std::string>> lines;
+        Protocol::id_t next = 0;
+        auto resume_at = [&](Protocol::id_t id){if(id && (!next || id < next))next = id;};
+        for(auto& a:answers)
+        {
+            resume_at(a.next);
+            std::move(a.lines.begin(), a.lines.end(), std::back_inserter(lines));
+        }
+        if(q.kind != query_find)
+        {
+            std::sort(lines.begin(), lines.end(), [](const auto& a, const auto& b){return a.first < b.first;});
+            // a node that stopped early leaves out ids others went past: those wait for the next page
+            if(next)lines.erase(std::lower_bound(lines.begin(), lines.end(), next,
+                [](const auto& line, Protocol::id_t id){return line.first < id;}), lines.end());
+        }
+
+        std::size_t max_bytes = Protocol::BodyMaxLength-1 - (q.listing ? listing_prefix_length : 0), n = 0;
+        std::string text;
+        for(;n<lines.size() && n<q.count && text.size()+lines[n].second.size()<=max_bytes;n++)text += lines[n].second;
+        if(n < lines.size())resume_at(lines[n].first);
+
+        if(q.listing)
+            RegisterSend(usr, EncodeListing(q.kind==query_users ? Protocol::Message::list_users : Protocol::Message::list_rooms, next, text));
+        else SendPrint(usr, text);
+    }
+
+    // Answers a query for the whole cluster: every other node is asked, and the answer goes out
+    // once they all have answered, or after the query timeout without the missing ones.
+    void Gather(UserPtr usr, Query q)
+    {
+        if(!cluster)
+        {
+            std::vector<Answer> answers{AnswerQuery(q)};
+            Present(usr, q, answers);
+            return;
+        }
+        auto g = std::make_shared<Gathering>(usr, std::move(q), cluster->size());
+        g->answers[cluster->self()] = AnswerQuery(g->query);
+        std::uint32_t id;
+        {
+            std::lock_guard<std::mutex> lock(gather_mtx);
+            id = ++gather_count;
+            gatherings.emplace(id, g);
+        }
+        g->timer.expires_after(cluster->getoptions().query_timeout);
+        g->timer.async_wait([=](const boost::system::error_code& eno)
+        {
+            if(eno == asio::error::operation_aborted)return;
+            if(auto done = EndGathering(id))
+            {
+                Metrics::add(Metrics::gather_timeouts);
+                Present(done->usr, done->query, done->answers);
+            }
+        });
+
+        Tools::Writer body;
+        body.u32(id);
+        body.u32(g->query.kind);
+        body.u32(g->query.cursor);
+        body.u32(g->query.count);
+        body.u32(g->query.listing);
+        body.raw(g->query.pattern);
+        FramePtr frame = Peer::Encode(Peer::query, body);
+        for(Peer::node_t n=0;n<cluster->size();n++)
+            if(n != cluster->self() && !cluster->send(n, {frame}))Answered(id, n, nullptr);
+    }
+
+    // the answer of node to gathering id, null if it is not going to come
+    void Answered(std::uint32_t id, Peer::node_t node, Answer* answer)
+    {
+        std::shared_ptr<Gathering> g;
+        {
+            std::lock_guard<std::mutex> lock(gather_mtx);
+            auto it = gatherings.find(id);
+            if(it == gatherings.end())return;
+            if(answer)it->second->answers[node] = std::move(*answer);
+            if(--it->second->waiting)return;
+            g = std::move(it->second);
+            gatherings.erase(it);
+        }
+        asio::post(g->usr->getexecutor(), pooled([=]
+        {
+            g->timer.cancel();
+            this->Present(g->usr, g->query, g->answers);
+        }));
+    }
+
+    std::shared_ptr<Gathering> EndGathering(std::uint32_t id)
+    {
+        std::lock_guard<std::mutex> lock(gather_mtx);
+        auto it = gatherings.find(id);
+        if(it == gatherings.end())return nullptr;
+        auto g = std::move(it->second);
+        gatherings.erase(it);
+        return g;
+    }
+
+    bool Owns(Protocol::id_t roomid)
+    {
+        return !cluster || cluster->owner(roomid) == cluster->self();
+    }
+
+    // the next room id that hashes to this node
+    Protocol::id_t NewRoomId()
+    {
+        Protocol::id_t id;
+        do id = Room::next_id(); while(!Owns(id));
+        return id;
+    }
+
+    // a room of another node is entered once its owner has answered
+    void EnterRoom(UserPtr usr, Protocol::id_t roomid)
+    {
+        if(Owns(roomid))
+        {
+            // a room emptied at this very moment is gone as well
+            auto room = FindRoom(roomid);
+            if(!room || !MoveToRoom(usr, room))SendPrint(usr, "No room " + lexical_cast<std::string>(roomid));
+            return;
+        }
+        auto owner = cluster->owner(roomid);
+        if(!cluster->send(owner, {Peer::Encode(Peer::join, {roomid, usr->getid(), static_cast<std::uint32_t>(options.replay_size)})}))
+            SendPrint(usr, "Room " + lexical_cast<std::string>(roomid) + " is on node " + lexical_cast<std::string>(owner) + ", which cannot be reached");
+    }
+
+    // the owner of roomid took usr in: the chat of the room comes to its local copy
+    void EnterReplica(UserPtr usr, Protocol::id_t roomid, FramePtr replay)
+    {
+        if(!usr->is_open())
+        {
+            cluster->send(cluster->owner(roomid), {Peer::Encode(Peer::part, {roomid})});
+            return;
+        }
+        while(true)
+        {
+            auto room = rooms.find(roomid);
+            if(!room)
+            {
+                rooms.insert(roomid, std::make_shared<Room>(roomid, 0, options.spread_at));
+                continue;
+            }
+            if(MoveToRoom(usr, room, replay))return;
+            if(!usr->is_open())
+            {
+                cluster->send(cluster->owner(roomid), {Peer::Encode(Peer::part, {roomid})});
+                return;
+            }
+            // the copy was emptied by its last member meanwhile: a new one replaces it
+            rooms.erase(roomid, room);
+        }
+    }
+
+    // a frame from another node, on the io thread of the link it came on
+    void PeerHandler(Peer::node_t from, Peer::type_t type, std::string_view body)
+    {
+        Tools::Reader r(body);
+        switch(type)
+        {
+            case Peer::join:
+            {
+                Protocol::id_t roomid = r.u32(), userid = r.u32();
+                std::uint32_t replay = r.u32();
+                if(!r.ok())break;
+                auto room = Owns(roomid) ? FindRoom(roomid) : nullptr;
+                // the replay is queued in the same locked section as the subscription,
+                // so the chat that follows it is exactly what it misses
+                bool subscribed = room && room->subscribe(from, [&](const HistoryRing& history)
+                {
+                    if(replay == Peer::Resync)return;
+                    Tools::Writer w;
+                    w.u32(roomid);
+                    w.u32(userid);
+                    history.for_each_last(std::min<std::size_t>(replay, options.replay_size),
+                        [&](const FramePtr& f){w.raw(std::string_view(f->data(), f->size()));});
+                    cluster->send(from, {Peer::Encode(Peer::joined, w)});
+                });
+                if(subscribed)RefreshRoomLine(*room);
+                else cluster->send(from, {Peer::Encode(Peer::no_room, {roomid, userid})});
+                break;
+            }
+
+            case Peer::joined:
+            {
+                Protocol::id_t roomid = r.u32(), userid = r.u32();
+                std::string_view replay = r.rest();
+                if(!r.ok())break;
+                auto usr = users.find(userid);
+                if(!usr)
+                {
+                    cluster->send(from, {Peer::Encode(Peer::part, {roomid})});
+                    break;
+                }
+                FramePtr frames;
+                if(!replay.empty())
+                {
+                    auto copy = std::make_shared<const std::string>(replay);
+                    frames = MakeFrame(copy, copy->data(), copy->size());
+                }
+                asio::post(usr->getexecutor(), pooled([=]{this->EnterReplica(usr, roomid, frames);}));
+                break;
+            }
+
+            case Peer::no_room:
+            {
+                Protocol::id_t roomid = r.u32(), userid = r.u32();
+                auto usr = users.find(userid);
+                if(!r.ok() || !usr)break;
+                asio::post(usr->getexecutor(), pooled([=]
+                {
+                    // the room went away under a member announced again after a reconnect
+                    if(usr->getroom() == roomid)this->MoveToRoom(usr, nullptr);
+                    this->SendPrint(usr, "No room " + lexical_cast<std::string>(roomid));
+                }));
+                break;
+            }
+
+            case Peer::part:
+            {
+                Protocol::id_t roomid = r.u32();
+                auto room = Owns(roomid) ? rooms.find(roomid) : nullptr;
+                if(!r.ok() || !room)break;
+                Departed(room, room->unsubscribe(from));
+                break;
+            }
+
+            case Peer::say:
+            case Peer::chat:
+            {
+                Protocol::id_t roomid = r.u32();
+                std::string_view frame_bytes = r.rest();
+                // say only goes to the room's own node, and chat only comes from it
+                if(!r.ok() || (type == Peer::say) != Owns(roomid) || !IsPrintFrame(frame_bytes))break;
+                auto room = rooms.find(roomid);
+                if(!room)break;
+                auto copy = std::make_shared<const std::string>(frame_bytes);
+                FramePtr frame = MakeFrame(copy, copy->data(), copy->size());
+                Broadcast(*room, frame);
+                if(type == Peer::say && chat_log)chat_log->append(roomid, std::move(frame));
+                break;
+            }
+
+            case Peer::query:
+            {
+                Query q;
+                std::uint32_t id = r.u32();
+                q.kind = static_cast<query_kind_t>(r.u32());
+                q.cursor = r.u32();
+                q.count = std::min<std::uint32_t>(r.u32(), Protocol::MaxPageSize);
+                q.listing = r.u32();
+                q.pattern = std::string(r.rest());
+                if(!r.ok())break;
+                Answer a = AnswerQuery(q);
+                Tools::Writer w;
+                w.u32(id);
+                w.u32(a.next);
+                for(auto& line:a.lines)
+                {
+                    w.u32(line.first);
+                    w.bytes(line.second);
+                }
+                cluster->send(from, {Peer::Encode(Peer::answer, w)});
+                break;
+            }
+
+            case Peer::answer:
+            {
+                std::uint32_t id = r.u32();
+                Answer a;
+                a.next = r.u32();
+                while(r.ok() && r.size())
+                {
+                    Protocol::id_t line_id = r.u32();
+                    a.lines.emplace_back(line_id, std::string(r.bytes()));
+                }
+                if(r.ok())Answered(id, from, &a);
+                break;
+            }
+
+            default:
+                std::cerr << "cluster: node " << from << " sent an undefined type=" << type << std::endl;
+        }
+    }
+
+    // one complete print frame, as relayed chat has to be
+    static bool IsPrintFrame(std::string_view bytes)
+    {
+        send_msg_t::header_t header;
+        if(!Codec::decode(bytes.data(), bytes.size(), header))return false;
+        return header.type == send_msg_t::header_t::print && header.body_len == bytes.size()-recv_header_length;
+    }
+
+    // the link to node came up: it hears again of every local member of its rooms
+    void Resync(Peer::node_t node)
+    {
+        for(auto& pr:users.snapshot())
+        {
+            Protocol::id_t roomid = pr.second->getroom();
+            if(roomid != Protocol::null_room_id && cluster->owner(roomid) == node)
+                cluster->send(node, {Peer::Encode(Peer::join, {roomid, pr.first, Peer::Resync})});
+        }
+    }
+
+    // The members node had in the rooms of this node are unknown until it tells them again.
+    // Rooms wait resync_grace for that before they close for want of members; the timer runs on shards[0].
+    void ResetNode(Peer::node_t node)
+    {
+        auto until = std::chrono::steady_clock::now() + cluster->getoptions().resync_grace;
+        for(auto& pr:rooms.snapshot())
+            Departed(pr.second, pr.second->unsubscribe_all(node, until));
+        auto timer = std::make_shared<asio::steady_timer>(shards[0]->context(), until);
+        timer->async_wait([this, node, timer](const boost::system::error_code& eno)
+        {
+            if(eno == asio::error::operation_aborted)return;
+            auto now = std::chrono::steady_clock::now();
+            for(auto& pr:rooms.snapshot())
+                Departed(pr.second, pr.second->resynced(node, now));
+        });
+    }
+
+    // Tears the session down once, whichever handler noticed the problem first.
+    void CloseSession(UserPtr usr)
+    {
+        if(!usr->close())return;
+        Metrics::add(Metrics::sessions_closed);
+        shard_states.at(&usr->getshard())->wheel.cancel(usr->getliveness().entry);
+        usr->close_socket();
+        users.erase(usr->getid());
+        names.erase(usr->getid());
+        user_dir.erase(usr->getid());
+        if(auto room = rooms.find(usr->getroom()))LeftRoom(room, room->leave(usr));
+    }
+
+    // The connection of usr is gone. A cap_resume session waits for a resume until the resume window
+    // is over, in its room and with what is sent to it queued; any other is closed.
+    void DetachSession(UserPtr usr)
+    {
+        // what was in flight on a connection already given up fails as well
+        if(usr->is_detached())return;
+        if(!options.resume_window.count() || !usr->detach())
+        {
+            CloseSession(usr);
+            return;
+        }
+        Metrics::add(Metrics::sessions_detached);
+        usr->close_socket();
+        shard_states.at(&usr->getshard())->wheel.schedule(usr->getliveness().entry, options.resume_window);
+    }
+
+    // The session of a dropped connection goes on in usr, a new one that has not entered a room:
+    // usr takes its id, name and room, and gets what was queued for it meanwhile right behind the answer.
+    void ResumeSession(UserPtr usr, const Messages::Resume& msg)
+    {
+        std::uint64_t token = static_cast<std::uint64_t>(msg.token_high) << 32 | msg.token_low;
+        UserPtr old = users.find(msg.id);
+        if(!usr->getresume() || usr->getroom()!=Protocol::null_room_id || !old || old==usr || !old->claim(token))
+        {
+            Metrics::add(Metrics::resume_failed);
+            RegisterSend(usr, EncodeResumed(0, Protocol::null_room_id, ""));
+            return;
+        }
+        Metrics::add(Metrics::sessions_resumed);
+        users.erase(usr->getid(), usr);
+        names.erase(usr->getid());
+        user_dir.erase(usr->getid());
+        std::string name = old->getname();
+        usr->setid(old->getid());
+        usr->setname(name);
+        users.erase(old->getid(), old);
+        users.insert(usr->getid(), usr);
+
+        Protocol::id_t roomid = old->getroom();
+        auto take_over = [&]
+        {
+            usr->setroom(roomid);
+            Metrics::frame_out(send_msg_t::header_t::resumed);
+            Queued(usr, usr->resume(*old, EncodeResumed(usr->getid(), roomid, name)));
+        };
+        auto room = rooms.find(roomid);
+        if(!room || !room->swap(old, usr, take_over))
+        {
+            roomid = Protocol::null_room_id;
+            take_over();
+        }
+        RefreshUserLine(*usr);
+        // the wheel of the old session's shard is only touched there
+        asio::post(old->getexecutor(), pooled([this, old]
+        {
+            shard_states.at(&old->getshard())->wheel.cancel(old->getliveness().entry);
+        }));
+    }
+
+    // The session is only made once a connection has come and the server has room for it.
+    void RegisterAccept(Listener& l)
+    {
+        if(draining)return;
+        if(Uring* ring = l.shard.ring())
+        {
+            // a multishot accept would take every connection the kernel has, whatever the rate
+            ring->accept(l.acceptor.native_handle(), &l.accept_op, options.accept_rate <= 0);
+            return;
+        }
+        l.acceptor.async_accept(pooled([this, &l](const boost::system::error_code& eno, asio::ip::tcp::socket peer)
+        {
+            UserPtr new_user;
+            if(!eno && Admit(peer.native_handle()))
+            {
+                new_user = std::make_shared<User>(l.shard, options.send_limits);
+                new_user->assign(std::move(peer));
+            }
+            this->AcceptHandler(l, new_user, eno);
+        }));
+    }
+
+    void RegisterRead(UserPtr usr)
+    {
+        if(draining)return;
+        if(auto ring = usr->getring())
+        {
+            ring->async_receive(usr, [this](const UserPtr& u, const boost::system::error_code& eno, const char* data, std::size_t len)
+            {
+                this->RingReceiveHandler(u, eno, data, len);
+            });
+            return;
+        }
+        // no buffer is tied up while the session is idle: it is read once it is readable
+        usr->getsock().async_wait(asio::socket_base::wait_read,
+            pooled([=](const boost::system::error_code& eno){ this->ReadableHandler(usr,eno); }) );
+    }
+
+    // Frames go through the user's queue so that only one write is in flight per socket.
+    // Droppable (chat) frames may be dropped when the user does not read fast enough.
+    void RegisterSend(UserPtr usr, FramePtr frame, bool droppable = false)
+    {
+        RegisterSend(usr, std::make_move_iterator(&frame), std::make_move_iterator(&frame+1), droppable);
+    }
+
+    // queues frames together, so that they leave in the same write
+    template <typename It>
+    void RegisterSend(UserPtr usr, It first, It last, bool droppable)
+    {
+        if(first == last)return;
+        for(It it=first;it!=last;++it)Metrics::frame_out((*it)->type());
+        Queued(usr, usr->queue_send(first, last, droppable));
+    }
+
+    void Queued(UserPtr usr, User::send_result_t result)
+    {
+        switch(result)
+        {
+            case User::start_flush:
+                asio::post(usr->getexecutor(), pooled([=]{this->StartSend(usr);}));
+                break;
+            case User::overflow:
+                // the caller may hold a room lock that closing the session takes
+                asio::post(usr->getexecutor(), pooled([=]{this->CloseSession(usr);}));
+                break;
+            default:
+                break;
+        }
+    }
+
+    // a session that was not writing starts: right away, or with the others of its shard at the next tick
+    void StartSend(UserPtr usr)
+    {
+        if(!draining && shard_states.at(&usr->getshard())->tick.defer(usr))
+        {
+            Metrics::add(Metrics::writes_deferred);
+            return;
+        }
+        FlushSend(usr);
+    }
+
+    void FlushSend(UserPtr usr)
+    {
+        if(draining)return;
+        if(auto ring = usr->getring())
+        {
+            ring->async_write(usr, usr->take_send_batch(), [this](const UserPtr& u, const boost::system::error_code& eno, std::size_t len)
+            {
+                this->WriteHandler(u, eno, len);
+            });
+            return;
+        }
+        asio::async_write( usr->getsock(), usr->take_send_batch(),
+            pooled([=](const boost::system::error_code& eno, std::size_t len){this->WriteHandler(usr,eno,len);}));
+    }
+
+    // false if the server is full: the connection is told so and closed by the caller.
+    // Shards admit at the same time, so the limit may be overshot by a few.
+    bool Admit(int fd)
+    {
+        if(users.size() < options.max_users)return true;
+        Metrics::add(Metrics::accept_rejects);
+        ::send(fd, full_notice->data(), full_notice->size(), MSG_DONTWAIT | MSG_NOSIGNAL);
+        return false;
+    }
+
+    // new_user is null if the connection was turned away; it is already on its home shard
+    void AcceptHandler(Listener& l, UserPtr new_user, const boost::system::error_code& eno, bool more = false)
+    {
+        if(eno == asio::error::operation_aborted)return;
+        Metrics::add(eno ? Metrics::accept_errors : Metrics::accepts);
+        if(!eno)l.bucket.take();
+        if(new_user)
+        {
+            users.insert(new_user->getid(), new_user);
+            RefreshUserLine(*new_user);
+            StartLiveness(new_user);
+            RegisterRead(new_user);
+        }
+        AcceptNext(l, more);
+    }
+
+    // A multishot accept goes on by itself as long as there are more completions to come.
+    // Once the accept rate has run out, connections wait in the backlog until the bucket refills.
+    void AcceptNext(Listener& l, bool more)
+    {
+        if(more || draining)return;
+        auto wait = l.bucket.wait();
+        if(wait == wait.zero())
+        {
+            RegisterAccept(l);
+            return;
+        }
+        Metrics::add(Metrics::accept_pauses);
+        l.pause.expires_after(wait);
+        l.pause.async_wait([this, &l](const boost::system::error_code& eno){if(!eno)this->RegisterAccept(l);});
+    }
+
+    void RingAcceptHandler(Listener& l, int res, std::uint32_t flags)
+    {
+        UserPtr new_user;
+        boost::system::error_code eno;
+        if(res < 0)eno = boost::system::error_code(-res, asio::error::get_system_category());
+        else if(Admit(res))
+        {
+            new_user = std::make_shared<User>(l.shard, options.send_limits);
+            new_user->assign(server_ep.protocol(), res);
+        }
+        else ::close(res);
+        AcceptHandler(l, new_user, eno, flags & IORING_CQE_F_MORE);
+    }
+
+    void ReadableHandler(UserPtr usr, const boost::system::error_code& eno)
+    {
+        if(eno)
+        {
+            ReceiveHandler(usr, eno, 0);
+            return;
+        }
+        boost::system::error_code read_eno;
+        std::size_t len = usr->getsock().receive(usr->getinbox().prepare(), 0, read_eno);
+        if(read_eno == asio::error::would_block || read_eno == asio::error::try_again)
+        {
+            usr->getinbox().release();
+            RegisterRead(usr);
+            return;
+        }
+        ReceiveHandler(usr, read_eno, len);
+    }
+
+    // Everything that is available has been read into the inbox: dispatch every complete frame,
+    // keep a partial one for the next read.
+    void ReceiveHandler(UserPtr usr, const boost::system::error_code& eno, std::size_t recv_len)
+    {
+        if(eno)
+        {
+            // stopped by a handoff: the session goes on in the next process
+            if(eno == asio::error::operation_aborted && draining)return;
+            if(eno != asio::error::eof)
+            {
+                std::cerr << "usr= " << usr->getname() << " errno: " << eno << std::endl;
+                Metrics::add(Metrics::read_errors);
+            }
+            DetachSession(usr);
+            return;
+        }
+        Metrics::add(Metrics::reads);
+        Metrics::add(Metrics::bytes_in, recv_len);
+        usr->getinbox().commit(recv_len);
+        if(DispatchInbox(usr))RegisterRead(usr);
+    }
 
-    void RegisterAccept()
+    // The same with an io_uring: len bytes at data, in a provided buffer that goes back to the ring
+    // once this returns. The multishot receive goes on by itself.
+    void RingReceiveHandler(const UserPtr& usr, const boost::system::error_code& eno, const char* data, std::size_t len)
     {
-        auto new_user = std::make_shared<User>(asio_service);
-        acceptor.async_accept( new_user->getsock(),  [=](const boost::system::error_code& eno){this->AcceptHandler(new_user, eno);} );
+        if(eno)
+        {
+            ReceiveHandler(usr, eno, 0);
+            return;
+        }
+        Metrics::add(Metrics::reads);
+        Metrics::add(Metrics::bytes_in, len);
+        auto& inbox = usr->getinbox();
+        // once its complete frames are dispatched the inbox has room for more, no frame fills it
+        while(len)
+        {
+            std::size_t n = std::min(len, inbox.space());
+            inbox.append(data, n);
+            data += n;
+            len -= n;
+            if(!DispatchInbox(usr))return;
+        }
     }
 
-    void RegisterReadHeader(UserPtr usr)
+    // dispatches every complete frame of the inbox, keeps a partial one; false if the session was closed
+    bool DispatchInbox(UserPtr usr)
     {
-        auto header_buf = std::make_shared<recv_header_buf_t>();
-        auto lambda = [=](const boost::system::error_code& eno, std::size_t len){ this->ReceiveHeaderHandler(usr,header_buf,eno,len); };
-        asio::async_read(usr->getsock(), buffer(*header_buf),  asio::transfer_exactly(recv_header_length), lambda );
+        if(Live())usr->getliveness().heard = shard_states.at(&usr->getshard())->wheel.now();
+        auto& inbox = usr->getinbox();
+        while(true)
+        {
+            // the protocol may change with any frame (hello)
+            recv_msg_t::header_t header;
+            int header_length = PeekHeader(usr->getprotocol(), inbox, header);
+            if(header_length == 0)return true;
+            std::size_t max_body = header.type==recv_msg_t::header_t::batch ? Protocol::BatchMaxLength : Protocol::BodyMaxLength;
+            if(header_length < 0 || header.body_len > max_body)
+            {
+                if(header_length < 0)std::cerr << "usr= " << usr->getname() << " bad header" << std::endl;
+                else std::cerr << "usr= " << usr->getname() << " body_len=" << header.body_len << " too long!" << std::endl;
+                Metrics::add(Metrics::bad_frames);
+                CloseSession(usr);
+                return false;
+            }
+            if(inbox.size() < header_length + header.body_len)return true;
+
+            const char* body = inbox.contiguous(header_length, header.body_len);
+            if(!body)
+            {
+                inbox.copy(wrapped_body.data(), header_length, header.body_len);
+                body = wrapped_body.data();
+            }
+            Dispatch(usr, header, body);
+            inbox.consume(header_length + header.body_len);
+            if(!usr->is_open())return false;
+        }
     }
 
-    void RegisterReadBody(UserPtr usr, const recv_msg_t::header_t& header)
+    // The header at in, in the given protocol: returns its length, 0 if it is not complete yet, -1 if it is not a header.
+    static int DecodeHeader(std::uint8_t version, const char* in, std::size_t n, recv_msg_t::header_t& header)
     {
-        auto body_buf_ptr = std::make_shared<recv_body_buf_t>();
-        asio::async_read( usr->getsock(), buffer(*body_buf_ptr), asio::transfer_exactly(header.body_len),
-            [=](const boost::system::error_code& eno, std::size_t len){ this->ReceiveBodyHandler(usr,body_buf_ptr,header,eno,len); } );
+        std::size_t len = Codec::decode(version, in, n, header);
+        if(len)return static_cast<int>(len);
+        return version != 1 && !Codec::varint_viable<recv_msg_t::header_t>(in, n) ? -1 : 0;
     }
 
-    template <typename T>
-    void RegisterSend(UserPtr usr, const T& send_buf, std::uint32_t send_len)
+    // the header at the front of the inbox, like DecodeHeader
+    static int PeekHeader(std::uint8_t version, const RecvRing& inbox, recv_msg_t::header_t& header)
     {
-        asio::async_write( usr->getsock(), buffer(send_buf), asio::transfer_exactly(send_len),
-            [=](const boost::system::error_code& eno, std::size_t len){this->WriteHandler(eno,len);});
+        recv_header_buf_t header_buf;
+        std::size_t n = std::min(inbox.size(), header_buf.size());
+        inbox.copy(header_buf.data(), 0, n);
+        return DecodeHeader(version, header_buf.data(), n, header);
     }
 
-    void AcceptHandler(UserPtr new_user, const boost::system::error_code& eno)
+    void Dispatch(UserPtr usr, const recv_msg_t::header_t& header, const char* body)
     {
-        if(!eno)
-        {
-            // header = type + body_len
-            users[new_user->getid()] = new_user;
-            RegisterReadHeader(new_user);
-            if( users.size() > MaxAverageSocket*threads.size()) // equals to (users.size()/threads.size() > MaxAverageSocket)
-                threads.emplace_back( std::make_shared<std::thread>([&]{asio_service.run();}) );
-        }
-        RegisterAccept();
+        Metrics::frame_in(header.type);
+        Metrics::ScopedTimer timer(header.type);
+        ReceiveHeaderHandler(usr, header, body);
     }
 
-    void ReceiveHeaderHandler(UserPtr usr, std::shared_ptr<recv_header_buf_t> header_buf, const boost::system::error_code& eno, std::size_t recv_len)
+    // every message of a batch is handled as if it had come on its own
+    void ReceiveBatch(UserPtr usr, const recv_msg_t::header_t& header, const char* body)
     {
-        if(eno)
+        const char* end = body+header.body_len;
+        while(body != end)
         {
-            std::cerr << "usr= " << usr->getname() << " errno: " << eno << std::endl;
-            usr->getsock().close();
+            recv_msg_t::header_t inner;
+            int n = usr->getprotocol()==1 ? -1 : DecodeHeader(2, body, end-body, inner);
+            if(n <= 0 || inner.type==recv_msg_t::header_t::batch || inner.type==recv_msg_t::header_t::hello ||
+                inner.body_len > Protocol::BodyMaxLength || inner.body_len > static_cast<std::size_t>(end-body-n))
+            {
+                std::cerr << "usr=" << usr->getname() << " bad batch" << std::endl;
+                Metrics::add(Metrics::bad_frames);
+                CloseSession(usr);
+                return;
+            }
+            body += n;
+            Dispatch(usr, inner, body);
+            body += inner.body_len;
+            if(!usr->is_open())return;
         }
+    }
 
-        recv_msg_t::header_t header;
-        header.type = Tools::from_network<decltype(header.type)>(header_buf->begin());
-        header.body_len = Tools::from_network<decltype(header.body_len)>(header_buf->begin()+sizeof(header.type));
-        std::shared_ptr<recv_body_buf_t> body_buf_ptr;
+    void ReceiveHeaderHandler(UserPtr usr, const recv_msg_t::header_t& header, const char* body)
+    {
         switch (header.type)
         {
             case recv_msg_t::header_t::rename:
             case recv_msg_t::header_t::find:
             case recv_msg_t::header_t::text:
             case recv_msg_t::header_t::enter:
+            case recv_msg_t::header_t::list:
+            case recv_msg_t::header_t::history:
+            case recv_msg_t::header_t::hello:
+            case recv_msg_t::header_t::ping:
+            case recv_msg_t::header_t::resume:
+                ReceiveBodyHandler(usr, header, body);
+                break;
+
+            // it was heard, which is all a pong is for
+            case recv_msg_t::header_t::pong:
+                break;
+
+            case recv_msg_t::header_t::batch:
+                ReceiveBatch(usr, header, body);
                 break;
 
             case recv_msg_t::header_t::rooms:
-            {
-                std::string send_string;
-                for(auto& pr:rooms)
-                {
-                    std::string append_str;
-                    auto &r = *pr.second;
-                    append_str = "Room" + boost::lexical_cast<std::string>(pr.first) + ":\n\tUsers:";
-                    int res = Protocol::MaxUsersPerRoom;
-                    for(auto u:r)
-                    {
-                        append_str += " " + u->getname();
-                        if(--res==0)break;
-                    }
-                    if(r.size()>Protocol::MaxUsersShowPerLine)append_str += " ...";
-                    if(append_str.size() + send_string.size() >= Protocol::BodyMaxLength)break;
-                    send_string += append_str;
-                }
-                SendPrint(usr,send_string);
+                Gather(usr, {query_rooms, 0, Protocol::MaxPageSize, "", false});
                 break;
-            }
-            
+
             case recv_msg_t::header_t::users:
-            {
-                std::string send_string;
-                for(auto& pr:users)
-                {
-                    std::string append_str;
-                    auto &u = *pr.second;
-                    append_str = "User " + u.getname();
-                    if(u.getroom()!=Protocol::null_room_id)
-                        append_str += "(in room " + lexical_cast<std::string>(u.getroom()) + ")";
-                    append_str += '\n';
-                    if(append_str.size() + send_string.size() >= Protocol::BodyMaxLength)break;
-                    send_string += append_str;
-                }
-                SendPrint(usr,send_string);
+                Gather(usr, {query_users, 0, Protocol::MaxPageSize, "", false});
                 break;
-            }
-            
+
             case recv_msg_t::header_t::leave:
-                if(usr->getroom()!=Protocol::null_room_id)
-                {
-                    rooms[usr->getroom()]->leave(usr);
-                    usr->setroom(Protocol::null_room_id);
-                    InformRoom(usr);
-                }
+                if(usr->getroom()!=Protocol::null_room_id)MoveToRoom(usr, nullptr);
                 break;
             
             case recv_msg_t::header_t::newroom:
             {
-                auto new_room = std::make_shared<Room>();
-                rooms[new_room->getid()] = new_room;
-                new_room->enter(usr);
-                usr->setroom(new_room->getid());
-                InformRoom(usr);
+                auto new_room = std::make_shared<Room>(NewRoomId(), options.history_size, options.spread_at);
+                rooms.insert(new_room->getid(), new_room);
+                MoveToRoom(usr, new_room);
                 break;
             }
             
             case recv_msg_t::header_t::randroom:
             {
-                if(rooms.size()==0)break;
-                Protocol::id_t roomid = (rand()%rooms.size())+1;
-                rooms[roomid]->enter(usr);
-                usr->setroom(roomid);
-                InformRoom(usr);
+                RoomPtr room = options.randroom_free ?
+                    rooms.pick(Tools::Rng(), [](const RoomPtr& r){
+                        return 1 - std::min(1.0, static_cast<double>(r->size())/Protocol::MaxUsersPerRoom);
+                    }) :
+                    rooms.pick(Tools::Rng());
+                if(room)EnterRoom(usr, room->getid());
                 break;
             }
             
             default:
                 std::cerr << "usr=" << usr->getname() << " undefined header.type=" << header.type << std::endl;
-                usr->getsock().close();
+                Metrics::add(Metrics::bad_frames);
+                CloseSession(usr);
         }
-        if(header.body_len > 0)RegisterReadBody(usr,header);
-        else RegisterReadHeader(usr);
     }
 
-    void ReceiveBodyHandler(UserPtr usr, std::shared_ptr<recv_body_buf_t> buf, recv_msg_t::header_t header, const boost::system::error_code& eno, std::size_t recv_len)
+    void ReceiveBodyHandler(UserPtr usr, const recv_msg_t::header_t& header, const char* body)
     {
-        if(eno)
-        {
-            std::cerr << "usr= " << usr->getname() << " errno: " << eno << std::endl;
-            usr->getsock().close();
-        }
+        // string bodies come with '\0', but never trust that
+        std::string_view body_view(body, strnlen(body, header.body_len));
+        auto body_string = [&]{return std::string(body_view);};
 
-        if(header.body_len != recv_len)
-        {
-            std::cerr << "usr= " << usr->getname() << " header.body_len != recv_len!" << std::endl;
-            usr->getsock().close();
-        }
-        
         if(header.type == recv_msg_t::header_t::rename)
         {
-            usr->setname((*buf).begin());
+            usr->setname(body_view);
+            names.update(usr->getid(), usr->getname());
+            RefreshUserLine(*usr);
+            if(auto room = rooms.find(usr->getroom()))
+            {
+                room->touch();
+                RefreshRoomLine(*room);
+            }
         }
         else if(header.type == recv_msg_t::header_t::find)
         {
-            std::string name((*buf).begin());
-            std::string send_string;
-            for(auto u:users)
+            Gather(usr, {query_find, 0, MaxFindResults, body_string(), false});
+        }
+        else if(header.type == recv_msg_t::header_t::text)
+        {
+            if(auto room = rooms.find(usr->getroom()))
             {
-                if(u.second->match(name))
+                auto frame = usr->withname([&](std::string_view name){return EncodePrint({name, " say: ", body_view});});
+                if(Owns(room->getid()))
                 {
-                    std::string add = "User " + u.second->getname();
-                    if(u.second->getroom()!=Protocol::null_room_id)
-                        add += "(in room" + lexical_cast<std::string>(u.second->getroom()) + ")";
-                    add += "\n";
-                    if(send_string.size()+add.size() >= Protocol::BodyMaxLength)break;
-                    else send_string += add;
+                    Broadcast(*room, frame);
+                    if(chat_log)chat_log->append(room->getid(), std::move(frame));
                 }
+                // the owner puts it in order with the rest of the room's chat and sends it back
+                else if(!cluster->send(cluster->owner(room->getid()), {Peer::Encode(Peer::say, {room->getid()}, frame->size()), frame}))
+                    SendPrint(usr, "Room " + lexical_cast<std::string>(room->getid()) + " cannot be reached");
             }
-            SendPrint(usr,send_string);
         }
-        else if(header.type == recv_msg_t::header_t::text)
+        else if(header.type == recv_msg_t::header_t::enter)
+        {
+            Messages::Enter msg;
+            if(!Codec::decode(usr->getprotocol(), body, header.body_len, msg))return;
+            EnterRoom(usr, msg.room);
+        }
+        else if(header.type == recv_msg_t::header_t::list)
+        {
+            Messages::List msg;
+            if(!Codec::decode(usr->getprotocol(), body, header.body_len, msg))return;
+            std::uint32_t page_size = std::max<std::uint32_t>(1, std::min<std::uint32_t>(msg.page_size, Protocol::MaxPageSize));
+            Gather(usr, {msg.kind==Protocol::Message::list_users ? query_users : query_rooms, msg.cursor, page_size, "", true});
+        }
+        else if(header.type == recv_msg_t::header_t::history)
+        {
+            Messages::History msg;
+            if(!Codec::decode(usr->getprotocol(), body, header.body_len, msg))return;
+            SendHistory(usr, msg.room, msg.from, msg.count);
+        }
+        else if(header.type == recv_msg_t::header_t::hello)
         {
-            auto room = *(rooms[usr->getroom()]);
-            for(auto u:room)
+            // v1 until the answer, which goes out as the last v1 message
+            Messages::Hello msg;
+            if(usr->getprotocol() != 1 || !Codec::decode(body, header.body_len, msg))return;
+            Messages::HelloReply reply;
+            reply.version = std::max<std::uint32_t>(1, std::min(msg.version, Protocol::Version));
+            std::uint32_t caps = Protocol::cap_batch | Protocol::cap_ping
+                | (options.resume_window.count() ? static_cast<std::uint32_t>(Protocol::cap_resume) : static_cast<std::uint32_t>(0));
+            reply.caps = reply.version < 2 ? 0 : msg.caps & caps;
+            usr->getliveness().pings = reply.caps & Protocol::cap_ping;
+            Metrics::frame_out(send_msg_t::header_t::hello);
+            Queued(usr, usr->switch_protocol(reply.version, reply.caps & Protocol::cap_batch, EncodeFixed(reply)));
+            if(reply.caps & Protocol::cap_resume)
             {
-                SendPrint(u,usr->getname()+" say: ");
-                SendPrint(u,buf->begin());
+                std::uint64_t token = NewToken();
+                usr->setresume(token);
+                RegisterSend(usr, EncodeFixed(Messages::Session{usr->getid(),
+                    static_cast<std::uint32_t>(token >> 32), static_cast<std::uint32_t>(token)}));
             }
         }
-        else if(header.type == recv_msg_t::header_t::enter)
+        else if(header.type == recv_msg_t::header_t::resume)
         {
-            Protocol::id_t roomid = asio::detail::socket_ops::network_to_host_long( *reinterpret_cast<std::uint32_t*>( (*buf).begin() ) );
-            usr->setroom(roomid);
-            rooms[roomid]->enter(usr);
-            InformRoom(usr);
+            Messages::Resume msg;
+            if(!Codec::decode(usr->getprotocol(), body, header.body_len, msg))return;
+            ResumeSession(usr, msg);
+        }
+        else if(header.type == recv_msg_t::header_t::ping)
+        {
+            Messages::Ping msg;
+            if(!usr->getliveness().pings || !Codec::decode(usr->getprotocol(), body, header.body_len, msg))return;
+            RegisterSend(usr, EncodeFixed(Messages::ServerPong{msg.token}));
         }
         else
         {
             std::cerr << "usr=" << usr->getname() << " undefined header.type=" << header.type << std::endl;
-            usr->getsock().close();
+            Metrics::add(Metrics::bad_frames);
+            CloseSession(usr);
         }
+    }
 
-        RegisterReadHeader(usr);
+    void WriteHandler(UserPtr usr, const boost::system::error_code& eno, std::size_t trans_len)
+    {
+        if(eno == asio::error::operation_aborted && draining)
+        {
+            usr->abort_send(trans_len);
+            return;
+        }
+        if(eno)
+        {
+            std::cerr << "usr= " << usr->getname() << " send errno: " << eno << std::endl;
+            Metrics::add(Metrics::write_errors);
+            DetachSession(usr);
+        }
+        else
+        {
+            Metrics::add(Metrics::writes);
+            Metrics::add(Metrics::bytes_out, trans_len);
+        }
+        if(usr->finish_send())FlushSend(usr);
     }
 
-    void WriteHandler(const boost::system::error_code& eno, std::size_t trans_len)
+    FramePtr EncodePrint(std::initializer_list<std::string_view> parts)
     {
+        return MakeFrame(send_msg_t::header_t::print, parts);
     }
 
-    void SendPrint(UserPtr usr, const std::string &str)
+    // a message of messages.hpp without anything after its numbers, in v1 like every frame
+    template <typename M>
+    FramePtr EncodeFixed(const M& msg)
     {
-        std::shared_ptr<send_buf_t> send_buf = std::make_shared<send_buf_t>();
-        send_msg_t::header_t header;
+        std::array<char,Codec::fixed_size<M>()> out;
+        Codec::encode(msg, out.data());
+        return MakeFrame(M::type, out.data(), out.size());
+    }
+
+    FramePtr EncodeResumed(Protocol::id_t id, Protocol::id_t roomid, std::string_view name)
+    {
+        std::string body(Codec::fixed_size<Messages::Resumed>(), '\0');
+        Codec::encode(Messages::Resumed{id, roomid}, &body[0]);
+        body += name;
+        body.push_back('\0');
+        return MakeFrame(send_msg_t::header_t::resumed, body.data(), body.size());
+    }
+
+    // a resume token, never 0; not from the shared generators, whose output is easily predicted
+    static std::uint64_t NewToken()
+    {
+        thread_local std::random_device device;
+        std::uint64_t token;
+        do token = static_cast<std::uint64_t>(device()) << 32 | device(); while(token == 0);
+        return token;
+    }
+
+    bool Live(){return options.idle_timeout.count() || options.ping_interval.count();}
+
+    static std::uint64_t Ticks(std::chrono::milliseconds d)
+    {
+        return (d.count()+LivenessTick.count()-1)/LivenessTick.count();
+    }
+
+    // a session starts, or goes on after a handoff: it counts as heard now
+    void StartLiveness(UserPtr usr)
+    {
+        if(!Live())return;
+        auto& wheel = shard_states.at(&usr->getshard())->wheel;
+        auto& live = usr->getliveness();
+        live.heard = live.pinged = wheel.now();
+        wheel.schedule(live.entry, LivenessTick);
+    }
 
-        // header
-        header.type = send_msg_t::header_t::print;
-        header.body_len = str.size()+1; // with '\0'
-        Tools::to_network(header.type,send_buf->begin());
-        Tools::to_network(header.body_len,send_buf->begin()+sizeof(header.type));
+    // On the session's shard, when its wheel entry is due: a session silent for idle_timeout is closed,
+    // one that takes pings is pinged once it has been silent for ping_interval, and again every
+    // ping_interval without an answer. The entry is then set for whichever of them comes first.
+    void LivenessHandler(UserPtr usr)
+    {
+        bool detached = usr->is_detached();
+        if(!detached && !usr->is_open())return;
+        auto& wheel = shard_states.at(&usr->getshard())->wheel;
+        auto& live = usr->getliveness();
+        // a handoff may still fail, and nothing is sent meanwhile
+        if(draining)
+        {
+            wheel.schedule(live.entry, std::chrono::seconds(1));
+            return;
+        }
+        // nobody came back for it within the resume window
+        if(detached)
+        {
+            CloseSession(usr);
+            return;
+        }
+        std::uint64_t now = wheel.now(), next = ~std::uint64_t(0);
+        if(options.idle_timeout.count())
+        {
+            next = live.heard + Ticks(options.idle_timeout);
+            if(now >= next)
+            {
+                Metrics::add(Metrics::sessions_reaped);
+                DetachSession(usr);
+                return;
+            }
+        }
+        if(options.ping_interval.count() && live.pings)
+        {
+            std::uint64_t due = std::max(live.heard, live.pinged) + Ticks(options.ping_interval);
+            if(now >= due)
+            {
+                Metrics::add(Metrics::pings);
+                RegisterSend(usr, EncodeFixed(Messages::ServerPing{static_cast<std::uint32_t>(now)}));
+                live.pinged = now;
+                due = now + Ticks(options.ping_interval);
+            }
+            next = std::min(next, due);
+        }
+        if(next != ~std::uint64_t(0))wheel.schedule(live.entry, (next-now)*LivenessTick);
+    }
 
-        // body
-        for(int i=0;i<str.size();i++)
-            send_buf->at(sizeof(header.type)+sizeof(header.body_len)+i) = str[i];
-        send_buf->at(sizeof(header.type)+sizeof(header.body_len)+str.size()) = '\0';
+    void SendPrint(UserPtr usr, const std::string &str)
+    {
+        RegisterSend(usr, EncodePrint({str}));
+    }
 
-        RegisterSend(usr, *send_buf, sizeof(header.type)+sizeof(header.body_len)+header.body_len );
+    // The frame is encoded once by the caller, every member gets the same one, and so does
+    // every node with members, behind a header of its own. The v2 form is made once per delivering shard.
+    // Only chat is broadcast: it goes into the room history, and members that do not keep up may lose it.
+    void Broadcast(Room &room, const FramePtr &frame)
+    {
+        FramePtr relay_header, v2;
+        room.post(frame, [this, frame, v2](const UserPtr &u) mutable
+        {
+            if(u->getprotocol() == 1)RegisterSend(u, frame, true);
+            else
+            {
+                if(!v2)v2 = ToV2(*frame);
+                RegisterSend(u, v2, true);
+            }
+        }, [&](Peer::node_t node)
+        {
+            if(!relay_header)relay_header = Peer::Encode(Peer::chat, {room.getid()}, frame->size());
+            cluster->send(node, {relay_header, frame});
+        });
     }
 
     void SendNoBody(UserPtr usr, send_msg_t::header_t::type_t type)
     {
-        send_msg_t::header_t header;
-        auto send_buf = std::make_shared<std::array<char,send_header_length>>();
-        
-        header.type = type;
-        header.body_len = 0;
-        Tools::to_network(header.type,send_buf->begin());
-        Tools::to_network(header.body_len,send_buf->begin()+sizeof(header.type));
+        RegisterSend(usr, MakeFrame(type, nullptr, 0));
+    }
 
-        RegisterSend(usr, *send_buf, sizeof(header.type)+sizeof(header.body_len) );
+    // The logged messages straight from the log mappings, then where they stop.
+    void SendHistory(UserPtr usr, Protocol::id_t roomid, ChatLog::seq_t from, std::size_t count)
+    {
+        if(!chat_log)
+        {
+            SendPrint(usr, "History is not kept");
+            return;
+        }
+        if(!Owns(roomid))
+        {
+            SendPrint(usr, "The history of room " + lexical_cast<std::string>(roomid) + " is kept by node " + lexical_cast<std::string>(cluster->owner(roomid)));
+            return;
+        }
+        count = std::max<std::size_t>(1, std::min<std::size_t>(count, Protocol::MaxPageSize));
+        auto slice = chat_log->read(roomid, from, count);
+        RegisterSend(usr, slice.frames.begin(), slice.frames.end(), false);
+        if(slice.count == 0)
+            SendPrint(usr, "No history of room " + lexical_cast<std::string>(roomid) + " from " + lexical_cast<std::string>(from));
+        else
+            SendPrint(usr, "Room" + lexical_cast<std::string>(roomid) + " messages " + lexical_cast<std::string>(slice.first)
+                + "-" + lexical_cast<std::string>(slice.first+slice.count-1) + " of " + lexical_cast<std::string>(slice.end-1));
     }
 
-    void InformRoom(UserPtr usr)
+    // Rooms that have a chat log are back, with their history warm from it
+    // (unless a handoff already brought it).
+    void RestoreRooms()
     {
-        std::shared_ptr<send_buf_t> send_buf = std::make_shared<send_buf_t>();
-        send_msg_t::header_t header;
+        for(auto id:chat_log->room_ids())
+        {
+            if(!Owns(id))continue;
+            auto room = rooms.find(id);
+            if(!room)
+            {
+                room = std::make_shared<Room>(id, options.history_size, options.spread_at);
+                rooms.insert(id, room);
+            }
+            if(room->recent(1).empty())
+                for(auto& frame:chat_log->read(id, 0, options.history_size, true).frames)
+                    room->post(frame, [](const UserPtr&){});
+            RefreshRoomLine(*room);
+        }
+    }
+
+    // waits for a new process on the handoff socket, shards[0] runs it
+    void ListenHandoff()
+    {
+        if(options.handoff_path.empty())return;
+        if(!handoff_acceptor.is_open())
+        {
+            ::unlink(options.handoff_path.c_str());
+            asio::local::stream_protocol::endpoint ep(options.handoff_path);
+            handoff_acceptor.open(ep.protocol());
+            handoff_acceptor.bind(ep);
+            handoff_acceptor.listen();
+        }
+        handoff_acceptor.async_accept([=](const boost::system::error_code& eno, asio::local::stream_protocol::socket peer)
+        {
+            if(eno == asio::error::operation_aborted)return;
+            if(eno)
+            {
+                ListenHandoff();
+                return;
+            }
+            std::lock_guard<std::mutex> lock(handoff_mtx);
+            if(closing)return;
+            // a failed handoff before this one has already resumed serving
+            if(handoff_thread.joinable())handoff_thread.join();
+            int fd = peer.release();
+            handoff_thread = std::thread([=]{this->HandOff(fd);});
+        });
+    }
+
+    // Runs on its own thread: stops all io and sends the state and the sockets to the new process
+    // on peer, then lets main return through stop_event. If the new process does not take it all,
+    // serving goes on.
+    void HandOff(int peer)
+    {
+        std::cerr << "handing off to a new process" << std::endl;
+        draining = true;
+        if(cluster)cluster->stop();
+        Quiesce();
+        for(auto& shard:shards)shard->stop();
+        if(chat_log)chat_log->stop();
+
+        std::vector<int> fds;
+        std::string snapshot = Snapshot(fds);
+        bool sent = Handoff::send_state(peer, snapshot, fds);
+        ::close(peer);
+        if(sent)
+        {
+            std::cerr << "handed off " << fds.size()-listeners.size() << " sessions" << std::endl;
+            // the sockets are the new process's now: tearing this server down must not close them
+            boost::system::error_code ignored;
+            for(auto& l:listeners)l->acceptor.release(ignored);
+            for(auto& pr:users.snapshot())pr.second->release_socket();
+            handed_off = true;
+            ::eventfd_write(stop_event, 1);
+            return;
+        }
+
+        std::cerr << "handoff failed, serving on" << std::endl;
+        draining = false;
+        if(chat_log)chat_log.reset(new ChatLog(options.chat_log));
+        Launch();
+    }
+
+    // Cancels the io of every session and waits until the cancelled handlers have run, so that
+    // what was read and what is left to write is all in the sessions.
+    void Quiesce()
+    {
+        for(auto& l:listeners)
+            asio::post(l->shard.context(), [l = l.get()]
+            {
+                boost::system::error_code ignored;
+                l->acceptor.cancel(ignored);
+                if(Uring* ring = l->shard.ring())ring->cancel(l->acceptor.native_handle());
+                l->pause.cancel();
+            });
+        asio::post(shards[0]->context(), [this]
+        {
+            boost::system::error_code ignored;
+            handoff_acceptor.cancel(ignored);
+            stats_timer.cancel();
+        });
+        std::map<IoShard*,std::vector<UserPtr>> by_shard;
+        for(auto& pr:users.snapshot())by_shard[&pr.second->getshard()].push_back(pr.second);
+
+        // The barrier is posted by the handler doing the cancels, so that it runs after their
+        // completions. A second round catches what the first one's handlers queued on other shards.
+        for(int round=0;round<2;round++)
+        {
+            std::vector<std::future<void>> done;
+            for(auto& shard:shards)
+            {
+                auto barrier = std::make_shared<std::promise<void>>();
+                done.push_back(barrier->get_future());
+                IoShard* s = shard.get();
+                auto& list = by_shard[s];
+                auto tick = &shard_states.at(s)->tick;
+                asio::post(s->context(), [s, &list, tick, barrier, round]
+                {
+                    if(round == 0)
+                    {
+                        tick->cancel();
+                        for(auto& u:list)u->cancel_io();
+                        // the completions of a ring only reach the io_context through its eventfd: wait for them here
+                        if(Uring* ring = s->ring())ring->settle();
+                    }
+                    asio::post(s->context(), [barrier]{barrier->set_value();});
+                });
+            }
+            for(auto& f:done)f.wait();
+        }
+    }
+
+    // Users, names, rooms and their history, and what is left in the sessions' buffers.
+    // fds gets the listening sockets, then the socket of every user in the order of the snapshot.
+    std::string Snapshot(std::vector<int>& fds)
+    {
+        Tools::Writer w;
+        w.u32(Handoff::Magic);
+        w.u32(Handoff::Version);
+        w.u32(User::last_id());
+        w.u32(Room::last_id());
+        for(auto& l:listeners)fds.push_back(l->acceptor.native_handle());
+
+        auto room_list = rooms.snapshot();
+        w.u32(room_list.size());
+        for(auto& pr:room_list)
+        {
+            w.u32(pr.first);
+            auto frames = pr.second->recent(options.history_size);
+            w.u32(frames.size());
+            for(auto& f:frames)w.bytes(std::string_view(f->data(), f->size()));
+        }
+
+        // a session waiting for a resume has no connection to hand over
+        auto user_list = users.snapshot();
+        user_list.erase(std::remove_if(user_list.begin(), user_list.end(), [](const auto& pr){return pr.second->is_detached();}), user_list.end());
+        w.u32(user_list.size());
+        for(auto& pr:user_list)
+        {
+            User& u = *pr.second;
+            std::string inbox(u.getinbox().size(), '\0');
+            u.getinbox().copy(&inbox[0], 0, inbox.size());
+            w.u32(pr.first);
+            w.u32(u.getroom());
+            w.bytes(u.getname());
+            w.bytes(inbox);
+            w.bytes(u.pending_output());
+            w.u32(u.getprotocol());
+            w.u32((u.getbatches() ? static_cast<std::uint32_t>(Protocol::cap_batch) : static_cast<std::uint32_t>(0))
+                | (u.getliveness().pings ? static_cast<std::uint32_t>(Protocol::cap_ping) : static_cast<std::uint32_t>(0)));
+            w.u64(u.getresume());
+            fds.push_back(u.native_handle());
+        }
+        return w.str();
+    }
+
+    // Takes the state and the sockets of the server listening on takeover_path.
+    // Nothing is changed unless the snapshot is complete, in which case the old server is told to exit.
+    bool TakeOver()
+    {
+        int peer = Handoff::connect_to(options.takeover_path);
+        if(peer < 0)
+        {
+            std::cerr << "cannot connect to " << options.takeover_path << std::endl;
+            return false;
+        }
+        std::string snapshot;
+        std::vector<int> fds;
+        bool received = Handoff::receive_state(peer, snapshot, fds);
+
+        struct RoomState {Protocol::id_t id; std::vector<std::string_view> history;};
+        struct UserState {Protocol::id_t id, roomid; std::string_view name, inbox, output; std::uint32_t protocol, caps; std::uint64_t token;};
+        std::vector<RoomState> room_states;
+        std::vector<UserState> user_states;
+        Tools::Reader r(snapshot);
+        bool valid = received && r.u32()==Handoff::Magic && r.u32()==Handoff::Version;
+        Protocol::id_t last_user = r.u32(), last_room = r.u32();
+        for(std::uint32_t n=r.u32();valid && r.ok() && n>0;n--)
+        {
+            RoomState room{r.u32(), {}};
+            for(std::uint32_t k=r.u32();r.ok() && k>0;k--)room.history.push_back(r.bytes());
+            room_states.push_back(std::move(room));
+        }
+        for(std::uint32_t n=r.u32();valid && r.ok() && n>0;n--)
+        {
+            UserState u;
+            u.id = r.u32();
+            u.roomid = r.u32();
+            u.name = r.bytes();
+            u.inbox = r.bytes();
+            u.output = r.bytes();
+            u.protocol = r.u32();
+            u.caps = r.u32();
+            u.token = r.u64();
+            user_states.push_back(u);
+        }
+        // the listening sockets come first, as many as the old server had
+        valid = valid && r.ok() && fds.size() > user_states.size();
+        if(!valid || !Handoff::acknowledge(peer))
+        {
+            std::cerr << "takeover from " << options.takeover_path << " failed" << std::endl;
+            for(int fd:fds)::close(fd);
+            ::close(peer);
+            return false;
+        }
+        ::close(peer);
+
+        User::reserve_id(last_user);
+        Room::reserve_id(last_room);
+        std::size_t listening = fds.size()-user_states.size();
+        for(std::size_t i=0;i<listening;i++)
+            if(auto eno = OpenListener(*shards[i%shards.size()], fds[i]))std::cerr << "listening socket lost: " << eno.message() << std::endl;
+        // with more threads than the old server, the shards left get listeners of their own
+        for(std::size_t i=listening;i<shards.size();i++)
+            if(auto eno = OpenListener(*shards[i]))std::cerr << "cannot listen on shard " << i << ": " << eno.message() << std::endl;
+        for(auto& rs:room_states)
+        {
+            auto room = std::make_shared<Room>(rs.id, Owns(rs.id) ? options.history_size : 0, options.spread_at);
+            for(auto bytes:rs.history)
+            {
+                auto copy = std::make_shared<const std::string>(bytes);
+                room->post(MakeFrame(copy, copy->data(), copy->size()), [](const UserPtr&){});
+            }
+            rooms.insert(rs.id, room);
+        }
+        for(std::size_t i=0;i<user_states.size();i++)
+        {
+            auto& us = user_states[i];
+            auto usr = std::make_shared<User>(PickShard(), options.send_limits, us.id);
+            usr->assign(server_ep.protocol(), fds[listening+i]);
+            usr->setname(us.name);
+            if(!us.name.empty())names.update(us.id, usr->getname());
+            usr->getinbox().append(us.inbox.data(), us.inbox.size());
+            usr->switch_protocol(static_cast<std::uint8_t>(us.protocol), us.caps & Protocol::cap_batch, nullptr);
+            usr->getliveness().pings = us.caps & Protocol::cap_ping;
+            usr->setresume(us.token);
+            if(!us.output.empty())
+            {
+                // already in the session's protocol: not converted again
+                auto copy = std::make_shared<const std::string>(us.output);
+                FramePtr frame = MakeFrame(copy, copy->data(), copy->size(), static_cast<std::uint8_t>(us.protocol));
+                usr->queue_send(&frame, &frame+1, false);
+            }
+            if(auto room = rooms.find(us.roomid))
+            {
+                room->enter(usr, [](const HistoryRing&){});
+                usr->setroom(us.roomid);
+            }
+            users.insert(us.id, usr);
+            RefreshUserLine(*usr);
+        }
+        for(auto& pr:rooms.snapshot())RefreshRoomLine(*pr.second);
+        std::cerr << "took over " << user_states.size() << " sessions" << std::endl;
+        return true;
+    }
+
+    // reads, and writes of what is queued, for every session (after a takeover or a failed handoff)
+    void ResumeSessions()
+    {
+        for(auto& pr:users.snapshot())
+        {
+            UserPtr usr = pr.second;
+            if(usr->is_detached())continue;
+            asio::post(usr->getexecutor(), pooled([=]
+            {
+                this->StartLiveness(usr);
+                this->RegisterRead(usr);
+                if(usr->restart_send())this->FlushSend(usr);
+            }));
+        }
+    }
+
+    void RegisterStatsDump()
+    {
+        stats_timer.expires_after(std::chrono::seconds(std::max(1u, options.stats_interval)));
+        stats_timer.async_wait([=](const boost::system::error_code& eno){this->StatsDumpHandler(eno);});
+    }
 
-        // header
-        header.type = send_msg_t::header_t::roomchange;
-        header.body_len = sizeof(Protocol::id_t);
-        Tools::to_network(header.type,send_buf->begin());
-        Tools::to_network(header.body_len,send_buf->begin()+sizeof(header.type));
+    // appends a report to the stats file, the file is reopened every time so that it can be rotated
+    void StatsDumpHandler(const boost::system::error_code& eno)
+    {
+        if(eno == asio::error::operation_aborted)return;
+        std::ofstream out(options.stats_file, std::ios::app);
+        std::time_t now = std::time(nullptr);
+        char when[32];
+        std::strftime(when, sizeof(when), "%F %T", std::localtime(&now));
+        if(out)out << "== " << when << "\n" << StatsReport(file_stats) << std::endl;
+        else std::cerr << "cannot write stats to " << options.stats_file << std::endl;
+        RegisterStatsDump();
+    }
 
-        // body
-        Tools::to_network(usr->getroom(), send_buf->begin()+sizeof(header.type)+sizeof(header.body_len));
+    std::string StatsReport(Metrics::Reporter& reporter)
+    {
+        std::size_t sessions = 0;
+        std::vector<std::pair<std::string,std::uint64_t>> totals = {{"allocs", AllocCounter::total()}};
+        if(shards[0]->ring())totals.insert(totals.end(), {{"ring_enters", 0}, {"ring_starved", 0}});
+        for(auto& shard:shards)
+        {
+            sessions += shard->load();
+            if(Uring* ring = shard->ring())
+            {
+                totals[1].second += ring->enter_calls();
+                totals[2].second += ring->starved_receives();
+            }
+        }
+        return reporter.report({{"sessions", sessions}, {"users", users.size()}, {"rooms", rooms.size()},
+            {"outbound_bytes", User::total_outbound()}}, totals);
+    }
 
-        RegisterSend(usr, *send_buf, sizeof(header.type)+sizeof(header.body_len)+header.body_len );
+    void InformRoom(UserPtr usr)
+    {
+        std::array<char,Codec::fixed_size<Messages::RoomChange>()> body;
+        Codec::encode(Messages::RoomChange{usr->getroom()}, body.data());
+        RegisterSend(usr, MakeFrame(send_msg_t::header_t::roomchange, body.data(), body.size()));
     }
 
     public:
 
     void Launch()
     {
-        RegisterAccept();
-        threads.emplace_back( std::make_shared<std::thread>([&]{asio_service.run();}) );
+        if(cluster)cluster->start();
+        for(auto& l:listeners)RegisterAccept(*l);
+        if(!options.stats_file.empty())RegisterStatsDump();
+        ListenHandoff();
+        ResumeSessions();
+        for(std::size_t i=0;i<shards.size();i++)
+            shards[i]->start(options.pin_threads ? static_cast<int>(i % std::max(1u, std::thread::hardware_concurrency())) : -1);
     }
 
+    // readable once the server has handed off to a new process, and main has to return
+    int StopFd() const {return stop_event;}
+
+    // Stops serving. A handoff under way is waited for, whichever way it goes, and none starts after it.
     void Close()
     {
-        asio_service.stop();
-        for(auto& t:threads)t->join();
-        threads.clear();
+        {
+            std::lock_guard<std::mutex> lock(handoff_mtx);
+            closing = true;
+        }
+        if(handoff_thread.joinable())handoff_thread.join();
+        // a ring holds on to the listening socket while its accept is pending: stop listening right away
+        if(!handed_off)
+            for(auto& l:listeners)
+                if(l->shard.ring())::shutdown(l->acceptor.native_handle(), SHUT_RDWR);
+        for(auto& shard:shards)shard->stop();
+        if(chat_log)chat_log->stop();
         users.clear();
         rooms.clear();
     }
@@ -355,52 +2401,221 @@ class Server
     std::string ShowUsers(int limit = 20)
     {
         std::stringstream ss;
-        for(auto &pr: users)
+        for(auto &pr: users.snapshot())
         {
+            auto ep = pr.second->remote_endpoint();
             ss << "User" << pr.first << " " << pr.second->getname()
-                << "(" << pr.second->getsock().remote_endpoint().address().to_string() << ":" << pr.second->getsock().remote_endpoint().port() << ")"
+                << "(" << ep.address().to_string() << ":" << ep.port() << ")"
                 << std::endl;
         }
         return ss.str();
     }
 
+    std::string ShowAllocs()
+    {
+        return "operator new calls: " + lexical_cast<std::string>(AllocCounter::total()) + "\n";
+    }
+
+    // counters and histograms, with rates since the previous call
+    std::string ShowStats()
+    {
+        return StatsReport(console_stats);
+    }
+
     std::string ShowRooms()
     {
         std::stringstream ss;
-        for(auto& pr: rooms)
+        for(auto& pr: rooms.snapshot())
         {
             ss << "Room" << pr.first << ":\n";
-            for(auto u:*pr.second)
+            pr.second->for_each([&](const UserPtr& u)
             {
                 ss << u->getname() << " ";
-            }
+            });
             ss << std::endl;
         }
         return ss.str();
     }
 
-    Server() : server_ep(asio::ip::address::from_string(Protocol::server_ip),Protocol::server_port), acceptor(asio_service, server_ep)
-    {}
+    Server(const ServerOptions& opts = ServerOptions()) :
+        options(opts),
+        shards(MakeShards(opts.threads)),
+        server_ep(asio::ip::address::from_string(opts.host),opts.port),
+        full_notice(EncodePrint({"The server is full, try again later."})),
+        stats_timer(shards[0]->context()),
+        handoff_acceptor(shards[0]->context()),
+        stop_event(::eventfd(0, EFD_CLOEXEC))
+    {
+        for(auto& shard:shards)
+            shard_states[shard.get()].reset(new ShardState{
+                FlushTick<UserPtr>(shard->context(), options.flush_tick, options.flush_busy_at,
+                    [this](const UserPtr& u){this->FlushSend(u);}),
+                TimerWheel<User>(shard->context(), LivenessTick,
+                    [this](User& u){this->LivenessHandler(u.shared_from_this());})});
+        if(options.cluster.nodes.size() > 1)
+        {
+            std::vector<asio::io_context*> contexts;
+            for(auto& shard:shards)contexts.push_back(&shard->context());
+            cluster.reset(new Cluster(options.cluster, contexts, {
+                [this](Peer::node_t from, Peer::type_t type, std::string_view body){this->PeerHandler(from, type, body);},
+                [this](Peer::node_t node){this->Resync(node);},
+                [this](Peer::node_t node){this->ResetNode(node);}}));
+            // users of different nodes never share an id
+            User::reserve_id(cluster->self() << Peer::NodeIdShift);
+        }
+        if(options.io == IoBackend::uring && !OpenRings())
+            std::cerr << "io_uring is not available, using epoll" << std::endl;
+        if(options.takeover_path.empty() || !TakeOver())
+            for(auto& shard:shards)
+                if(auto eno = OpenListener(*shard))throw boost::system::system_error(eno, "listen");
+        SetAcceptRate();
+        if(!options.chat_log.dir.empty())
+        {
+            chat_log.reset(new ChatLog(options.chat_log));
+            RestoreRooms();
+        }
+    }
+
+    ~Server()
+    {
+        ::close(stop_event);
+    }
 
 };
+thread_local Server::recv_body_buf_t Server::wrapped_body;
+thread_local std::vector<FramePtr> Server::replay_frames;
+
+// host:port,host:port,...
+std::vector<asio::ip::tcp::endpoint> ParseEndpoints(const std::string& list)
+{
+    std::vector<asio::ip::tcp::endpoint> eps;
+    std::stringstream ss(list);
+    std::string item;
+    while(std::getline(ss, item, ','))
+    {
+        auto colon = item.rfind(':');
+        boost::system::error_code eno;
+        auto addr = asio::ip::make_address(item.substr(0, colon), eno);
+        if(colon == std::string::npos || eno)
+        {
+            std::cerr << "bad node address " << item << std::endl;
+            std::exit(1);
+        }
+        eps.emplace_back(addr, static_cast<unsigned short>(std::stoul(item.substr(colon+1))));
+    }
+    return eps;
+}
+
+ServerOptions ParseOptions(int argc, char* argv[])
+{
+    ServerOptions opts;
+    for(int i=1;i<argc;i++)
+    {
+        std::string arg = argv[i];
+        if(arg.compare(0,7,"--host=")==0)opts.host = arg.substr(7);
+        else if(arg.compare(0,7,"--port=")==0)opts.port = static_cast<unsigned short>(std::stoul(arg.substr(7)));
+        else if(arg.compare(0,10,"--cluster=")==0)opts.cluster.nodes = ParseEndpoints(arg.substr(10));
+        else if(arg.compare(0,7,"--node=")==0)opts.cluster.self = std::stoul(arg.substr(7));
+        else if(arg.compare(0,10,"--threads=")==0)opts.threads = std::stoul(arg.substr(10));
+        else if(arg=="--pin")opts.pin_threads = true;
+        else if(arg=="--io=epoll")opts.io = IoBackend::epoll;
+        else if(arg=="--io=uring")opts.io = IoBackend::uring;
+        else if(arg=="--randroom=uniform")opts.randroom_free = false;
+        else if(arg=="--randroom=free")opts.randroom_free = true;
+        else if(arg.compare(0,12,"--spread-at=")==0)opts.spread_at = std::max<std::size_t>(1, std::stoull(arg.substr(12)));
+        else if(arg.compare(0,15,"--ring-entries=")==0)opts.ring_entries = std::stoul(arg.substr(15));
+        else if(arg.compare(0,15,"--ring-buffers=")==0)opts.ring_buffers = std::stoul(arg.substr(15));
+        else if(arg.compare(0,12,"--max-users=")==0)opts.max_users = std::stoull(arg.substr(12));
+        else if(arg.compare(0,14,"--accept-rate=")==0)opts.accept_rate = std::stod(arg.substr(14));
+        else if(arg.compare(0,15,"--accept-burst=")==0)opts.accept_burst = std::stod(arg.substr(15));
+        else if(arg.compare(0,13,"--flush-tick=")==0)
+            opts.flush_tick = std::chrono::microseconds(static_cast<std::int64_t>(std::stod(arg.substr(13))*1000));
+        else if(arg.compare(0,13,"--flush-busy=")==0)opts.flush_busy_at = std::stoull(arg.substr(13));
+        else if(arg.compare(0,15,"--idle-timeout=")==0)
+            opts.idle_timeout = std::chrono::milliseconds(static_cast<std::int64_t>(std::stod(arg.substr(15))*1000));
+        else if(arg.compare(0,16,"--ping-interval=")==0)
+            opts.ping_interval = std::chrono::milliseconds(static_cast<std::int64_t>(std::stod(arg.substr(16))*1000));
+        else if(arg.compare(0,16,"--resume-window=")==0)
+            opts.resume_window = std::chrono::milliseconds(static_cast<std::int64_t>(std::stod(arg.substr(16))*1000));
+        else if(arg.compare(0,17,"--resume-backlog=")==0)opts.send_limits.detached = std::stoull(arg.substr(17));
+        else if(arg.compare(0,14,"--send-budget=")==0)opts.send_limits.budget = std::stoull(arg.substr(14));
+        else if(arg.compare(0,15,"--send-ceiling=")==0)opts.send_limits.ceiling = std::stoull(arg.substr(15));
+        else if(arg=="--overflow=drop")opts.send_limits.policy = OverflowPolicy::drop_oldest;
+        else if(arg=="--overflow=collapse")opts.send_limits.policy = OverflowPolicy::collapse;
+        else if(arg=="--overflow=disconnect")opts.send_limits.policy = OverflowPolicy::disconnect;
+        else if(arg.compare(0,10,"--history=")==0)opts.history_size = std::stoul(arg.substr(10));
+        else if(arg.compare(0,9,"--replay=")==0)opts.replay_size = std::stoul(arg.substr(9));
+        else if(arg.compare(0,10,"--log-dir=")==0)opts.chat_log.dir = arg.substr(10);
+        else if(arg.compare(0,19,"--log-segment-size=")==0)opts.chat_log.segment_size = std::stoull(arg.substr(19));
+        else if(arg.compare(0,17,"--log-sync-bytes=")==0)opts.chat_log.sync_bytes = std::stoull(arg.substr(17));
+        else if(arg.compare(0,14,"--log-sync-ms=")==0)opts.chat_log.sync_interval = std::chrono::milliseconds(std::stoul(arg.substr(14)));
+        else if(arg.compare(0,10,"--handoff=")==0)opts.handoff_path = arg.substr(10);
+        else if(arg.compare(0,11,"--takeover=")==0)opts.takeover_path = arg.substr(11);
+        else if(arg.compare(0,13,"--stats-file=")==0)opts.stats_file = arg.substr(13);
+        else if(arg.compare(0,17,"--stats-interval=")==0)opts.stats_interval = std::stoul(arg.substr(17));
+        else std::cerr << "unknown option " << arg << std::endl;
+    }
+    if(!opts.cluster.nodes.empty() && (opts.cluster.self >= opts.cluster.nodes.size() || opts.cluster.nodes.size() > Peer::MaxNodes))
+    {
+        std::cerr << "--node must be one of the " << opts.cluster.nodes.size() << " nodes of --cluster, which has at most "
+            << Peer::MaxNodes << std::endl;
+        std::exit(1);
+    }
+    return opts;
+}
 
-int main()
+// The next line typed on the console, like std::getline. False at the end of the input, or once
+// stop_fd is readable. stdin is read directly so that waiting for it can also wait for stop_fd.
+bool ReadCommand(int stop_fd, std::string& line)
 {
-    Server server;
+    static std::string pending;
+    while(true)
+    {
+        auto eol = pending.find('\n');
+        if(eol != std::string::npos)
+        {
+            line.assign(pending, 0, eol);
+            pending.erase(0, eol+1);
+            return true;
+        }
+        pollfd fds[2] = {{STDIN_FILENO, POLLIN, 0}, {stop_fd, POLLIN, 0}};
+        if(::poll(fds, 2, -1) < 0)
+        {
+            if(errno == EINTR)continue;
+            return false;
+        }
+        if(fds[1].revents)return false;
+        char buf[1024];
+        ssize_t n = ::read(STDIN_FILENO, buf, sizeof(buf));
+        if(n < 0 && errno == EINTR)continue;
+        if(n <= 0)
+        {
+            // the last line may have no end of line
+            if(pending.empty())return false;
+            line.swap(pending);
+            pending.clear();
+            return true;
+        }
+        pending.append(buf, n);
+    }
+}
+
+int main(int argc, char* argv[])
+{
+    Server server(ParseOptions(argc,argv));
     server.Launch();
     std::string usage = "usage:\n"
     "\tquit: close the serve and quit\n"
     "\trooms: show all rooms\n"
-    "\tusers: show all users\n";
+    "\tusers: show all users\n"
+    "\tallocs: show how many heap allocations were made so far\n"
+    "\tstats: show counters, rates and latency histograms\n";
     std::cout << usage << ">> " << std::flush;
     std::string s;
-    while(std::getline(std::cin,s))
+    // a handoff to a new process ends the loop as quit does
+    while(ReadCommand(server.StopFd(), s))
     {
-        if(s=="quit")
-        {
-            server.Close();
-            break;
-        }
+        if(s=="quit")break;
         else if(s=="rooms")
         {
             std::cout << server.ShowRooms() << std::flush;
@@ -409,10 +2624,19 @@ int main()
         {
             std::cout << server.ShowUsers() << std::flush;
         }
+        else if(s=="allocs")
+        {
+            std::cout << server.ShowAllocs() << std::flush;
+        }
+        else if(s=="stats")
+        {
+            std::cout << server.ShowStats() << std::flush;
+        }
         else
         {
             std::cout << usage << std::flush;
         }
         std::cout << ">> " << std::flush;
     }
+    server.Close();
 }
\ No newline at end of file
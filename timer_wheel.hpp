@@ -0,0 +1,192 @@
+#ifndef TIMER_WHEEL_HPP
+#define TIMER_WHEEL_HPP
+
+#include <boost/asio.hpp>
+#include <array>
+#include <chrono>
+#include <cstdint>
+#include <functional>
+
+using namespace boost;
+
+// A hierarchical timing wheel driven by one steady_timer of an io_context, for deadlines that are
+// many and often pushed back, like one per session. Levels of 64 slots cover 64, 64^2, ... ticks
+// ahead; a slot of a higher level is spread over the level below once its time comes.
+// Scheduling, rescheduling and cancelling are O(1) and allocate nothing: the entry is embedded
+// in its owner. A deadline farther than the wheel reaches (64^4 ticks) is looked at again every
+// revolution of the top level.
+// Only used on the thread of its io_context.
+template <typename T>
+class TimerWheel
+{
+    public:
+    class Entry
+    {
+        friend class TimerWheel;
+        Entry *prev = nullptr, *next = nullptr;
+        TimerWheel* wheel = nullptr;
+        T* owner;
+        std::uint64_t due = 0;
+
+        void link_before(Entry& head)
+        {
+            prev = head.prev;
+            next = &head;
+            head.prev->next = this;
+            head.prev = this;
+        }
+
+        void unlink()
+        {
+            prev->next = next;
+            next->prev = prev;
+            prev = next = nullptr;
+        }
+
+        // an empty list
+        void make_head(){prev = next = this;}
+
+        public:
+        bool scheduled() const {return wheel != nullptr;}
+
+        explicit Entry(T* owner = nullptr):owner(owner)
+        {}
+        Entry(const Entry&) = delete;
+        Entry& operator=(const Entry&) = delete;
+        ~Entry(){if(wheel)wheel->cancel(*this);}
+    };
+
+    private:
+    using clock = std::chrono::steady_clock;
+    static const unsigned Bits = 6, Size = 1u << Bits, Levels = 4;
+
+    asio::steady_timer timer;
+    clock::duration tick;
+    clock::time_point origin;   // when tick 0 began
+    std::uint64_t current = 0;  // the last tick that went by
+    std::size_t count = 0;
+    bool armed = false;
+    std::array<std::array<Entry,Size>,Levels> slots;
+    std::function<void(T&)> expire;
+
+    std::uint64_t elapsed() const {return (clock::now()-origin)/tick;}
+
+    // the highest level whose slot differs from the current one's
+    void link(Entry& e)
+    {
+        std::uint64_t diff = e.due ^ current;
+        unsigned level = diff ? (63-__builtin_clzll(diff))/Bits : 0;
+        std::size_t slot;
+        if(level < Levels)slot = (e.due >> (Bits*level)) & (Size-1);
+        else
+        {
+            // the slot the top level reaches last
+            level = Levels-1;
+            slot = ((current >> (Bits*level))-1) & (Size-1);
+        }
+        e.link_before(slots[level][slot]);
+    }
+
+    // moves the entries of a slot to head
+    void take(Entry& slot, Entry& head)
+    {
+        head.make_head();
+        if(slot.next == &slot)return;
+        head.next = slot.next;
+        head.prev = slot.prev;
+        head.next->prev = &head;
+        head.prev->next = &head;
+        slot.make_head();
+    }
+
+    void advance()
+    {
+        current++;
+        for(unsigned level=Levels-1;level>0;level--)
+        {
+            if(current & ((std::uint64_t(1) << (Bits*level))-1))continue;
+            Entry moved;
+            take(slots[level][(current >> (Bits*level)) & (Size-1)], moved);
+            while(moved.next != &moved)
+            {
+                Entry* e = moved.next;
+                e->unlink();
+                link(*e);
+            }
+        }
+        Entry due;
+        take(slots[0][current & (Size-1)], due);
+        while(due.next != &due)
+        {
+            Entry* e = due.next;
+            e->unlink();
+            e->wheel = nullptr;
+            count--;
+            expire(*e->owner);
+        }
+    }
+
+    void arm()
+    {
+        if(armed || count == 0)return;
+        armed = true;
+        timer.expires_at(origin + (current+1)*tick);
+        timer.async_wait([this](const boost::system::error_code& eno)
+        {
+            armed = false;
+            if(eno)return;
+            for(std::uint64_t now = elapsed();current < now;)advance();
+            arm();
+        });
+    }
+
+    public:
+    // ticks since the wheel was made
+    std::uint64_t now() const {return current;}
+
+    // expire(owner) is called once after, rounded up to whole ticks, unless rescheduled or cancelled first
+    void schedule(Entry& e, clock::duration after)
+    {
+        if(e.wheel)cancel(e);
+        // an empty wheel has nothing to catch up on
+        if(count == 0)current = std::max(current, elapsed());
+        std::uint64_t ticks = (after+tick-clock::duration(1))/tick;
+        e.due = current + std::max<std::uint64_t>(1, ticks);
+        e.wheel = this;
+        link(e);
+        count++;
+        arm();
+    }
+
+    void cancel(Entry& e)
+    {
+        if(!e.wheel)return;
+        e.unlink();
+        e.wheel = nullptr;
+        count--;
+    }
+
+    std::size_t size() const {return count;}
+
+    TimerWheel(asio::io_context& ctx, clock::duration tick, std::function<void(T&)> f):
+        timer(ctx), tick(tick), origin(clock::now()), expire(std::move(f))
+    {
+        for(auto& level:slots)
+            for(auto& slot:level)slot.make_head();
+    }
+
+    // whatever is still scheduled is let go, so that its entry does not come back to a wheel that is gone
+    ~TimerWheel()
+    {
+        for(auto& level:slots)
+            for(auto& slot:level)
+                while(slot.next != &slot)
+                {
+                    Entry* e = slot.next;
+                    e->unlink();
+                    e->wheel = nullptr;
+                }
+    }
+};
+
+#endif // TIMER_WHEEL_HPP
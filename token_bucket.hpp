@@ -0,0 +1,46 @@
+#ifndef TOKEN_BUCKET_HPP
+#define TOKEN_BUCKET_HPP
+
+#include <algorithm>
+#include <chrono>
+
+// Lets through rate events per second on average, and bursts of up to burst of them.
+// A rate of 0 lets everything through. Not thread-safe: each bucket belongs to one shard.
+class TokenBucket
+{
+    private:
+    using clock = std::chrono::steady_clock;
+    double rate, burst, tokens;
+    clock::time_point last;
+
+    void refill()
+    {
+        auto now = clock::now();
+        tokens = std::min(burst, tokens + rate*std::chrono::duration<double>(now-last).count());
+        last = now;
+    }
+
+    public:
+    // one event happened; the tokens may go below zero, to be paid back before the next one
+    void take()
+    {
+        if(rate <= 0)return;
+        refill();
+        tokens -= 1;
+    }
+
+    // how long until the next event may happen, zero if it may right away
+    clock::duration wait()
+    {
+        if(rate <= 0)return clock::duration::zero();
+        refill();
+        if(tokens >= 1)return clock::duration::zero();
+        return std::chrono::duration_cast<clock::duration>(std::chrono::duration<double>((1-tokens)/rate));
+    }
+
+    TokenBucket(double rate = 0, double burst = 1):
+        rate(rate), burst(std::max(1.0, burst)), tokens(this->burst), last(clock::now())
+    {}
+};
+
+#endif // TOKEN_BUCKET_HPP
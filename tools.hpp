@@ -1,30 +1,157 @@
-#include <boost/asio.hpp>
+#ifndef TOOLS_HPP
+#define TOOLS_HPP
 
-using namespace boost;
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+#include <random>
+#include <string>
+#include <string_view>
+#include <thread>
+#include "codec.hpp"
 
 namespace Tools
 {
-    template <typename T>
-    void to_network(const T& x, char* begin)
+    // big-endian fields appended to a string
+    class Writer
     {
-        auto szT = sizeof(T);
-        assert(szT==1 or szT==2 or szT==4);
+        private:
+        std::string out;
 
-        T* p = reinterpret_cast<T*>(begin);
-        *p = x;
+        public:
+        void u32(std::uint32_t x)
+        {
+            char b[sizeof(x)];
+            Codec::store(b, x);
+            out.append(b, sizeof(b));
+        }
 
-        if(szT==2)*p = static_cast<T>( asio::detail::socket_ops::host_to_network_short(x) );
-        else *p = static_cast<T>( asio::detail::socket_ops::host_to_network_long(x) );
-    }
+        void u64(std::uint64_t x)
+        {
+            char b[sizeof(x)];
+            Codec::store(b, x);
+            out.append(b, sizeof(b));
+        }
+
+        void bytes(std::string_view s)
+        {
+            u32(static_cast<std::uint32_t>(s.size()));
+            raw(s);
+        }
+
+        void raw(std::string_view s)
+        {
+            out.append(s.data(), s.size());
+        }
+
+        const std::string& str() const {return out;}
+        std::string take(){return std::move(out);}
+    };
+
+    // reads what a Writer wrote; once anything is missing ok() stays false and every read gives 0
+    class Reader
+    {
+        private:
+        std::string_view in;
+        bool good = true;
+
+        public:
+        bool ok() const {return good;}
+        std::size_t size() const {return in.size();}
+
+        std::uint32_t u32()
+        {
+            if(in.size() < 4)
+            {
+                good = false;
+                return 0;
+            }
+            auto x = Codec::load<std::uint32_t>(in.data());
+            in.remove_prefix(4);
+            return x;
+        }
+
+        std::uint64_t u64()
+        {
+            if(in.size() < 8)
+            {
+                good = false;
+                return 0;
+            }
+            auto x = Codec::load<std::uint64_t>(in.data());
+            in.remove_prefix(8);
+            return x;
+        }
+
+        std::string_view bytes()
+        {
+            std::uint32_t n = u32();
+            if(in.size() < n)
+            {
+                good = false;
+                return {};
+            }
+            std::string_view s = in.substr(0, n);
+            in.remove_prefix(n);
+            return s;
+        }
 
-    template <typename T>
-    T from_network(char* begin)
+        // whatever has not been read yet
+        std::string_view rest()
+        {
+            std::string_view s = in;
+            in = {};
+            return s;
+        }
+
+        Reader(std::string_view data):in(data)
+        {}
+    };
+
+    // A string of at most N bytes kept inline, for short per-session strings such as names.
+    // A longer one is cut, at a UTF-8 character boundary.
+    template <std::size_t N>
+    class FixedString
+    {
+        static_assert(N < 256, "the length is kept in a byte");
+
+        private:
+        std::array<char,N> chars;
+        std::uint8_t len = 0;
+
+        public:
+        FixedString& operator=(std::string_view s)
+        {
+            std::size_t n = std::min(s.size(), N);
+            while(n > 0 && n < s.size() && (static_cast<unsigned char>(s[n]) & 0xc0) == 0x80)n--;
+            std::memcpy(chars.data(), s.data(), n);
+            len = static_cast<std::uint8_t>(n);
+            return *this;
+        }
+
+        std::string_view view() const {return std::string_view(chars.data(), len);}
+        std::string str() const {return std::string(chars.data(), len);}
+    };
+
+    // a byte instead of a mutex, for sections of a few instructions
+    class SpinLock
     {
-        auto szT = sizeof(T);
-        assert(szT==1 or szT==2 or szT==4);
+        private:
+        std::atomic_flag flag = ATOMIC_FLAG_INIT;
+
+        public:
+        void lock(){while(flag.test_and_set(std::memory_order_acquire))std::this_thread::yield();}
+        void unlock(){flag.clear(std::memory_order_release);}
+    };
 
-        T x = (*reinterpret_cast<T*>(begin));
-        if(szT==2)return static_cast<T>( asio::detail::socket_ops::network_to_host_short(x) );
-        else return static_cast<T>( asio::detail::socket_ops::network_to_host_long(x) );
+    // a generator of the calling thread, seeded once per thread: rand() shares one state between all of them
+    inline std::mt19937& Rng()
+    {
+        thread_local std::mt19937 rng(std::random_device{}());
+        return rng;
     }
-}
\ No newline at end of file
+}
+
+#endif // TOOLS_HPP
@@ -0,0 +1,491 @@
+#ifndef URING_HPP
+#define URING_HPP
+
+#include <boost/asio.hpp>
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <functional>
+#include <memory>
+#include <vector>
+#include <linux/io_uring.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+using namespace boost;
+
+// An io_uring of one shard, driven through the raw system calls.
+// Completions wake the shard through an eventfd that its io_context waits on, so they run on the
+// shard thread between its other handlers. Submissions are collected and go to the kernel together,
+// in one io_uring_enter once the handlers that are ready have run.
+// Received data lands in a ring of provided buffers that every multishot receive of the shard shares.
+// Only the shard thread touches a Uring after it is opened.
+class Uring
+{
+    public:
+    // something waiting for completions: a multishot operation gets several, the last one without IORING_CQE_F_MORE
+    class Operation
+    {
+        public:
+        virtual void complete(int res, std::uint32_t flags) = 0;
+
+        protected:
+        ~Operation() = default;
+    };
+
+    // an Operation calling a function
+    class Callback : public Operation
+    {
+        private:
+        std::function<void(int,std::uint32_t)> f;
+
+        public:
+        void complete(int res, std::uint32_t flags) override {f(res, flags);}
+
+        Callback(std::function<void(int,std::uint32_t)> fn):f(std::move(fn))
+        {}
+    };
+
+    private:
+    static const std::uint16_t BufferGroup = 0;
+
+    asio::io_context& ctx;
+    int ring_fd = -1, event_fd = -1;
+    asio::posix::stream_descriptor events;
+    std::uint64_t event_count;
+
+    void* sq_map = MAP_FAILED;
+    void* cq_map = MAP_FAILED;
+    std::size_t sq_map_len = 0, cq_map_len = 0;
+    io_uring_sqe* sqes = static_cast<io_uring_sqe*>(MAP_FAILED);
+    std::size_t sqes_len = 0;
+    unsigned *sq_head, *sq_tail, *sq_flags, *sq_array, *cq_head, *cq_tail;
+    io_uring_cqe* cqes;
+    unsigned sq_mask = 0, sq_entries = 0, cq_mask = 0;
+    unsigned sq_local_tail = 0, to_submit = 0;
+    bool submit_posted = false;
+    std::size_t inflight = 0;   // operations that have not had their last completion
+
+    // provided buffers: the kernel takes them from the front of buf_ring, recycled ones go back at the tail.
+    // The entries are reached through a plain array: in C++ the empty struct in front of
+    // io_uring_buf_ring::bufs takes room, and would put them 8 bytes off.
+    io_uring_buf_ring* buf_ring = static_cast<io_uring_buf_ring*>(MAP_FAILED);
+    io_uring_buf* buf_entries = nullptr;
+    char* buffers = static_cast<char*>(MAP_FAILED);
+    std::size_t buf_ring_len = 0, buffers_len = 0;
+    unsigned buf_count = 0, buf_size = 0;
+    std::uint16_t buf_tail = 0;
+
+    std::atomic<std::uint64_t> enters{0}, starved{0};
+
+    static int setup(unsigned entries, io_uring_params* p){return static_cast<int>(::syscall(__NR_io_uring_setup, entries, p));}
+    static int register_ring(int fd, unsigned op, const void* arg, unsigned n){return static_cast<int>(::syscall(__NR_io_uring_register, fd, op, arg, n));}
+
+    int enter(unsigned submit, unsigned min_complete, unsigned flags)
+    {
+        enters.fetch_add(1, std::memory_order_relaxed);
+        return static_cast<int>(::syscall(__NR_io_uring_enter, ring_fd, submit, min_complete, flags, nullptr, 0));
+    }
+
+    template <typename T>
+    static T* at(void* base, std::uint32_t offset){return reinterpret_cast<T*>(static_cast<char*>(base)+offset);}
+
+    io_uring_sqe* get_sqe()
+    {
+        while(sq_local_tail - __atomic_load_n(sq_head, __ATOMIC_ACQUIRE) == sq_entries)submit();
+        unsigned index = sq_local_tail & sq_mask;
+        io_uring_sqe* sqe = &sqes[index];
+        std::memset(sqe, 0, sizeof(*sqe));
+        sq_array[index] = index;
+        sq_local_tail++;
+        to_submit++;
+        if(!submit_posted)
+        {
+            submit_posted = true;
+            asio::post(ctx, [this]{submit_posted = false; submit();});
+        }
+        return sqe;
+    }
+
+    io_uring_sqe* get_sqe(std::uint8_t opcode, int fd, Operation* op)
+    {
+        io_uring_sqe* sqe = get_sqe();
+        sqe->opcode = opcode;
+        sqe->fd = fd;
+        sqe->user_data = reinterpret_cast<std::uint64_t>(op);
+        if(op)inflight++;
+        return sqe;
+    }
+
+    // The eventfd is read rather than waited for: asio re-arms a descriptor for every wait, and it would
+    // be ready again at once as long as the count is not read, while a read that finds nothing
+    // is left waiting without that.
+    void wait_events()
+    {
+        events.async_read_some(asio::buffer(&event_count, sizeof(event_count)), [this](const boost::system::error_code& eno, std::size_t)
+        {
+            if(eno)return;
+            reap();
+            submit();
+            wait_events();
+        });
+    }
+
+    // runs the completions posted so far
+    void reap()
+    {
+        if(__atomic_load_n(sq_flags, __ATOMIC_RELAXED) & IORING_SQ_CQ_OVERFLOW)enter(0, 0, IORING_ENTER_GETEVENTS);
+        unsigned head = *cq_head;
+        while(head != __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE))
+        {
+            io_uring_cqe cqe = cqes[head & cq_mask];
+            __atomic_store_n(cq_head, ++head, __ATOMIC_RELEASE);
+            auto op = reinterpret_cast<Operation*>(cqe.user_data);
+            if(!op)continue;
+            if(!(cqe.flags & IORING_CQE_F_MORE))inflight--;
+            op->complete(cqe.res, cqe.flags);
+        }
+    }
+
+    void close_all()
+    {
+        boost::system::error_code ignored;
+        events.close(ignored);
+        if(ring_fd >= 0)::close(ring_fd);
+        if(buf_ring != MAP_FAILED)::munmap(buf_ring, buf_ring_len);
+        if(buffers != MAP_FAILED)::munmap(buffers, buffers_len);
+        if(sqes != MAP_FAILED)::munmap(sqes, sqes_len);
+        if(cq_map != MAP_FAILED && cq_map != sq_map)::munmap(cq_map, cq_map_len);
+        if(sq_map != MAP_FAILED)::munmap(sq_map, sq_map_len);
+        ring_fd = -1;
+        buf_ring = static_cast<io_uring_buf_ring*>(MAP_FAILED);
+        buffers = static_cast<char*>(MAP_FAILED);
+        sqes = static_cast<io_uring_sqe*>(MAP_FAILED);
+        sq_map = cq_map = MAP_FAILED;
+    }
+
+    public:
+    // Sets the ring up with entries submissions and count provided buffers of size bytes each (count a power of two).
+    // False if the kernel cannot do it all (io_uring disabled, or older than 5.19): nothing is left open then.
+    bool open(unsigned entries, unsigned count, unsigned size)
+    {
+        io_uring_params p;
+        std::memset(&p, 0, sizeof(p));
+        p.flags = IORING_SETUP_CQSIZE;
+        p.cq_entries = 4*entries;   // multishot receives post many completions per submission
+        ring_fd = setup(entries, &p);
+        if(ring_fd < 0)return false;
+
+        sq_map_len = p.sq_off.array + p.sq_entries*sizeof(unsigned);
+        cq_map_len = p.cq_off.cqes + p.cq_entries*sizeof(io_uring_cqe);
+        if(p.features & IORING_FEAT_SINGLE_MMAP)sq_map_len = cq_map_len = std::max(sq_map_len, cq_map_len);
+        sq_map = ::mmap(nullptr, sq_map_len, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, ring_fd, IORING_OFF_SQ_RING);
+        cq_map = sq_map == MAP_FAILED || (p.features & IORING_FEAT_SINGLE_MMAP) ? sq_map :
+            ::mmap(nullptr, cq_map_len, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, ring_fd, IORING_OFF_CQ_RING);
+        sqes_len = p.sq_entries*sizeof(io_uring_sqe);
+        sqes = static_cast<io_uring_sqe*>(::mmap(nullptr, sqes_len, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, ring_fd, IORING_OFF_SQES));
+        if(sq_map == MAP_FAILED || cq_map == MAP_FAILED || sqes == MAP_FAILED)
+        {
+            close_all();
+            return false;
+        }
+        sq_head = at<unsigned>(sq_map, p.sq_off.head);
+        sq_tail = at<unsigned>(sq_map, p.sq_off.tail);
+        sq_flags = at<unsigned>(sq_map, p.sq_off.flags);
+        sq_array = at<unsigned>(sq_map, p.sq_off.array);
+        sq_mask = *at<unsigned>(sq_map, p.sq_off.ring_mask);
+        sq_entries = p.sq_entries;
+        sq_local_tail = *sq_tail;
+        cq_head = at<unsigned>(cq_map, p.cq_off.head);
+        cq_tail = at<unsigned>(cq_map, p.cq_off.tail);
+        cq_mask = *at<unsigned>(cq_map, p.cq_off.ring_mask);
+        cqes = at<io_uring_cqe>(cq_map, p.cq_off.cqes);
+
+        buf_count = count;
+        buf_size = size;
+        buf_ring_len = count*sizeof(io_uring_buf);
+        buffers_len = std::size_t(count)*size;
+        buf_ring = static_cast<io_uring_buf_ring*>(::mmap(nullptr, buf_ring_len, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0));
+        buffers = static_cast<char*>(::mmap(nullptr, buffers_len, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0));
+        io_uring_buf_reg reg;
+        std::memset(&reg, 0, sizeof(reg));
+        reg.ring_addr = reinterpret_cast<std::uint64_t>(buf_ring);
+        reg.ring_entries = count;
+        reg.bgid = BufferGroup;
+        if(buf_ring == MAP_FAILED || buffers == MAP_FAILED || (count & (count-1)) ||
+            register_ring(ring_fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0)
+        {
+            close_all();
+            return false;
+        }
+        buf_entries = reinterpret_cast<io_uring_buf*>(buf_ring);
+        for(unsigned i=0;i<count;i++)recycle(static_cast<std::uint16_t>(i));
+
+        event_fd = ::eventfd(0, EFD_CLOEXEC|EFD_NONBLOCK);
+        if(event_fd < 0 || register_ring(ring_fd, IORING_REGISTER_EVENTFD, &event_fd, 1) < 0)
+        {
+            if(event_fd >= 0)::close(event_fd);
+            close_all();
+            return false;
+        }
+        events.assign(event_fd);
+        wait_events();
+        return true;
+    }
+
+    // hands everything collected so far to the kernel
+    void submit()
+    {
+        if(!to_submit)return;
+        __atomic_store_n(sq_tail, sq_local_tail, __ATOMIC_RELEASE);
+        int n = enter(to_submit, 0, 0);
+        // busy with completions not reaped yet (-EBUSY, -EAGAIN): the next reap submits what is left
+        if(n > 0)to_submit -= std::min<unsigned>(to_submit, n);
+    }
+
+    // Waits until every operation has had its last completion, running them meanwhile.
+    // Used after cancelling everything, with no new operation started by the completions.
+    void settle()
+    {
+        submit();
+        while(inflight)
+        {
+            enter(0, 1, IORING_ENTER_GETEVENTS);
+            reap();
+            submit();
+        }
+    }
+
+    // multishot: the kernel accepts every connection as it comes, a completion for each
+    void accept(int fd, Operation* op, bool multishot = true)
+    {
+        io_uring_sqe* sqe = get_sqe(IORING_OP_ACCEPT, fd, op);
+        if(multishot)sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    }
+
+    // multishot: a completion per chunk received, in a provided buffer given back with recycle
+    void receive(int fd, Operation* op)
+    {
+        io_uring_sqe* sqe = get_sqe(IORING_OP_RECV, fd, op);
+        sqe->ioprio = IORING_RECV_MULTISHOT;
+        sqe->flags = IOSQE_BUFFER_SELECT;
+        sqe->buf_group = BufferGroup;
+    }
+
+    void send(int fd, const msghdr* msg, Operation* op)
+    {
+        io_uring_sqe* sqe = get_sqe(IORING_OP_SENDMSG, fd, op);
+        sqe->addr = reinterpret_cast<std::uint64_t>(msg);
+        sqe->msg_flags = MSG_NOSIGNAL;
+    }
+
+    // every operation on fd completes with -ECANCELED, unless it is done already
+    void cancel(int fd)
+    {
+        io_uring_sqe* sqe = get_sqe(IORING_OP_ASYNC_CANCEL, fd, nullptr);
+        sqe->cancel_flags = IORING_ASYNC_CANCEL_FD | IORING_ASYNC_CANCEL_ALL;
+    }
+
+    // the data of a receive completion
+    const char* buffer(std::uint32_t flags) const {return buffers + std::size_t(flags >> IORING_CQE_BUFFER_SHIFT)*buf_size;}
+
+    void recycle(std::uint32_t flags){recycle(static_cast<std::uint16_t>(flags >> IORING_CQE_BUFFER_SHIFT));}
+
+    void recycle(std::uint16_t bid)
+    {
+        io_uring_buf& b = buf_entries[buf_tail & (buf_count-1)];
+        b.addr = reinterpret_cast<std::uint64_t>(buffers + std::size_t(bid)*buf_size);
+        b.len = buf_size;
+        b.bid = bid;
+        __atomic_store_n(&buf_ring->tail, ++buf_tail, __ATOMIC_RELEASE);
+    }
+
+    // a multishot receive stopped because every buffer was taken
+    void count_starved(){starved.fetch_add(1, std::memory_order_relaxed);}
+
+    // io_uring_enter calls and receives that ran out of buffers so far, for the stats
+    std::uint64_t enter_calls() const {return enters.load(std::memory_order_relaxed);}
+    std::uint64_t starved_receives() const {return starved.load(std::memory_order_relaxed);}
+
+    Uring(asio::io_context& context):ctx(context), events(context)
+    {}
+
+    ~Uring(){close_all();}
+};
+
+// A connected socket whose io goes through a Uring, in the manner of asio's socket: one receive
+// (multishot, so it goes on by itself) and one write at a time. Every operation keeps its owner
+// alive until its handler has run for the last time, and runs on the shard thread.
+template <typename Owner>
+class RingSocket
+{
+    public:
+    using OwnerPtr = std::shared_ptr<Owner>;
+    using receive_handler_t = std::function<void(const OwnerPtr&, const boost::system::error_code&, const char*, std::size_t)>;
+    using write_handler_t = std::function<void(const OwnerPtr&, const boost::system::error_code&, std::size_t)>;
+
+    private:
+    Uring& ring;
+    std::atomic<int> fd{-1};
+    bool stopping = false;  // cancelled: no operation is started again
+
+    static boost::system::error_code error(int res){return boost::system::error_code(-res, asio::error::get_system_category());}
+
+    class Receive : public Uring::Operation
+    {
+        public:
+        RingSocket& sock;
+        OwnerPtr owner;
+        receive_handler_t handler;
+
+        void complete(int res, std::uint32_t flags) override
+        {
+            bool more = flags & IORING_CQE_F_MORE;
+            OwnerPtr self = more ? owner : std::move(owner);
+            if(res > 0)
+            {
+                handler(self, {}, sock.ring.buffer(flags), res);
+                sock.ring.recycle(flags);
+                if(!more && sock.rearm())owner = std::move(self);
+                return;
+            }
+            if(res == -ENOBUFS)
+            {
+                sock.ring.count_starved();
+                if(sock.rearm())
+                {
+                    owner = std::move(self);
+                    return;
+                }
+            }
+            handler(self, res ? error(res) : asio::error::eof, nullptr, 0);
+        }
+
+        Receive(RingSocket& s):sock(s)
+        {}
+    } receive_op{*this};
+
+    class Write : public Uring::Operation
+    {
+        public:
+        RingSocket& sock;
+        OwnerPtr owner;
+        write_handler_t handler;
+        std::vector<iovec> iov;
+        std::size_t next = 0, written = 0;
+        msghdr msg;
+
+        void start()
+        {
+            std::memset(&msg, 0, sizeof(msg));
+            msg.msg_iov = iov.data()+next;
+            msg.msg_iovlen = std::min<std::size_t>(iov.size()-next, IOV_MAX);
+            sock.ring.send(sock.fd, &msg, this);
+        }
+
+        void complete(int res, std::uint32_t) override
+        {
+            OwnerPtr self = std::move(owner);
+            if(res <= 0)
+            {
+                handler(self, res ? error(res) : asio::error::connection_reset, written);
+                return;
+            }
+            written += res;
+            std::size_t n = res;
+            for(;next<iov.size() && n>=iov[next].iov_len;next++)n -= iov[next].iov_len;
+            if(n)
+            {
+                iov[next].iov_base = static_cast<char*>(iov[next].iov_base)+n;
+                iov[next].iov_len -= n;
+            }
+            if(next == iov.size())handler(self, {}, written);
+            else if(sock.stopping || !sock.is_open())handler(self, asio::error::operation_aborted, written);
+            else
+            {
+                owner = std::move(self);
+                start();
+            }
+        }
+
+        Write(RingSocket& s):sock(s)
+        {}
+    } write_op{*this};
+
+    bool rearm()
+    {
+        if(stopping || !is_open())return false;
+        ring.receive(fd, &receive_op);
+        return true;
+    }
+
+    public:
+    bool is_open() const {return fd.load(std::memory_order_relaxed) >= 0;}
+    int native_handle() const {return fd.load(std::memory_order_relaxed);}
+    void assign(int new_fd){fd = new_fd;}
+
+    // handler gets every chunk as it arrives, then an error (eof included) once receiving stopped
+    void async_receive(OwnerPtr owner, receive_handler_t handler)
+    {
+        stopping = false;
+        receive_op.owner = std::move(owner);
+        receive_op.handler = std::move(handler);
+        ring.receive(fd, &receive_op);
+    }
+
+    // writes all of bufs, then calls handler with how much was written
+    template <typename Buffers>
+    void async_write(OwnerPtr owner, const Buffers& bufs, write_handler_t handler)
+    {
+        stopping = false;
+        write_op.iov.clear();
+        for(const auto& b:bufs)
+            write_op.iov.push_back({const_cast<void*>(b.data()), b.size()});
+        write_op.next = write_op.written = 0;
+        write_op.owner = std::move(owner);
+        write_op.handler = std::move(handler);
+        write_op.start();
+    }
+
+    // what is in flight completes with operation_aborted
+    void cancel()
+    {
+        stopping = true;
+        if(is_open())ring.cancel(fd);
+    }
+
+    // The kernel holds on to the socket while an operation is in flight: shutting it down
+    // is what makes them complete.
+    void close()
+    {
+        int old = fd.exchange(-1);
+        if(old < 0)return;
+        ::shutdown(old, SHUT_RDWR);
+        ::close(old);
+    }
+
+    // forgets the socket without shutting it down or closing it
+    void release(){fd = -1;}
+
+    // the peer's address, unspecified if the socket is closed
+    asio::ip::tcp::endpoint remote_endpoint() const
+    {
+        asio::ip::tcp::endpoint ep;
+        socklen_t len = static_cast<socklen_t>(ep.capacity());
+        if(::getpeername(native_handle(), ep.data(), &len) == 0)ep.resize(len);
+        return ep;
+    }
+
+    RingSocket(Uring& r):ring(r)
+    {}
+
+    ~RingSocket(){close();}
+};
+
+#endif // URING_HPP
@@ -0,0 +1,101 @@
+#ifndef WIRE_HPP
+#define WIRE_HPP
+
+#include <boost/asio.hpp>
+#include <cstring>
+#include <string>
+#include <string_view>
+#include "protocol.h"
+#include "codec.hpp"
+#include "messages.hpp"
+
+// The client side of the wire format: encoding Client_to_Server messages and decoding
+// Server_to_Client headers, in the protocol version of the connection (see protocol.h).
+// Shared by the interactive client and the benchmark.
+namespace Wire
+{
+    using request_header_t = Protocol::Message::Client_to_Server::header_t;
+    using reply_header_t = Protocol::Message::Server_to_Client::header_t;
+
+    const std::size_t header_length = Messages::header_length;
+    const std::size_t max_header_length_v2 = Messages::max_header_length_v2;
+    const std::size_t max_request_length = max_header_length_v2 + Protocol::BodyMaxLength;
+
+    // The Encode overloads write a whole message to out, which must hold max_request_length bytes,
+    // and return its length, 0 if the body is too long.
+    inline std::size_t Encode(std::uint32_t version, char* out, request_header_t::type_t type, const char* body, std::size_t body_len)
+    {
+        if(body_len > Protocol::BodyMaxLength)return 0;
+        std::size_t n = Codec::encode(version, request_header_t{type, static_cast<std::uint32_t>(body_len)}, out);
+        if(body_len)std::memcpy(out+n, body, body_len);
+        return n+body_len;
+    }
+
+    inline std::size_t Encode(std::uint32_t version, char* out, request_header_t::type_t type)
+    {
+        return Encode(version, out, type, nullptr, 0);
+    }
+
+    // a string is sent with '\0' in v1
+    inline std::size_t Encode(std::uint32_t version, char* out, request_header_t::type_t type, const std::string& str)
+    {
+        return Encode(version, out, type, str.c_str(), version==1 ? str.size()+1 : str.size());
+    }
+
+    // a message of messages.hpp
+    template <typename M>
+    inline std::size_t Encode(std::uint32_t version, char* out, const M& msg)
+    {
+        return Messages::Encode(version, msg, out);
+    }
+
+    // The header of the message at in (n bytes): returns its length,
+    // 0 if more bytes are needed, -1 if it is not a header.
+    inline int DecodeHeader(std::uint32_t version, const char* in, std::size_t n, reply_header_t& header)
+    {
+        std::size_t len = Codec::decode(version, in, n, header);
+        if(len)return static_cast<int>(len);
+        return version != 1 && !Codec::varint_viable<reply_header_t>(in, n) ? -1 : 0;
+    }
+
+    // the largest body a reply may have
+    inline std::size_t MaxBodyLength(const reply_header_t& header)
+    {
+        return header.type==reply_header_t::batch ? Protocol::BatchMaxLength : Protocol::BodyMaxLength;
+    }
+
+    // The fixed part of a reply body (messages.hpp), which moves past it; false if the body is too short.
+    template <typename M>
+    inline bool Read(std::uint32_t version, const char*& body, std::size_t& len, M& msg)
+    {
+        std::size_t n = Codec::decode(version, body, len, msg);
+        body += n;
+        len -= n;
+        return n != 0;
+    }
+
+    // the text of a print or a listing: v1 sends it with '\0'
+    inline std::string_view Text(const char* body, std::size_t len)
+    {
+        return std::string_view(body, strnlen(body, len));
+    }
+
+    // calls f(header, body) for every message of a batch; false if it is malformed
+    template <typename F>
+    bool ForEachInBatch(const char* body, std::size_t len, F f)
+    {
+        const char* end = body+len;
+        while(body != end)
+        {
+            reply_header_t header;
+            int n = DecodeHeader(2, body, end-body, header);
+            if(n <= 0 || header.type==reply_header_t::batch || header.body_len > static_cast<std::size_t>(end-body-n))return false;
+            body += n;
+            f(header, body);
+            body += header.body_len;
+        }
+        return true;
+    }
+}
+
+#endif // WIRE_HPP